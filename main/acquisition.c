@@ -0,0 +1,533 @@
+/* MIT License
+*
+* Copyright (c) 2022 ma-lwa-re
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "acquisition.h"
+
+static const char *ACQUISITION_TAG = "acquisition";
+
+uint8_t acquisition_crc(const uint8_t *data, uint8_t size) {
+    uint8_t crc = ACQUISITION_CRC8_INIT;
+
+    for(uint8_t i = 0; i < size; i++) {
+        crc ^= data[i];
+
+        for(uint8_t bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x80) ? (crc << 1) ^ ACQUISITION_CRC8_POLYNOMIAL : crc << 1;
+        }
+    }
+    return crc;
+}
+
+static esp_err_t acquisition_command(acquisition_t *acquisition, uint16_t command) {
+    uint8_t data[] = {command >> 8, command & 0xFF};
+
+    return i2c_master_write_to_device(acquisition->port, ACQUISITION_ADDRESS, data, sizeof(data),
+                                      pdMS_TO_TICKS(ACQUISITION_I2C_TIMEOUT_MS));
+}
+
+static esp_err_t acquisition_write(acquisition_t *acquisition, uint16_t command, uint16_t word) {
+    uint8_t data[] = {command >> 8, command & 0xFF, word >> 8, word & 0xFF, 0x00};
+    data[4] = acquisition_crc(&data[2], 2);
+
+    return i2c_master_write_to_device(acquisition->port, ACQUISITION_ADDRESS, data, sizeof(data),
+                                      pdMS_TO_TICKS(ACQUISITION_I2C_TIMEOUT_MS));
+}
+
+static esp_err_t acquisition_receive(acquisition_t *acquisition, uint16_t *words, uint8_t count) {
+    uint8_t data[ACQUISITION_MEASUREMENT_WORDS * ACQUISITION_WORD_SIZE];
+    esp_err_t err = i2c_master_read_from_device(acquisition->port, ACQUISITION_ADDRESS, data,
+                                                count * ACQUISITION_WORD_SIZE,
+                                                pdMS_TO_TICKS(ACQUISITION_I2C_TIMEOUT_MS));
+
+    if(err != ESP_OK) {
+        return err;
+    }
+
+    for(uint8_t i = 0; i < count; i++) {
+        uint8_t *word = &data[i * ACQUISITION_WORD_SIZE];
+
+        if(acquisition_crc(word, 2) != word[2]) {
+            return ESP_ERR_INVALID_CRC;
+        }
+        words[i] = (word[0] << 8) | word[1];
+    }
+    return ESP_OK;
+}
+
+// The SCD4x needs a millisecond between the command and the read, the bus is free meanwhile
+static esp_err_t acquisition_read(acquisition_t *acquisition, uint16_t command, uint16_t *words, uint8_t count) {
+    esp_err_t err = acquisition_command(acquisition, command);
+
+    if(err != ESP_OK) {
+        return err;
+    }
+    vTaskDelay(1);
+    return acquisition_receive(acquisition, words, count);
+}
+
+static uint32_t acquisition_interval(acquisition_t *acquisition) {
+
+    switch(acquisition->mode) {
+        case ACQUISITION_LOW_POWER:
+            return ACQUISITION_LOW_POWER_MS;
+        case ACQUISITION_SINGLE_SHOT:
+            return ACQUISITION_SINGLE_SHOT_MS;
+        default:
+            return ACQUISITION_PERIODIC_MS;
+    }
+}
+
+static void acquisition_clear(acquisition_t *acquisition) {
+    acquisition->samples = 0;
+    acquisition->co2_sum = 0;
+    acquisition->temperature_sum = 0.0;
+    acquisition->humidity_sum = 0.0;
+}
+
+// Drops the samples of the current reading and stops the sensor before starting over
+static acquisition_result_t acquisition_fail(acquisition_t *acquisition, int64_t now, const char *step,
+                                             esp_err_t err) {
+    ESP_LOGE(ACQUISITION_TAG, "SCD4x %s error (0x%x), retrying", step, err);
+    acquisition_clear(acquisition);
+    acquisition->failures = 0;
+    acquisition->state = ACQUISITION_STOP;
+    acquisition->next_time = now + ACQUISITION_RETRY_MS * 1000LL;
+    return ACQUISITION_ERROR;
+}
+
+// A glitch only costs the exchange, the sensor keeps measuring and the samples are kept
+// for the next poll, a sensor that fails over and over is stopped and started again
+static acquisition_result_t acquisition_retry(acquisition_t *acquisition, int64_t now, const char *step,
+                                              esp_err_t err) {
+
+    if(++acquisition->failures >= ACQUISITION_MAX_FAILURES) {
+        return acquisition_fail(acquisition, now, step, err);
+    }
+    ESP_LOGW(ACQUISITION_TAG, "SCD4x %s error (0x%x), polling again", step, err);
+    acquisition->next_time = now + ACQUISITION_POLL_MS * 1000LL;
+    return ACQUISITION_ERROR;
+}
+
+// The EEPROM of the SCD4x is only good for about 2000 writes, settings go there once per change
+static esp_err_t acquisition_persist(acquisition_t *acquisition, int64_t now) {
+
+    if(!acquisition->changed) {
+        return ESP_OK;
+    }
+    esp_err_t err = acquisition_command(acquisition, SCD4X_COMMAND_PERSIST_SETTINGS);
+
+    if(err == ESP_OK) {
+        ESP_LOGW(ACQUISITION_TAG, "SCD4x settings written to EEPROM");
+        acquisition->changed = false;
+        acquisition->calibration.persists++;
+        acquisition->next_time = now + ACQUISITION_PERSIST_MS * 1000LL;
+    }
+    return err;
+}
+
+// Reads the settings once and rewrites only the ones that differ by more than a step from the configuration
+static esp_err_t acquisition_check(acquisition_t *acquisition, int64_t now, bool *done) {
+    acquisition_calibration_t *calibration = &acquisition->calibration;
+    uint16_t offset = lroundf(SENSORS_TEMPERATURE_OFFSET * ACQUISITION_OFFSET_SCALE);
+    uint16_t words[ACQUISITION_MEASUREMENT_WORDS];
+    esp_err_t err = ESP_OK;
+
+    switch(acquisition->phase++) {
+        case 0:
+            err = acquisition_read(acquisition, SCD4X_COMMAND_GET_SERIAL_NUMBER, words, 3);
+
+            if(err == ESP_OK) {
+                calibration->serial_number = ((uint64_t) words[0] << 32) | ((uint64_t) words[1] << 16) | words[2];
+                ESP_LOGI(ACQUISITION_TAG, "Sensor serial number 0x%012llX",
+                         (unsigned long long) calibration->serial_number);
+            }
+            break;
+        case 1:
+            err = acquisition_read(acquisition, SCD4X_COMMAND_GET_TEMPERATURE_OFFSET, words, 1);
+
+            if(err == ESP_OK) {
+                calibration->temperature_offset = words[0] / ACQUISITION_OFFSET_SCALE;
+                acquisition->phase += abs(words[0] - offset) <= 1;
+            }
+            break;
+        case 2:
+            ESP_LOGW(ACQUISITION_TAG, "Temperature offset calibration from %.2f °C to %.2f °C",
+                     calibration->temperature_offset, SENSORS_TEMPERATURE_OFFSET);
+            err = acquisition_write(acquisition, SCD4X_COMMAND_SET_TEMPERATURE_OFFSET, offset);
+
+            if(err == ESP_OK) {
+                calibration->temperature_offset = offset / ACQUISITION_OFFSET_SCALE;
+                acquisition->changed = true;
+            }
+            break;
+        case 3:
+            err = acquisition_read(acquisition, SCD4X_COMMAND_GET_SENSOR_ALTITUDE, words, 1);
+
+            if(err == ESP_OK) {
+                calibration->sensor_altitude = words[0];
+                acquisition->phase += words[0] == SENSORS_SENSOR_ALTITUDE;
+            }
+            break;
+        case 4:
+            ESP_LOGW(ACQUISITION_TAG, "Sensor altitude calibration from %d m to %d m",
+                     calibration->sensor_altitude, SENSORS_SENSOR_ALTITUDE);
+            err = acquisition_write(acquisition, SCD4X_COMMAND_SET_SENSOR_ALTITUDE, SENSORS_SENSOR_ALTITUDE);
+
+            if(err == ESP_OK) {
+                calibration->sensor_altitude = SENSORS_SENSOR_ALTITUDE;
+                acquisition->changed = true;
+            }
+            break;
+        case 5:
+            err = acquisition_read(acquisition, SCD4X_COMMAND_GET_ASC_ENABLED, words, 1);
+            calibration->asc_enabled = err == ESP_OK ? words[0] != 0 : calibration->asc_enabled;
+            break;
+        case 6:
+            err = acquisition_persist(acquisition, now);
+            break;
+        default:
+            ESP_LOGI(ACQUISITION_TAG, "Temperature offset %.2f °C - Sensor altitude %d m - ASC %s",
+                     calibration->temperature_offset, calibration->sensor_altitude,
+                     calibration->asc_enabled ? "on" : "off");
+            *done = true;
+            break;
+    }
+    return err;
+}
+
+// The reference has to be the air the sensor measured for the last 3 minutes, ideally outdoors
+static esp_err_t acquisition_recalibrate(acquisition_t *acquisition, int64_t now, bool *done) {
+    acquisition_calibration_t *calibration = &acquisition->calibration;
+    uint16_t words[1];
+    esp_err_t err = ESP_OK;
+
+    switch(acquisition->phase++) {
+        case 0:
+            err = acquisition_write(acquisition, SCD4X_COMMAND_FORCED_RECALIBRATION, calibration->argument);
+            acquisition->next_time = now + ACQUISITION_RECALIBRATION_MS * 1000LL;
+            break;
+        default:
+            err = acquisition_receive(acquisition, words, 1);
+
+            if(err == ESP_OK && words[0] == ACQUISITION_RECALIBRATION_FAILED) {
+                ESP_LOGE(ACQUISITION_TAG, "Forced recalibration to %d ppm failed", calibration->argument);
+                calibration->status = ACQUISITION_STATUS_FAILED;
+            } else if(err == ESP_OK) {
+                calibration->correction = words[0] - ACQUISITION_RECALIBRATION_ZERO;
+                ESP_LOGW(ACQUISITION_TAG, "Forced recalibration to %d ppm corrected by %d ppm",
+                         calibration->argument, calibration->correction);
+            }
+            *done = true;
+            break;
+    }
+    return err;
+}
+
+static esp_err_t acquisition_asc(acquisition_t *acquisition, int64_t now, bool *done) {
+    acquisition_calibration_t *calibration = &acquisition->calibration;
+    esp_err_t err = ESP_OK;
+
+    switch(acquisition->phase++) {
+        case 0:
+
+            if(calibration->asc_enabled == calibration->argument) {
+                *done = true;
+                break;
+            }
+            err = acquisition_write(acquisition, SCD4X_COMMAND_SET_ASC_ENABLED, calibration->argument);
+
+            if(err == ESP_OK) {
+                calibration->asc_enabled = calibration->argument;
+                acquisition->changed = true;
+                ESP_LOGW(ACQUISITION_TAG, "Automatic self calibration %s", calibration->asc_enabled ? "on" : "off");
+            }
+            break;
+        case 1:
+            err = acquisition_persist(acquisition, now);
+            break;
+        default:
+            *done = true;
+            break;
+    }
+    return err;
+}
+
+static esp_err_t acquisition_self_test(acquisition_t *acquisition, int64_t now, bool *done) {
+    acquisition_calibration_t *calibration = &acquisition->calibration;
+    uint16_t words[1];
+    esp_err_t err = ESP_OK;
+
+    switch(acquisition->phase++) {
+        case 0:
+            err = acquisition_command(acquisition, SCD4X_COMMAND_PERFORM_SELF_TEST);
+            acquisition->next_time = now + ACQUISITION_SELF_TEST_MS * 1000LL;
+            break;
+        default:
+            err = acquisition_receive(acquisition, words, 1);
+
+            if(err == ESP_OK && words[0] != 0) {
+                ESP_LOGE(ACQUISITION_TAG, "SCD4x self test failed (0x%04x)", words[0]);
+                calibration->status = ACQUISITION_STATUS_FAILED;
+            } else if(err == ESP_OK) {
+                ESP_LOGI(ACQUISITION_TAG, "SCD4x self test passed");
+            }
+            calibration->self_test = err == ESP_OK ? words[0] : calibration->self_test;
+            *done = true;
+            break;
+    }
+    return err;
+}
+
+// Takes the pending request once the sensor is idle, a recalibration needs it measuring long enough before
+static bool acquisition_begin(acquisition_t *acquisition, int64_t now) {
+    acquisition_calibration_t *calibration = &acquisition->calibration;
+
+    calibration->step = acquisition->request;
+    calibration->argument = acquisition->request_argument;
+    calibration->status = ACQUISITION_STATUS_RUNNING;
+    calibration->version++;
+    acquisition->request = ACQUISITION_STEP_NONE;
+    acquisition->phase = 0;
+
+    if(calibration->step == ACQUISITION_STEP_RECALIBRATION && (acquisition->measuring_since == 0 ||
+       now - acquisition->measuring_since < ACQUISITION_RECALIBRATION_WARMUP_MS * 1000LL)) {
+        ESP_LOGE(ACQUISITION_TAG, "Forced recalibration needs %d s of continuous measurement first",
+                 ACQUISITION_RECALIBRATION_WARMUP_MS / 1000);
+        calibration->status = ACQUISITION_STATUS_FAILED;
+        calibration->step_time = now;
+        return false;
+    }
+    return true;
+}
+
+// One exchange per call like the measurements, phase walks through the commands of the step
+static acquisition_result_t acquisition_calibrate(acquisition_t *acquisition, int64_t now) {
+    acquisition_calibration_t *calibration = &acquisition->calibration;
+    bool done = false;
+    esp_err_t err;
+
+    acquisition->next_time = now + ACQUISITION_COMMAND_MS * 1000LL;
+
+    switch(calibration->step) {
+        case ACQUISITION_STEP_CHECK:
+            err = acquisition_check(acquisition, now, &done);
+            break;
+        case ACQUISITION_STEP_RECALIBRATION:
+            err = acquisition_recalibrate(acquisition, now, &done);
+            break;
+        case ACQUISITION_STEP_ASC:
+            err = acquisition_asc(acquisition, now, &done);
+            break;
+        case ACQUISITION_STEP_SELF_TEST:
+            err = acquisition_self_test(acquisition, now, &done);
+            break;
+        default:
+            err = ESP_OK;
+            done = true;
+            break;
+    }
+
+    // The check is tried again after the retry delay, the requests are left for the API to send again
+    if(err != ESP_OK) {
+        calibration->status = ACQUISITION_STATUS_FAILED;
+        calibration->step_time = now;
+        calibration->version++;
+        acquisition->request = calibration->step == ACQUISITION_STEP_CHECK ? ACQUISITION_STEP_CHECK
+                                                                          : ACQUISITION_STEP_NONE;
+        return acquisition_fail(acquisition, now, "calibration", err);
+    }
+
+    if(done) {
+        calibration->status = calibration->status == ACQUISITION_STATUS_RUNNING ? ACQUISITION_STATUS_DONE
+                                                                                : calibration->status;
+        calibration->checked = calibration->checked || calibration->step == ACQUISITION_STEP_CHECK;
+        calibration->step_time = now;
+        calibration->version++;
+        acquisition->state = ACQUISITION_START;
+    }
+    return ACQUISITION_NONE;
+}
+
+void acquisition_init(acquisition_t *acquisition, i2c_port_t port, acquisition_mode_t mode) {
+    memset(acquisition, 0x00, sizeof(*acquisition));
+    acquisition->port = port;
+    acquisition->mode = mode;
+    acquisition->state = ACQUISITION_STOP;
+    acquisition->request = ACQUISITION_STEP_CHECK;
+    acquisition->calibration.step = ACQUISITION_STEP_CHECK;
+    acquisition->calibration.status = ACQUISITION_STATUS_PENDING;
+}
+
+bool acquisition_request(acquisition_t *acquisition, acquisition_step_t step, uint16_t argument, int64_t now) {
+
+    if(acquisition->request != ACQUISITION_STEP_NONE || acquisition->state == ACQUISITION_CALIBRATE ||
+       step == ACQUISITION_STEP_NONE || step == ACQUISITION_STEP_CHECK) {
+        return false;
+    }
+    argument = step == ACQUISITION_STEP_ASC ? argument != 0 : argument;
+    acquisition->request = step;
+    acquisition->request_argument = argument;
+    acquisition->calibration.step = step;
+    acquisition->calibration.argument = argument;
+    acquisition->calibration.status = ACQUISITION_STATUS_PENDING;
+    acquisition->calibration.version++;
+
+    // A measuring sensor takes the stop at any time and an idle one needs nothing, only a
+    // single shot in progress, a stop or a start still has to run its course
+    bool busy = acquisition->mode == ACQUISITION_SINGLE_SHOT ? acquisition->state != ACQUISITION_START :
+                                                               acquisition->state != ACQUISITION_WAIT;
+
+    if(!busy && acquisition->next_time > now) {
+        acquisition->next_time = now;
+    }
+    return true;
+}
+
+acquisition_result_t acquisition_run(acquisition_t *acquisition, int64_t now, acquisition_sample_t *sample) {
+    uint16_t words[ACQUISITION_MEASUREMENT_WORDS];
+    uint32_t interval = acquisition_interval(acquisition);
+    esp_err_t err;
+
+    switch(acquisition->state) {
+        case ACQUISITION_STOP:
+            // A reboot can leave the sensor measuring, it then refuses anything but a stop.
+            // An idle sensor does not acknowledge the stop, which is fine.
+            acquisition_command(acquisition, SCD4X_COMMAND_STOP_PERIODIC);
+            acquisition->state = ACQUISITION_START;
+            acquisition->next_time = now + ACQUISITION_STOP_MS * 1000LL;
+
+            if(acquisition->request != ACQUISITION_STEP_NONE && acquisition_begin(acquisition, now)) {
+                acquisition->state = ACQUISITION_CALIBRATE;
+            }
+            acquisition->measuring_since = 0;
+            return ACQUISITION_NONE;
+
+        case ACQUISITION_CALIBRATE:
+            return acquisition_calibrate(acquisition, now);
+
+        case ACQUISITION_START:
+
+            // Single shots leave the sensor idle between readings, nothing to stop first
+            if(acquisition->request != ACQUISITION_STEP_NONE && acquisition->mode == ACQUISITION_SINGLE_SHOT) {
+                acquisition->state = acquisition_begin(acquisition, now) ? ACQUISITION_CALIBRATE : ACQUISITION_START;
+                acquisition->next_time = now;
+                return ACQUISITION_NONE;
+            }
+
+            if(acquisition->mode == ACQUISITION_SINGLE_SHOT) {
+                err = acquisition_command(acquisition, SCD4X_COMMAND_MEASURE_SINGLE_SHOT);
+            } else {
+                err = acquisition_command(acquisition, acquisition->mode == ACQUISITION_LOW_POWER ?
+                                          SCD4X_COMMAND_START_LOW_POWER : SCD4X_COMMAND_START_PERIODIC);
+                acquisition->discard = ACQUISITION_DISCARD;
+            }
+
+            if(err != ESP_OK) {
+                return acquisition_fail(acquisition, now, "start", err);
+            }
+            acquisition->measuring_since = acquisition->mode == ACQUISITION_SINGLE_SHOT ? 0 : now;
+
+            if(acquisition->samples == 0) {
+                acquisition->cycle_start = now;
+            }
+            // A single shot keeps the sensor busy for its whole duration, it would not acknowledge a poll
+            acquisition->state = ACQUISITION_WAIT;
+            acquisition->wait_start = now;
+            acquisition->next_time = now + (interval - (acquisition->mode == ACQUISITION_SINGLE_SHOT ?
+                                                        0 : ACQUISITION_EARLY_MS)) * 1000LL;
+            return ACQUISITION_NONE;
+
+        case ACQUISITION_WAIT:
+
+            // The samples taken so far are kept, the reading goes on once the sensor measures again
+            if(acquisition->request != ACQUISITION_STEP_NONE && acquisition->mode != ACQUISITION_SINGLE_SHOT) {
+                acquisition->state = ACQUISITION_STOP;
+                acquisition->next_time = now;
+                return ACQUISITION_NONE;
+            }
+            err = acquisition_read(acquisition, SCD4X_COMMAND_GET_DATA_READY, words, 1);
+
+            if(err != ESP_OK) {
+                return acquisition_retry(acquisition, now, "data ready", err);
+            }
+            acquisition->failures = 0;
+
+            if((words[0] & ACQUISITION_DATA_READY_MASK) == 0) {
+
+                if(now - acquisition->wait_start > interval * ACQUISITION_TIMEOUT_FACTOR * 1000LL) {
+                    return acquisition_fail(acquisition, now, "measurement timeout", ESP_ERR_TIMEOUT);
+                }
+                acquisition->next_time = now + ACQUISITION_POLL_MS * 1000LL;
+                return ACQUISITION_NONE;
+            }
+            err = acquisition_read(acquisition, SCD4X_COMMAND_READ_MEASUREMENT, words, ACQUISITION_MEASUREMENT_WORDS);
+
+            if(err != ESP_OK) {
+                return acquisition_retry(acquisition, now, "read measurement", err);
+            }
+
+            // The next periodic sample is due one interval after this one became ready
+            acquisition->wait_start = now;
+            acquisition->next_time = now + (interval - ACQUISITION_EARLY_MS) * 1000LL;
+
+            if(acquisition->mode == ACQUISITION_SINGLE_SHOT) {
+                acquisition->state = ACQUISITION_START;
+                acquisition->next_time = now;
+            }
+
+            // The first samples after a start are less accurate
+            if(acquisition->discard > 0) {
+                acquisition->discard--;
+                return ACQUISITION_NONE;
+            }
+
+            acquisition->co2_sum += words[0];
+            acquisition->temperature_sum += -45.0 + (175.0 * words[1]) / 65535.0;
+            acquisition->humidity_sum += (100.0 * words[2]) / 65535.0;
+            ESP_LOGD(ACQUISITION_TAG, "CO₂ %4d ppm - Temperature %2.1f °C - Humidity %2.1f%%", words[0],
+                     -45.0 + (175.0 * words[1]) / 65535.0, (100.0 * words[2]) / 65535.0);
+
+            if(++acquisition->samples < SENSORS_SAMPLES) {
+                return ACQUISITION_NONE;
+            }
+
+            sample->co2 = acquisition->co2_sum / acquisition->samples;
+            sample->temperature = acquisition->temperature_sum / acquisition->samples;
+            sample->humidity = acquisition->humidity_sum / acquisition->samples;
+            sample->samples = acquisition->samples;
+            acquisition_clear(acquisition);
+
+            // Single shots leave the sensor idle until the next reading is due
+            if(acquisition->mode == ACQUISITION_SINGLE_SHOT) {
+                acquisition->next_time = acquisition->cycle_start + SENSORS_SINGLE_SHOT_INTERVAL * 1000000LL;
+                acquisition->next_time = acquisition->next_time > now ? acquisition->next_time : now;
+            }
+            return ACQUISITION_READING;
+    }
+    return ACQUISITION_NONE;
+}
@@ -0,0 +1,166 @@
+/* MIT License
+*
+* Copyright (c) 2022 ma-lwa-re
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "driver/i2c.h"
+
+#define ACQUISITION_ADDRESS                 (0x62)
+#define SCD4X_COMMAND_START_PERIODIC        (0x21B1)
+#define SCD4X_COMMAND_START_LOW_POWER       (0x21AC)
+#define SCD4X_COMMAND_STOP_PERIODIC         (0x3F86)
+#define SCD4X_COMMAND_READ_MEASUREMENT      (0xEC05)
+#define SCD4X_COMMAND_GET_DATA_READY        (0xE4B8)
+#define SCD4X_COMMAND_MEASURE_SINGLE_SHOT   (0x219D)
+#define SCD4X_COMMAND_GET_SERIAL_NUMBER     (0x3682)
+#define SCD4X_COMMAND_GET_TEMPERATURE_OFFSET (0x2318)
+#define SCD4X_COMMAND_SET_TEMPERATURE_OFFSET (0x241D)
+#define SCD4X_COMMAND_GET_SENSOR_ALTITUDE   (0x2322)
+#define SCD4X_COMMAND_SET_SENSOR_ALTITUDE   (0x2427)
+#define SCD4X_COMMAND_GET_ASC_ENABLED       (0x2313)
+#define SCD4X_COMMAND_SET_ASC_ENABLED       (0x2416)
+#define SCD4X_COMMAND_PERSIST_SETTINGS      (0x3615)
+#define SCD4X_COMMAND_FORCED_RECALIBRATION  (0x362F)
+#define SCD4X_COMMAND_PERFORM_SELF_TEST     (0x3639)
+#define ACQUISITION_DATA_READY_MASK         (0x07FF)
+#define ACQUISITION_CRC8_POLYNOMIAL         (0x31)
+#define ACQUISITION_CRC8_INIT               (0xFF)
+#define ACQUISITION_WORD_SIZE               (3)
+#define ACQUISITION_MEASUREMENT_WORDS       (3)
+#define ACQUISITION_I2C_TIMEOUT_MS          (50)
+#define ACQUISITION_STOP_MS                 (500)
+#define ACQUISITION_PERIODIC_MS             (5000)
+#define ACQUISITION_LOW_POWER_MS            (30000)
+#define ACQUISITION_SINGLE_SHOT_MS          (5000)
+#define ACQUISITION_POLL_MS                 (100)
+#define ACQUISITION_EARLY_MS                (50)
+#define ACQUISITION_TIMEOUT_FACTOR          (3)
+#define ACQUISITION_RETRY_MS                (5000)
+#define ACQUISITION_MAX_FAILURES            (3)
+#define ACQUISITION_DISCARD                 (2)
+#define ACQUISITION_COMMAND_MS              (1)
+#define ACQUISITION_PERSIST_MS              (800)
+#define ACQUISITION_RECALIBRATION_MS        (400)
+#define ACQUISITION_SELF_TEST_MS            (10000)
+#define ACQUISITION_RECALIBRATION_WARMUP_MS (180000)
+#define ACQUISITION_RECALIBRATION_FAILED    (0xFFFF)
+#define ACQUISITION_RECALIBRATION_ZERO      (0x8000)
+#define ACQUISITION_OFFSET_SCALE            (65536.0 / 175.0)
+
+#ifndef SENSORS_TEMPERATURE_OFFSET
+#define SENSORS_TEMPERATURE_OFFSET          (4.0)
+#endif
+
+#ifndef SENSORS_SENSOR_ALTITUDE
+#define SENSORS_SENSOR_ALTITUDE             (0)
+#endif
+
+#ifndef SENSORS_SAMPLES
+#define SENSORS_SAMPLES                     (5)
+#endif
+
+#ifndef SENSORS_SINGLE_SHOT_INTERVAL
+#define SENSORS_SINGLE_SHOT_INTERVAL        (300)
+#endif
+
+#if defined(SENSORS_MODE_LOW_POWER)
+#define ACQUISITION_MODE                    (ACQUISITION_LOW_POWER)
+#elif defined(SENSORS_MODE_SINGLE_SHOT)
+#define ACQUISITION_MODE                    (ACQUISITION_SINGLE_SHOT)
+#else
+#define ACQUISITION_MODE                    (ACQUISITION_PERIODIC)
+#endif
+
+typedef enum acquisition_mode {ACQUISITION_PERIODIC, ACQUISITION_LOW_POWER,
+                               ACQUISITION_SINGLE_SHOT} acquisition_mode_t;
+
+typedef enum acquisition_state {ACQUISITION_STOP, ACQUISITION_CALIBRATE, ACQUISITION_START,
+                                ACQUISITION_WAIT} acquisition_state_t;
+
+typedef enum acquisition_result {ACQUISITION_NONE, ACQUISITION_READING,
+                                 ACQUISITION_ERROR} acquisition_result_t;
+
+// Steps of the calibration, the configuration check runs once after boot, the others on request
+typedef enum acquisition_step {ACQUISITION_STEP_NONE, ACQUISITION_STEP_CHECK, ACQUISITION_STEP_RECALIBRATION,
+                               ACQUISITION_STEP_ASC, ACQUISITION_STEP_SELF_TEST} acquisition_step_t;
+
+typedef enum acquisition_status {ACQUISITION_STATUS_IDLE, ACQUISITION_STATUS_PENDING, ACQUISITION_STATUS_RUNNING,
+                                 ACQUISITION_STATUS_DONE, ACQUISITION_STATUS_FAILED} acquisition_status_t;
+
+// What the firmware knows of the sensor settings, read once and kept so nothing waits on the
+// sensor to show them. version moves on every change, persists counts the EEPROM writes since boot
+typedef struct acquisition_calibration {
+    uint32_t version;
+    bool checked;
+    uint64_t serial_number;
+    float temperature_offset;
+    uint16_t sensor_altitude;
+    bool asc_enabled;
+    uint32_t persists;
+    acquisition_step_t step;
+    acquisition_status_t status;
+    uint16_t argument;
+    int16_t correction;
+    uint16_t self_test;
+    int64_t step_time;
+} acquisition_calibration_t;
+
+typedef struct acquisition_sample {
+    uint16_t co2;
+    float temperature;
+    float humidity;
+    uint8_t samples;
+} acquisition_sample_t;
+
+// Drives the SCD4x without ever sleeping while it owns the bus, every call makes at most
+// one short exchange and sets next_time to when the sensor should be asked again
+typedef struct acquisition {
+    i2c_port_t port;
+    acquisition_mode_t mode;
+    acquisition_state_t state;
+    int64_t next_time;
+    int64_t wait_start;
+    int64_t cycle_start;
+    int64_t measuring_since;
+    uint8_t phase;
+    bool changed;
+    acquisition_step_t request;
+    uint16_t request_argument;
+    uint8_t discard;
+    uint8_t failures;
+    uint8_t samples;
+    uint32_t co2_sum;
+    float temperature_sum;
+    float humidity_sum;
+    acquisition_calibration_t calibration;
+} acquisition_t;
+
+uint8_t acquisition_crc(const uint8_t *data, uint8_t size);
+
+void acquisition_init(acquisition_t *acquisition, i2c_port_t port, acquisition_mode_t mode);
+
+// Queues a forced recalibration to argument ppm, an ASC change or a self test, the next run is
+// brought forward when the sensor can be stopped for it right away and measures again once it is done
+bool acquisition_request(acquisition_t *acquisition, acquisition_step_t step, uint16_t argument, int64_t now);
+
+acquisition_result_t acquisition_run(acquisition_t *acquisition, int64_t now, acquisition_sample_t *sample);
@@ -0,0 +1,691 @@
+/* MIT License
+*
+* Copyright (c) 2022 ma-lwa-re
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "api.h"
+#include "dreamdesk.h"
+#include "presets.h"
+#include "metrics.h"
+
+#if defined(SENSORS_ON)
+#include "sensors.h"
+#include "statistics.h"
+#endif
+
+#if defined(JOURNAL_ON)
+#include "journal.h"
+#endif
+
+static const char *API_TAG = "api";
+
+static int api_socket = -1;
+static api_connection_t connections[API_CONNECTIONS];
+static char api_body[API_RESPONSE_SIZE - API_HEADERS_SIZE];
+
+static void api_close(api_connection_t *connection) {
+    close(connection->socket);
+    connection->socket = -1;
+}
+
+static bool api_set_non_blocking(int socket) {
+    int flags = fcntl(socket, F_GETFL, 0);
+    return flags >= 0 && fcntl(socket, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+bool api_init(uint16_t port) {
+    struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = htons(port),
+                                  .sin_addr.s_addr = htonl(INADDR_ANY)};
+    int reuse = 1;
+
+    for(uint8_t i = 0; i < API_CONNECTIONS; i++) {
+        connections[i].socket = -1;
+    }
+
+    api_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+    if(api_socket < 0) {
+        ESP_LOGE(API_TAG, "Unable to create the socket: errno %d", errno);
+        return false;
+    }
+    setsockopt(api_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    if(bind(api_socket, (struct sockaddr*) &address, sizeof(address)) != 0 || listen(api_socket, API_BACKLOG) != 0 ||
+       !api_set_non_blocking(api_socket)) {
+        ESP_LOGE(API_TAG, "Unable to listen on port %d: errno %d", port, errno);
+        close(api_socket);
+        api_socket = -1;
+        return false;
+    }
+    ESP_LOGI(API_TAG, "Listening on port %d", port);
+    return true;
+}
+
+// Finds a header value in the block between the request line and the empty line
+static const char *api_header(const char *headers, const char *name) {
+    size_t length = strlen(name);
+
+    for(const char *line = strstr(headers, "\r\n"); line != NULL; line = strstr(line + 2, "\r\n")) {
+
+        if(strncasecmp(line + 2, name, length) == 0 && line[2 + length] == ':') {
+            const char *value = line + 3 + length;
+
+            while(*value == ' ') {
+                value++;
+            }
+            return value;
+        }
+    }
+    return NULL;
+}
+
+// Only digits are a length, the value stops growing once it is past what a request can hold
+static int api_content_length(const char *value, size_t *length) {
+    size_t digits = value != NULL ? strspn(value, "0123456789") : 0;
+    *length = 0;
+
+    if(value == NULL) {
+        return 0;
+    }
+
+    if(digits == 0 || strspn(value + digits, " \t") + digits != strcspn(value, "\r")) {
+        return -400;
+    }
+
+    for(size_t i = 0; i < digits; i++) {
+
+        if(*length >= API_REQUEST_SIZE) {
+            return -413;
+        }
+        *length = *length * 10 + (value[i] - '0');
+    }
+    return *length < API_REQUEST_SIZE ? 0 : -413;
+}
+
+// Reads an integer member of a flat JSON object, enough for the requests this API accepts
+static bool api_json_int(const char *json, const char *key, long *value) {
+    char quoted[16];
+    snprintf(quoted, sizeof(quoted), "\"%s\"", key);
+    const char *member = strstr(json, quoted);
+
+    if(member == NULL) {
+        return false;
+    }
+    member += strlen(quoted);
+    member += strspn(member, " \t\r\n");
+
+    if(*member++ != ':') {
+        return false;
+    }
+
+    char *end;
+    *value = strtol(member, &end, 10);
+    return end != member;
+}
+
+static int api_state(char *body, size_t size) {
+    desk_state_t state = desk_get_state();
+
+    return snprintf(body, size, "{\"height\":%u,\"target\":%u,\"percentage\":%u,\"moving\":%s,\"valid\":%s,"
+                    "\"age_ms\":%lld}\n", state.current_height, state.target_height, state.percentage,
+                    state.control ? "true" : "false", state.height_valid ? "true" : "false",
+                    state.height_valid ? (long long) (esp_timer_get_time() - state.height_timestamp) / 1000 : -1LL);
+}
+
+// Accepts one of height (mm), offset (mm), percentage or preset (1-7), queued like any other front end
+static int api_target(const char *json, char *body, size_t size) {
+    long value;
+    bool sent;
+
+    if(api_json_int(json, "height", &value)) {
+
+        if(value < DESK_MIN_HEIGHT || value > DESK_MAX_HEIGHT) {
+            return -400;
+        }
+        sent = desk_send_command(DESK_COMMAND_HEIGHT, value);
+    } else if(api_json_int(json, "offset", &value)) {
+
+        if(labs(value) > DESK_MAX_HEIGHT - DESK_MIN_HEIGHT) {
+            return -400;
+        }
+        sent = desk_send_command(DESK_COMMAND_OFFSET, value);
+    } else if(api_json_int(json, "percentage", &value)) {
+
+        if(value < 0 || value > 100) {
+            return -400;
+        }
+        sent = desk_send_command(DESK_COMMAND_PERCENTAGE, value);
+    } else if(api_json_int(json, "preset", &value)) {
+
+        if(value < 1 || value > PRESETS_COUNT) {
+            return -400;
+        }
+        sent = desk_send_command(DESK_COMMAND_PRESET, value - 1);
+    } else {
+        return -400;
+    }
+
+    if(!sent) {
+        return -503;
+    }
+    return api_state(body, size);
+}
+
+static const char *api_reason(int status) {
+    switch(status) {
+        case 200:
+            return "OK";
+        case 202:
+            return "Accepted";
+        case 400:
+            return "Bad Request";
+        case 404:
+            return "Not Found";
+        case 405:
+            return "Method Not Allowed";
+        case 413:
+            return "Payload Too Large";
+        case 503:
+            return "Service Unavailable";
+        default:
+            return "Internal Server Error";
+    }
+}
+
+static void api_respond(api_connection_t *connection, int status, const char *content_type, int body_size) {
+
+    if(body_size < 0 || body_size >= sizeof(api_body)) {
+        status = 500;
+        body_size = 0;
+    }
+
+    if(status >= 400) {
+        metrics_count(METRICS_API_ERRORS);
+        connection->keep_alive = connection->keep_alive && status != 413;
+        body_size = snprintf(api_body, sizeof(api_body), "{\"error\":\"%s\"}\n", api_reason(status));
+        content_type = "application/json";
+    }
+
+    int headers_size = snprintf(connection->response, API_HEADERS_SIZE, "HTTP/1.1 %d %s\r\n"
+                                "Content-Type: %s\r\nContent-Length: %d\r\nConnection: %s\r\n\r\n",
+                                status, api_reason(status), content_type, body_size,
+                                connection->keep_alive ? "keep-alive" : "close");
+
+    memcpy(connection->response + headers_size, api_body, body_size);
+    connection->response_size = headers_size + body_size;
+    connection->response_sent = 0;
+}
+
+#if defined(SENSORS_ON)
+static int api_sensors(char *body, size_t size) {
+    static const char *windows[STATISTICS_WINDOWS] = {"1h", "8h", "24h"};
+    static const char *quantities[STATISTICS_QUANTITIES] = {"co2", "temperature", "humidity"};
+
+    sensors_snapshot_t snapshot = sensors_get_snapshot();
+
+    int used = snprintf(body, size, "{\"co2\":%.0f,\"co2_peak\":%.0f,\"temperature\":%.2f,\"humidity\":%.2f,"
+                        "\"scale\":\"%c\",\"air_quality\":%d,\"valid\":%s,\"samples\":%u,\"version\":%u,"
+                        "\"age_ms\":%lld", snapshot.values.co2_level, snapshot.values.co2_peak_level,
+                        snapshot.values.temperature, snapshot.values.humidity, snapshot.scale ? snapshot.scale : 'C',
+                        snapshot.air_quality, snapshot.valid ? "true" : "false", snapshot.samples, snapshot.version,
+                        snapshot.version > 0 ? (long long) (esp_timer_get_time() - snapshot.timestamp) / 1000 : -1LL);
+
+    for(uint8_t window = 0; window < STATISTICS_WINDOWS && used < size; window++) {
+        used += snprintf(body + used, size - used, ",\"%s\":{\"samples\":%u", windows[window],
+                         (unsigned int) statistics_get(STATISTICS_CO2, window).count);
+
+        for(uint8_t quantity = 0; quantity < STATISTICS_QUANTITIES && used < size; quantity++) {
+            statistics_summary_t summary = statistics_get(quantity, window);
+            used += snprintf(body + used, size - used, ",\"%s\":{\"min\":%.2f,\"max\":%.2f,\"mean\":%.2f}",
+                             quantities[quantity], summary.min, summary.max, summary.mean);
+        }
+        used += used < size ? snprintf(body + used, size - used, "}") : 0;
+    }
+    return used < size ? used + snprintf(body + used, size - used, "}\n") : -1;
+}
+
+typedef struct api_history {
+    char *buffer;
+    size_t size;
+    size_t used;
+    uint32_t now;
+    metrics_cursor_t *cursor;
+    bool full;
+} api_history_t;
+
+static int api_calibration(char *body, size_t size) {
+    static const char *steps[] = {"none", "check", "recalibration", "asc", "self_test"};
+    static const char *statuses[] = {"idle", "pending", "running", "done", "failed"};
+    sensors_calibration_t calibration = sensors_get_calibration();
+    acquisition_calibration_t *sensor = &calibration.sensor;
+
+    return snprintf(body, size, "{\"checked\":%s,\"serial_number\":\"%012llX\",\"temperature_offset\":%.2f,"
+                    "\"sensor_altitude\":%u,\"asc\":%s,\"eeprom_writes\":%u,\"step\":\"%s\",\"status\":\"%s\","
+                    "\"argument\":%u,\"correction\":%d,\"self_test\":%u,\"step_ms\":%lld,\"first_reading_ms\":%lld}\n",
+                    sensor->checked ? "true" : "false", (unsigned long long) sensor->serial_number,
+                    sensor->temperature_offset, sensor->sensor_altitude, sensor->asc_enabled ? "true" : "false",
+                    sensor->persists, steps[sensor->step], statuses[sensor->status], sensor->argument,
+                    sensor->correction, sensor->self_test, (long long) sensor->step_time / 1000,
+                    calibration.first_reading_time > 0 ? (long long) calibration.first_reading_time / 1000 : -1LL);
+}
+
+// Accepts one of co2 (reference ppm for a forced recalibration), asc (0 or 1) or self_test (1)
+static int api_calibrate(const char *json, char *body, size_t size) {
+    long value;
+    bool sent;
+
+    if(api_json_int(json, "co2", &value)) {
+
+        if(value < CO2_REFERENCE_MIN || value > CO2_REFERENCE_MAX) {
+            return -400;
+        }
+        sent = sensors_send_command(ACQUISITION_STEP_RECALIBRATION, value);
+    } else if(api_json_int(json, "asc", &value)) {
+
+        if(value != 0 && value != 1) {
+            return -400;
+        }
+        sent = sensors_send_command(ACQUISITION_STEP_ASC, value);
+    } else if(api_json_int(json, "self_test", &value)) {
+
+        if(value != 1) {
+            return -400;
+        }
+        sent = sensors_send_command(ACQUISITION_STEP_SELF_TEST, 0);
+    } else {
+        return -400;
+    }
+
+    if(!sent) {
+        return -503;
+    }
+    return api_calibration(body, size);
+}
+
+static bool api_history_line(const statistics_sample_t *sample, void *arg) {
+    api_history_t *history = arg;
+    char line[96];
+
+    int size = snprintf(line, sizeof(line), "{\"age_s\":%u,\"co2\":%.0f,\"temperature\":%.2f,\"humidity\":%.2f}\n",
+                        (unsigned int) (history->now - sample->time), statistics_value(sample, STATISTICS_CO2),
+                        statistics_value(sample, STATISTICS_TEMPERATURE),
+                        statistics_value(sample, STATISTICS_HUMIDITY));
+
+    if(history->used + size > history->size) {
+        history->full = true;
+        return false;
+    }
+    memcpy(history->buffer + history->used, line, size);
+    history->used += size;
+    history->cursor->line = sample->time;
+    return true;
+}
+
+// One JSON object per slot from the oldest, the cursor remembers the time of the last one sent
+// so samples overwritten while the client is slow are skipped rather than repeated
+static size_t api_history_export(char *buffer, size_t size, metrics_cursor_t *cursor) {
+    api_history_t history = {.buffer = buffer, .size = size, .used = 0, .cursor = cursor, .full = false,
+                             .now = esp_timer_get_time() / 1000000};
+
+    statistics_visit(cursor->line, api_history_line, &history);
+    cursor->done = !history.full;
+    return history.used;
+}
+#endif
+
+// Fills the connection buffer from offset with the next part of the stream, framed as
+// a chunk unless the client is HTTP/1.0 and reads until the connection closes
+static void api_stream(api_connection_t *connection, size_t offset) {
+    size_t header_size = connection->chunked ? API_CHUNK_HEADER_SIZE : 0;
+    char *data = connection->response + offset;
+    char *payload = data + header_size;
+    size_t size = connection->source(payload, API_RESPONSE_SIZE - offset - API_CHUNK_OVERHEAD, &connection->cursor);
+
+    if(connection->chunked && size > 0) {
+        // Fixed width size in front of the data, leading zeros are valid in a chunk size
+        char header[16];
+        snprintf(header, sizeof(header), "%03x\r\n", (unsigned int) size);
+        memcpy(data, header, header_size);
+        memcpy(payload + size, "\r\n", 2);
+        size += header_size + 2;
+    }
+
+    if(connection->chunked && connection->cursor.done) {
+        memcpy(data + size, "0\r\n\r\n", 5);
+        size += 5;
+    }
+    connection->response_size = offset + size;
+    connection->response_sent = 0;
+    connection->streaming = !connection->cursor.done;
+}
+
+// Metrics and history do not fit in one buffer, they go out as it drains instead of being built up front
+static void api_respond_stream(api_connection_t *connection, bool chunked, const char *content_type,
+                               api_source_t source, uint32_t line) {
+    connection->source = source;
+    connection->chunked = chunked;
+    connection->keep_alive = connection->keep_alive && chunked;
+    connection->cursor = (metrics_cursor_t) {.line = line, .done = false};
+
+    int headers_size = snprintf(connection->response, API_HEADERS_SIZE, "HTTP/1.1 200 OK\r\n"
+                                "Content-Type: %s\r\n%sConnection: %s\r\n\r\n", content_type,
+                                chunked ? "Transfer-Encoding: chunked\r\n" : "",
+                                connection->keep_alive ? "keep-alive" : "close");
+
+    api_stream(connection, headers_size);
+}
+
+// Handles the first complete request in the buffer, returns false while it is still arriving
+static bool api_handle_request(api_connection_t *connection) {
+    char *end = strstr(connection->request, "\r\n\r\n");
+
+    if(end == NULL) {
+
+        if(connection->received >= sizeof(connection->request) - 1) {
+            connection->keep_alive = false;
+            api_respond(connection, 413, NULL, 0);
+            connection->received = 0;
+            return true;
+        }
+        return false;
+    }
+
+    char method[8], path[32];
+    int minor = 0;
+    *end = '\0';
+
+    if(sscanf(connection->request, "%7s %31s HTTP/1.%d", method, path, &minor) != 3) {
+        connection->keep_alive = false;
+        api_respond(connection, 400, NULL, 0);
+        connection->received = 0;
+        return true;
+    }
+
+    const char *content_length = api_header(connection->request, "Content-Length");
+    const char *connection_header = api_header(connection->request, "Connection");
+    size_t headers_size = end + 4 - connection->request;
+    size_t body_size;
+    int length_status = api_content_length(content_length, &body_size);
+
+    if(length_status == 0 && headers_size + body_size >= sizeof(connection->request)) {
+        length_status = -413;
+    }
+
+    if(length_status != 0) {
+        connection->keep_alive = false;
+        api_respond(connection, -length_status, NULL, 0);
+        connection->received = 0;
+        return true;
+    }
+
+    if(connection->received < headers_size + body_size) {
+        *end = '\r';
+        return false;
+    }
+
+    // HTTP/1.1 stays open unless asked otherwise, HTTP/1.0 only when asked
+    if(minor >= 1) {
+        connection->keep_alive = connection_header == NULL || strncasecmp(connection_header, "close", 5) != 0;
+    } else {
+        connection->keep_alive = connection_header != NULL && strncasecmp(connection_header, "keep-alive", 10) == 0;
+    }
+
+    connection->requests++;
+    connection->keep_alive = connection->keep_alive && connection->requests < API_KEEP_ALIVE_MAX;
+    metrics_count(METRICS_API_REQUESTS);
+
+    char *body = end + 4;
+    char saved = body[body_size];
+    body[body_size] = '\0';
+
+    if(strcmp(path, "/state") == 0) {
+
+        if(strcmp(method, "GET") == 0) {
+            api_respond(connection, 200, "application/json", api_state(api_body, sizeof(api_body)));
+        } else {
+            api_respond(connection, 405, NULL, 0);
+        }
+    } else if(strcmp(path, "/target") == 0) {
+
+        if(strcmp(method, "POST") == 0) {
+            int size = api_target(body, api_body, sizeof(api_body));
+            api_respond(connection, size < 0 ? -size : 202, "application/json", size < 0 ? 0 : size);
+        } else {
+            api_respond(connection, 405, NULL, 0);
+        }
+    } else if(strcmp(path, "/metrics") == 0) {
+
+        if(strcmp(method, "GET") == 0) {
+            api_respond_stream(connection, minor >= 1, "text/plain; version=0.0.4", metrics_export, 0);
+        } else {
+            api_respond(connection, 405, NULL, 0);
+        }
+    #if defined(SENSORS_ON)
+    } else if(strcmp(path, "/sensors") == 0) {
+
+        if(strcmp(method, "GET") == 0) {
+            api_respond(connection, 200, "application/json", api_sensors(api_body, sizeof(api_body)));
+        } else {
+            api_respond(connection, 405, NULL, 0);
+        }
+    } else if(strcmp(path, "/calibration") == 0) {
+
+        if(strcmp(method, "GET") == 0) {
+            api_respond(connection, 200, "application/json", api_calibration(api_body, sizeof(api_body)));
+        } else if(strcmp(method, "POST") == 0) {
+            int size = api_calibrate(body, api_body, sizeof(api_body));
+            api_respond(connection, size < 0 ? -size : 202, "application/json", size < 0 ? 0 : size);
+        } else {
+            api_respond(connection, 405, NULL, 0);
+        }
+    } else if(strcmp(path, "/history") == 0) {
+
+        if(strcmp(method, "GET") == 0) {
+            api_respond_stream(connection, minor >= 1, "application/x-ndjson", api_history_export, 0);
+        } else {
+            api_respond(connection, 405, NULL, 0);
+        }
+    #endif
+    #if defined(JOURNAL_ON)
+    } else if(strcmp(path, "/journal") == 0 || strncmp(path, "/journal?from=", 14) == 0) {
+
+        if(strcmp(method, "GET") == 0) {
+            // The raw sectors from the given sequence on, tools/journal decodes them on the host
+            unsigned long sequence = path[8] == '?' ? strtoul(path + 14, NULL, 10) : 0;
+            api_respond_stream(connection, minor >= 1, "application/octet-stream", journal_export,
+                               MIN(sequence, UINT32_MAX / JOURNAL_SECTOR_SIZE) * JOURNAL_SECTOR_SIZE);
+        } else {
+            api_respond(connection, 405, NULL, 0);
+        }
+    #endif
+    } else {
+        api_respond(connection, 404, NULL, 0);
+    }
+
+    // Keep whatever was pipelined behind this request
+    body[body_size] = saved;
+    connection->received -= headers_size + body_size;
+    memmove(connection->request, body + body_size, connection->received);
+    connection->request[connection->received] = '\0';
+    return true;
+}
+
+static void api_send(api_connection_t *connection) {
+    ssize_t sent = send(connection->socket, connection->response + connection->response_sent,
+                        connection->response_size - connection->response_sent, 0);
+
+    if(sent < 0) {
+
+        if(errno != EAGAIN && errno != EWOULDBLOCK) {
+            api_close(connection);
+        }
+        return;
+    }
+    connection->response_sent += sent;
+
+    if(connection->response_sent < connection->response_size) {
+        return;
+    }
+
+    if(connection->streaming) {
+        api_stream(connection, 0);
+        return;
+    }
+    connection->response_size = connection->response_sent = 0;
+
+    if(!connection->keep_alive) {
+        api_close(connection);
+    }
+}
+
+static void api_receive(api_connection_t *connection) {
+    ssize_t received = recv(connection->socket, connection->request + connection->received,
+                            sizeof(connection->request) - 1 - connection->received, 0);
+
+    if(received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        api_close(connection);
+        return;
+    }
+
+    if(received < 0) {
+        return;
+    }
+    connection->received += received;
+    connection->request[connection->received] = '\0';
+    connection->last_activity = esp_timer_get_time();
+}
+
+static void api_accept() {
+    int socket = accept(api_socket, NULL, NULL);
+
+    if(socket < 0) {
+        return;
+    }
+
+    for(uint8_t i = 0; i < API_CONNECTIONS; i++) {
+        api_connection_t *connection = &connections[i];
+
+        if(connection->socket < 0 && api_set_non_blocking(socket)) {
+            connection->socket = socket;
+            connection->last_activity = esp_timer_get_time();
+            connection->requests = 0;
+            connection->received = 0;
+            connection->response_size = connection->response_sent = 0;
+            connection->keep_alive = true;
+            connection->streaming = false;
+            metrics_count(METRICS_API_CONNECTIONS);
+            return;
+        }
+    }
+
+    // Every slot is busy, the client retries rather than waiting behind a kept-alive connection
+    metrics_count(METRICS_API_REJECTED);
+    close(socket);
+}
+
+void api_poll(uint32_t timeout_ms) {
+    struct timeval timeout = {.tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000};
+    fd_set read_set, write_set;
+    int max_socket = api_socket;
+
+    if(api_socket < 0) {
+        return;
+    }
+
+    FD_ZERO(&read_set);
+    FD_ZERO(&write_set);
+    FD_SET(api_socket, &read_set);
+
+    for(uint8_t i = 0; i < API_CONNECTIONS; i++) {
+        api_connection_t *connection = &connections[i];
+
+        if(connection->socket < 0) {
+            continue;
+        }
+
+        // A response still going out holds back the next request of the same client
+        if(connection->response_size > 0) {
+            FD_SET(connection->socket, &write_set);
+        } else {
+            FD_SET(connection->socket, &read_set);
+        }
+        max_socket = MAX(max_socket, connection->socket);
+    }
+
+    if(select(max_socket + 1, &read_set, &write_set, NULL, &timeout) < 0) {
+        return;
+    }
+
+    if(FD_ISSET(api_socket, &read_set)) {
+        api_accept();
+    }
+
+    int64_t now = esp_timer_get_time();
+
+    for(uint8_t i = 0; i < API_CONNECTIONS; i++) {
+        api_connection_t *connection = &connections[i];
+
+        if(connection->socket < 0) {
+            continue;
+        }
+
+        if(FD_ISSET(connection->socket, &write_set)) {
+            api_send(connection);
+        } else if(FD_ISSET(connection->socket, &read_set)) {
+            api_receive(connection);
+        }
+
+        while(connection->socket >= 0 && connection->response_size == 0 && api_handle_request(connection)) {
+            api_send(connection);
+        }
+
+        if(connection->socket >= 0 && connection->response_size == 0 &&
+           now - connection->last_activity > API_KEEP_ALIVE_TIMEOUT_MS * 1000LL) {
+            api_close(connection);
+        }
+    }
+}
+
+void api_task(void *arg) {
+
+    // Suspended rather than deleted, /metrics keeps reading the stack of every task started
+    if(!api_init(API_PORT)) {
+        vTaskSuspend(NULL);
+    }
+
+    for(;;) {
+        api_poll(API_POLL_TIMEOUT_MS);
+    }
+}
@@ -0,0 +1,70 @@
+/* MIT License
+*
+* Copyright (c) 2022 ma-lwa-re
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "metrics.h"
+
+#ifndef API_PORT
+#define API_PORT                    (80)
+#endif
+
+#define API_STACK_SIZE              (4096)
+#define API_CONNECTIONS             (2)
+#define API_SOCKETS                 (API_CONNECTIONS + 1)
+#define API_BACKLOG                 (2)
+#define API_REQUEST_SIZE            (1024)
+#define API_RESPONSE_SIZE           (1024)
+#define API_HEADERS_SIZE            (160)
+#define API_POLL_TIMEOUT_MS         (1000)
+#define API_KEEP_ALIVE_TIMEOUT_MS   (10000)
+#define API_KEEP_ALIVE_MAX          (100)
+#define API_CHUNK_HEADER_SIZE       (5)
+#define API_CHUNK_OVERHEAD          (API_CHUNK_HEADER_SIZE + 2 + 5 + 1)
+
+// Writes the next lines of a streamed response that fit in size, moving the cursor past them
+typedef size_t (*api_source_t)(char *buffer, size_t size, metrics_cursor_t *cursor);
+
+// Every connection owns its buffers for its whole life, nothing is allocated per request
+typedef struct api_connection {
+    int socket;
+    int64_t last_activity;
+    uint32_t requests;
+    size_t received;
+    size_t response_size;
+    size_t response_sent;
+    bool keep_alive;
+    bool streaming;
+    bool chunked;
+    api_source_t source;
+    metrics_cursor_t cursor;
+    char request[API_REQUEST_SIZE];
+    char response[API_RESPONSE_SIZE];
+} api_connection_t;
+
+bool api_init(uint16_t port);
+
+void api_poll(uint32_t timeout_ms);
+
+void api_task(void *arg);
@@ -112,8 +112,9 @@ void ddns_task(void *arg) {
 
     if(err != ESP_OK) {
         ESP_LOGE(DDNS_TAG, "DDNS endpoint not found! Canceling record update.");
-        vTaskDelete(NULL);
-        return;
+
+        // Suspended rather than deleted, /metrics keeps reading the stack of every task started
+        vTaskSuspend(NULL);
     }
  
     for(;;) {
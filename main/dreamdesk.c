@@ -22,22 +22,38 @@
 */
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
 #include "driver/gpio.h"
+#include "stdlib.h"
+#include "stdatomic.h"
 #include "string.h"
+#include "sys/param.h"
 #include "esp_log.h"
 #include "esp_system.h"
 #include "esp_spi_flash.h"
+#include "esp_timer.h"
 #include "nvs_flash.h"
 #include "dreamdesk.h"
+#include "motion.h"
+#include "presets.h"
+#include "metrics.h"
+#if defined(JOURNAL_ON)
+#include "journal.h"
+#endif
 
 static const char *DREAMDESK_TAG = "dreamdesk";
 static const char *LIN_TAG = "lin";
 
-uint8_t current_desk_height = 0xFF;
-uint8_t target_desk_height = 0xFF;
-uint8_t desk_percentage = 0xFF;
-
-uint8_t desk_control = false;
+static portMUX_TYPE desk_state_lock = portMUX_INITIALIZER_UNLOCKED;
+static atomic_uint desk_state_sequence = 0;
+static desk_state_t desk_state;
+static TaskHandle_t move_task_handle = NULL;
+static desk_move_stats_t move_stats;
+static QueueHandle_t desk_command_queue = NULL;
+static portMUX_TYPE desk_command_lock = portMUX_INITIALIZER_UNLOCKED;
+static desk_command_stats_t command_stats;
+static desk_listener_t desk_listeners[DESK_LISTENERS];
+static atomic_uint desk_listener_count = 0;
 
 void chip_info() {
     esp_chip_info_t chip_info;
@@ -60,36 +76,289 @@ void memory_init() {
     ESP_ERROR_CHECK(flash_error);
 }
 
-void desk_set_target_height(uint8_t target_height) {
+// Writers are serialized and never preempted while the sequence is odd, readers
+// copy the state and retry only if a writer on the other core was in the middle
+static void desk_state_write_begin() {
+    portENTER_CRITICAL(&desk_state_lock);
+    atomic_store_explicit(&desk_state_sequence, desk_state_sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void desk_state_write_end() {
+    atomic_store_explicit(&desk_state_sequence, desk_state_sequence + 1, memory_order_release);
+    portEXIT_CRITICAL(&desk_state_lock);
+}
+
+desk_state_t desk_get_state() {
+    desk_state_t state;
+    unsigned int sequence;
+
+    do {
+        sequence = atomic_load_explicit(&desk_state_sequence, memory_order_acquire);
+        state = *(volatile desk_state_t*) &desk_state;
+        atomic_thread_fence(memory_order_acquire);
+    } while((sequence & 0x01) || sequence != atomic_load_explicit(&desk_state_sequence, memory_order_relaxed));
+
+    return state;
+}
+
+void desk_state_init() {
+    desk_state_write_begin();
+    memset(&desk_state, 0x00, sizeof(desk_state));
+    desk_state_write_end();
+
+    if(desk_command_queue == NULL) {
+        desk_command_queue = xQueueCreate(DESK_COMMAND_QUEUE_SIZE, sizeof(desk_command_t));
+    }
+}
+
+static void desk_notify(uint32_t event) {
+
+    if(move_task_handle != NULL) {
+        xTaskNotify(move_task_handle, event, eSetBits);
+    }
+}
+
+desk_move_stats_t desk_get_move_stats() {
+    return move_stats;
+}
+
+// Listeners are added from one task while rx_task and move_task already notify, the count
+// is only published once the new slot is written so they never call a half set one
+bool desk_add_listener(desk_listener_t listener) {
+    uint32_t count = atomic_load_explicit(&desk_listener_count, memory_order_relaxed);
+
+    if(count >= DESK_LISTENERS) {
+        ESP_LOGE(DREAMDESK_TAG, "Too many desk listeners!");
+        return false;
+    }
+    desk_listeners[count] = listener;
+    atomic_store_explicit(&desk_listener_count, count + 1, memory_order_release);
+    return true;
+}
+
+// Front ends only queue the command and return, move_task applies it. An absolute
+// target makes the targets and offsets still queued stale, preset saves are kept in order.
+bool desk_send_command(desk_command_type_t type, int16_t value) {
+    desk_command_t command = {.type = type, .value = value, .timestamp = esp_timer_get_time()};
+    desk_command_t queued[DESK_COMMAND_QUEUE_SIZE];
+    uint32_t superseded = 0, saves = 0;
+
+    if(type != DESK_COMMAND_OFFSET && type != DESK_COMMAND_PRESET_SAVE) {
+
+        // Take everything out and put the saves back, move_task may take some meanwhile
+        while(saves < DESK_COMMAND_QUEUE_SIZE && xQueueReceive(desk_command_queue, &queued[saves], 0) == pdTRUE) {
+
+            if(queued[saves].type == DESK_COMMAND_PRESET_SAVE) {
+                saves++;
+            } else {
+                superseded++;
+            }
+        }
+
+        for(uint32_t i = 0; i < saves; i++) {
+            xQueueSend(desk_command_queue, &queued[i], 0);
+        }
+    }
+
+    bool sent = xQueueSend(desk_command_queue, &command, 0) == pdTRUE;
+    uint32_t depth = uxQueueMessagesWaiting(desk_command_queue);
+
+    portENTER_CRITICAL(&desk_command_lock);
+    command_stats.superseded += superseded;
+    command_stats.dropped += !sent;
+    command_stats.queue_depth_max = MAX(command_stats.queue_depth_max, depth);
+    portEXIT_CRITICAL(&desk_command_lock);
+
+    if(!sent) {
+        ESP_LOGW(DREAMDESK_TAG, "Desk command queue full, dropping command!");
+        return false;
+    }
+    desk_notify(DESK_NOTIFY_COMMAND);
+    return true;
+}
+
+desk_command_stats_t desk_get_command_stats() {
+    portENTER_CRITICAL(&desk_command_lock);
+    desk_command_stats_t stats = command_stats;
+    portEXIT_CRITICAL(&desk_command_lock);
+    return stats;
+}
 
-    if(target_desk_height != (target_height + 1) &&
-       target_desk_height != (target_height - 1)) {
-           desk_stop();
+static void desk_apply_command(const desk_command_t *command) {
+
+    switch(command->type) {
+        case DESK_COMMAND_HEIGHT:
+            desk_set_target_height(command->value);
+            break;
+        case DESK_COMMAND_OFFSET:
+            desk_set_target_offset(command->value);
+            break;
+        case DESK_COMMAND_PERCENTAGE:
+            desk_set_target_percentage(command->value);
+            break;
+        case DESK_COMMAND_PRESET:
+            desk_set_target_height(presets_get(command->value));
+            break;
+        case DESK_COMMAND_PRESET_SAVE:
+
+            if(desk_get_state().height_valid) {
+                presets_set(command->value, desk_get_state().current_height);
+            }
+            break;
     }
+}
 
-    if(current_desk_height == 0xFF) {
+static void desk_notify_listeners() {
+    desk_state_t state = desk_get_state();
+    uint32_t count = atomic_load_explicit(&desk_listener_count, memory_order_acquire);
+
+    for(uint32_t i = 0; i < count; i++) {
+        desk_listeners[i](&state);
+    }
+}
+
+void desk_update_height(uint16_t height) {
+    int64_t timestamp = esp_timer_get_time();
+    bool learned = motion_update(height, timestamp);
+
+    bool height_valid = desk_state.height_valid;
+    uint16_t previous_height = desk_state.current_height;
+    uint8_t previous_percentage = desk_state.percentage;
+
+    // Every measurement matters while moving, at rest only a change wakes move_task
+    if(height_valid && height == previous_height) {
+
+        if(desk_state.control) {
+            desk_state_write_begin();
+            desk_state.height_timestamp = timestamp;
+            desk_state_write_end();
+            desk_notify(DESK_NOTIFY_HEIGHT);
+        } else if(learned) {
+            desk_notify(DESK_NOTIFY_HEIGHT);
+        }
+        return;
+    }
+
+    desk_state_write_begin();
+    desk_state.height_timestamp = timestamp;
+
+    if(!height_valid) {
+        desk_state.target_height = height;
+    }
+
+    desk_state.current_height = height;
+    desk_state.height_valid = true;
+
+    desk_state.percentage = desk_height_percentage(height);
+    desk_state_write_end();
+    desk_notify(DESK_NOTIFY_HEIGHT);
+
+    if(!height_valid || desk_state.percentage != previous_percentage) {
+        desk_notify_listeners();
+    }
+
+    if(!height_valid || (desk_state.current_height / 10) != (previous_height / 10)) {
+        ESP_LOGI(DREAMDESK_TAG, "Desk height %d.%dcm @ %d%%", desk_state.current_height / 10,
+                 desk_state.current_height % 10, desk_state.percentage);
+    }
+}
+
+void desk_set_target_height(uint16_t target_height) {
+
+    if(!desk_get_state().height_valid) {
         desk_wake_up();
         vTaskDelay(10);
+    }
 
-        if(target_height == 0x00) {
-            target_height = current_desk_height + 0x01;
-        } else if(target_height == 0xFE) {
-            target_height = current_desk_height - 0x01;
-        }
+    desk_state_t state = desk_get_state();
+
+    if(!state.height_valid) {
+        ESP_LOGE(DREAMDESK_TAG, "Desk height is unknown!");
+        return;
     }
 
     if(target_height < DESK_MIN_HEIGHT || target_height > DESK_MAX_HEIGHT) {
-        ESP_LOGE(DREAMDESK_TAG, "Target height %dcm is out of range!", target_height);
+        ESP_LOGE(DREAMDESK_TAG, "Target height %dmm is out of range!", target_height);
         return;
     }
 
-    target_desk_height = target_height;
-    desk_control = true;
-    ESP_LOGI(DREAMDESK_TAG, "Setting the desk at %dcm", target_height);
+    // Keep moving when the target is nudged by one step, stop before any other change
+    if(abs(target_height - state.target_height) > DESK_HEIGHT_STEP) {
+        desk_stop();
+    }
+
+    desk_state_write_begin();
+    desk_state.target_height = target_height;
+    desk_state.control = true;
+    desk_state_write_end();
+    desk_notify(DESK_NOTIFY_TARGET);
+    desk_notify_listeners();
+
+    ESP_LOGI(DREAMDESK_TAG, "Setting the desk at %d.%dcm", target_height / 10, target_height % 10);
+}
+
+void desk_set_target_offset(int16_t offset) {
+
+    if(!desk_get_state().height_valid) {
+        desk_wake_up();
+        vTaskDelay(10);
+    }
+    desk_set_target_height(desk_get_state().target_height + offset);
+}
+
+// Release the control only if no new target was set since the move was decided
+bool desk_finish_move(uint16_t target_height) {
+    desk_state_write_begin();
+    bool finished = desk_state.control && desk_state.target_height == target_height;
+
+    if(finished) {
+        desk_state.control = false;
+        desk_state.target_height = desk_state.current_height;
+    }
+    desk_state_write_end();
+
+    if(finished) {
+        desk_notify_listeners();
+    }
+    return finished;
+}
+
+uint8_t desk_height_percentage(uint16_t height) {
+    height = MIN(MAX(height, DESK_MIN_HEIGHT), DESK_MAX_HEIGHT);
+    return ((height - DESK_MIN_HEIGHT) * 100) / (DESK_MAX_HEIGHT - DESK_MIN_HEIGHT);
 }
 
 void desk_set_target_percentage(uint8_t target_percentage) {
-    desk_set_target_height((((DESK_MAX_HEIGHT - DESK_MIN_HEIGHT) / 100.0) * target_percentage) + DESK_MIN_HEIGHT);
+    desk_set_target_height(DESK_MIN_HEIGHT + ((DESK_MAX_HEIGHT - DESK_MIN_HEIGHT) * target_percentage) / 100);
+}
+
+void desk_handle_lin_bytes(lin_parser_t *lin_parser, uint8_t *data, int size) {
+    lin_frame_t *lin_frame = (lin_frame_t*) &lin_parser->buffer[LIN_HEADER_SIZE - 1];
+
+    for(int i = 0; i < size; i++) {
+
+        switch(lin_parser_feed(lin_parser, data[i])) {
+            case LIN_EVENT_HEADER:
+                desk_handle_lin_frame(lin_frame, lin_parser->buffer, LIN_HEADER_SIZE);
+                break;
+            case LIN_EVENT_FRAME:
+                metrics_count_lin_frame(lin_frame->protected_id);
+                desk_handle_lin_frame(lin_frame, lin_parser->buffer, lin_parser->size);
+                break;
+            case LIN_EVENT_PARITY_ERROR:
+                metrics_count(METRICS_LIN_PARITY_ERRORS);
+                ESP_LOGE(LIN_TAG, "Invalid protected_id parity %02x", lin_frame->protected_id);
+                break;
+            case LIN_EVENT_CHECKSUM_ERROR:
+                metrics_count(METRICS_LIN_CHECKSUM_ERRORS);
+                ESP_LOGE(LIN_TAG, "Skipping invalid frame checksum %02x!", lin_parser->buffer[lin_parser->size - 1]);
+                ESP_LOG_BUFFER_HEX_LEVEL(LIN_TAG, lin_parser->buffer, lin_parser->size, ESP_LOG_ERROR);
+                break;
+            default:
+                break;
+        }
+    }
 }
 
 void rx_task(void *arg) {
@@ -110,81 +379,152 @@ void rx_task(void *arg) {
     esp_log_level_set(LIN_TAG, ESP_LOG_INFO);
 
     uart_event_t lin_event;
-    uint8_t *event_data = (uint8_t*) malloc(128);
+    lin_parser_t lin_parser;
+    uint8_t event_data[LIN_EVENT_BUFFER_SIZE];
+    int64_t last_event_time = 0;
+
+    lin_parser_reset(&lin_parser);
 
     while(xQueueReceive(uart_queue, (void*) &lin_event, portMAX_DELAY)) {
 
-        if(lin_event.type == UART_DATA) {
+        if(lin_event.type == UART_BREAK) {
+            lin_parser_reset(&lin_parser);
+        } else if(lin_event.type == UART_FIFO_OVF || lin_event.type == UART_BUFFER_FULL) {
+            ESP_LOGW(LIN_TAG, "UART overflow, flushing input");
+            metrics_count(METRICS_LIN_OVERFLOWS);
+            uart_flush_input(UART_PORT);
+            xQueueReset(uart_queue);
+            lin_parser_reset(&lin_parser);
+        } else if(lin_event.type == UART_DATA) {
             gpio_set_level(LED_ACTIVITY, ON);
-            memset(event_data, 0x00, 128);
+            int64_t event_time = esp_timer_get_time();
 
-            int16_t protected_id = -1;
-            lin_frame_t *lin_frame = NULL;
+            // A silent bus means the previous frame will never complete
+            if(event_time - last_event_time > LIN_FRAME_TIMEOUT_US) {
+                lin_parser_reset(&lin_parser);
+            }
+            last_event_time = event_time;
 
-            uart_read_bytes(UART_PORT, event_data, lin_event.size, 1);
-            ESP_LOG_BUFFER_HEX_LEVEL(LIN_TAG, event_data, lin_event.size, ESP_LOG_DEBUG);
+            // The driver posts the event once the line stayed idle for one byte time and the
+            // bytes came back to back before that, stamping them from the end of the event
+            // keeps the size of the event out of the response latency
+            lin_parser.timestamp = event_time - (int64_t) lin_event.size * LIN_BYTE_US;
 
-            for(uint8_t i = 0; i <= LIN_HEADER_SIZE; i++) {
+            for(size_t event_size = lin_event.size; event_size > 0;) {
+                int read_size = uart_read_bytes(UART_PORT, event_data,
+                                                MIN(event_size, sizeof(event_data)), 1);
 
-                if(event_data[i] == LIN_HEADER_SYNC){
-                    lin_frame = (lin_frame_t*) &event_data[i + 1];
-                    break;
-                } else if((event_data[i] == LIN_HEADER_BREAK && event_data[i + 1] == LIN_HEADER_SYNC)) {
-                    lin_frame = (lin_frame_t*) &event_data[i + 2];
+                if(read_size <= 0) {
                     break;
                 }
+                event_size -= read_size;
+                ESP_LOG_BUFFER_HEX_LEVEL(LIN_TAG, event_data, read_size, ESP_LOG_DEBUG);
+                desk_handle_lin_bytes(&lin_parser, event_data, read_size);
             }
+        }
+        gpio_set_level(LED_ACTIVITY, OFF);
+    }
+}
 
-            if(lin_frame == NULL) {
-                continue;
-            }
+static int compare_latency(const void *a, const void *b) {
+    return (*(const uint32_t*) a > *(const uint32_t*) b) - (*(const uint32_t*) a < *(const uint32_t*) b);
+}
+
+void move_task(void *arg) {
+    static uint32_t latency[DESK_LATENCY_SAMPLES];
+    uint32_t latency_count = 0;
+    uint32_t period_wakeups = 0;
+    int64_t period_start = esp_timer_get_time();
+    int64_t command_time = 0;
+    desk_command_t command;
 
-            protected_id = lin_frame->protected_id & 0x3F;
+    move_task_handle = xTaskGetCurrentTaskHandle();
 
-            if(protected_id < LIN_PROTECTED_ID_MIN || protected_id > LIN_PROTECTED_ID_MAX) {
-                ESP_LOGE(LIN_TAG, "Invalid protected_id %d", protected_id);
-                ESP_LOG_BUFFER_HEX_LEVEL(LIN_TAG, event_data, lin_event.size, ESP_LOG_ERROR);
-            }
+    for(;;) {
+        uint32_t events = 0;
+        TickType_t timeout = desk_get_state().control ? DESK_MOVE_TIMEOUT : DESK_IDLE_TIMEOUT;
 
-            if(lin_event.size > LIN_HEADER_SIZE &&
-               lin_event.size < (LIN_HEADER_SIZE + LIN_DATA_SIZE + LIN_CHECKSUM_SIZE)) {
+        // Commands queued before this task registered its handle were never notified
+        if(uxQueueMessagesWaiting(desk_command_queue) > 0) {
+            timeout = 0;
+        }
 
-                if(checksum(lin_frame->data, lin_frame->protected_id) != lin_frame->checksum) {
-                    ESP_LOGE(LIN_TAG, "Skipping invalid frame checksum %02x!", lin_frame->checksum);
-                    ESP_LOG_BUFFER_HEX_LEVEL(LIN_TAG, event_data, lin_event.size, ESP_LOG_ERROR);
-                    continue;
-                }
-            }
+        // Sleep until a fresh height or a new target arrives, the timeout keeps the desk polled
+        xTaskNotifyWait(0x00, UINT32_MAX, &events, timeout);
+        while(xQueueReceive(desk_command_queue, &command, 0) == pdTRUE) {
+            desk_apply_command(&command);
+            command_time = command.timestamp;
 
-            desk_handle_lin_frame(lin_frame, event_data, lin_event.size);
+            portENTER_CRITICAL(&desk_command_lock);
+            command_stats.commands++;
+            portEXIT_CRITICAL(&desk_command_lock);
         }
-        gpio_set_level(LED_ACTIVITY, OFF);
-    }
-}
 
-void move_task(void *arg) {
-    for(;;) {
+        desk_state_t state = desk_get_state();
+        period_wakeups++;
+        move_stats.wakeups++;
 
-        if(desk_control) {
+        // A command the desk cannot follow never leads to a motion
+        if(!state.control) {
+            command_time = 0;
+        }
 
-            if(target_desk_height != current_desk_height) {
+        if(state.control && motion_valid()) {
+            int32_t remaining = state.target_height - motion_height();
 
-                if(target_desk_height < current_desk_height) {
-                    desk_move_down();
-                }
+            // Stop ahead of the target by the distance the desk needs to come to rest
+            bool stop = abs(remaining) <= DESK_MOVE_THRESHOLD || motion_should_stop(state.target_height);
 
-                if(target_desk_height > current_desk_height) {
-                    desk_move_up();
-                }
+            if((events & DESK_NOTIFY_HEIGHT) && latency_count < DESK_LATENCY_SAMPLES) {
+                latency[latency_count++] = esp_timer_get_time() - state.height_timestamp;
+            }
+            move_stats.decisions++;
+
+            if(command_time != 0) {
+                uint32_t latency = esp_timer_get_time() - command_time;
+                command_time = 0;
+                metrics_observe(METRICS_MOVE_LATENCY, latency);
+
+                portENTER_CRITICAL(&desk_command_lock);
+                command_stats.latency_us = latency;
+                command_stats.latency_max_us = MAX(command_stats.latency_max_us, latency);
+                portEXIT_CRITICAL(&desk_command_lock);
             }
 
-            if(target_desk_height == current_desk_height) {
+            if(stop) {
+                motion_stop(state.target_height);
                 desk_stop();
-                desk_control = false;
-                target_desk_height = current_desk_height;
+                desk_finish_move(state.target_height);
+            } else if(remaining < 0) {
+                desk_move_down();
+            } else {
+                desk_move_up();
             }
         }
-        vTaskDelay(5);
+        motion_persist();
+
+        int64_t now = esp_timer_get_time();
+
+        #if defined(JOURNAL_ON)
+        // Where the desk came to rest, moved from here or with its own buttons
+        if(state.height_valid && !state.control && now - state.height_timestamp >= JOURNAL_HEIGHT_SETTLE_US) {
+            journal_add_height(state.height_timestamp / 1000000, state.current_height);
+        }
+        #endif
+
+        if(now - period_start >= DESK_STATS_PERIOD_US) {
+            move_stats.wakeups_per_second = (period_wakeups * 1000000LL) / (now - period_start);
+
+            if(latency_count > 0) {
+                qsort(latency, latency_count, sizeof(latency[0]), compare_latency);
+                move_stats.latency_median_us = latency[latency_count / 2];
+                ESP_LOGD(DREAMDESK_TAG, "move_task %u wakeups/s, median latency %uus",
+                         move_stats.wakeups_per_second, move_stats.latency_median_us);
+            }
+            latency_count = 0;
+            period_wakeups = 0;
+            period_start = now;
+        }
     }
 }
 
@@ -204,6 +544,7 @@ void usb_task(void *arg) {
     ESP_ERROR_CHECK(uart_set_rx_timeout(UART_NUM_0, 1));
 
     uint8_t move_data = 0;
+    bool preset_save = false;
 
     for(;;) {
         ESP_ERROR_CHECK(uart_get_buffered_data_len(UART_NUM_0, (size_t*) &move_data));
@@ -218,40 +559,20 @@ void usb_task(void *arg) {
             uart_read_bytes(UART_NUM_0, &keyboard, sizeof(keyboard), 0x01);
         
             if(keyboard.arrow_key == ARROW_KEY_UP) {
-                desk_set_target_height(target_desk_height + 0x01);
+                desk_send_command(DESK_COMMAND_OFFSET, DESK_HEIGHT_STEP);
             }
 
             if(keyboard.arrow_key == ARROW_KEY_DOWN) {
-                desk_set_target_height(target_desk_height - 0x01);
-            }
-
-            if(keyboard.memory == MEMORY_1) {
-                desk_set_target_height(MEMORY_1_HEIGHT);
-            }
-
-            if(keyboard.memory == MEMORY_2) {
-                desk_set_target_height(MEMORY_2_HEIGHT);
-            }
-
-            if(keyboard.memory == MEMORY_3) {
-                desk_set_target_height(MEMORY_3_HEIGHT);
-            }
-
-            if(keyboard.memory == MEMORY_4) {
-                desk_set_target_height(MEMORY_4_HEIGHT);
-            }
-
-            if(keyboard.memory == MEMORY_5) {
-                desk_set_target_height(MEMORY_5_HEIGHT);
+                desk_send_command(DESK_COMMAND_OFFSET, -DESK_HEIGHT_STEP);
             }
 
-            if(keyboard.memory == MEMORY_6) {
-                desk_set_target_height(MEMORY_6_HEIGHT);
+            // A memory key recalls its preset, or stores the current height right after the save key
+            if(keyboard.memory >= MEMORY_1 && keyboard.memory <= MEMORY_7) {
+                desk_send_command(preset_save ? DESK_COMMAND_PRESET_SAVE : DESK_COMMAND_PRESET,
+                                  keyboard.memory - MEMORY_1);
             }
 
-            if(keyboard.memory == MEMORY_7) {
-                desk_set_target_height(MEMORY_7_HEIGHT);
-            }
+            preset_save = keyboard.memory == PRESET_SAVE_KEY;
             ESP_LOG_BUFFER_HEX_LEVEL(LIN_TAG, &keyboard, sizeof(keyboard), ESP_LOG_DEBUG);
         }
         vTaskDelay(10);
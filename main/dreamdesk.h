@@ -20,6 +20,7 @@
 * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 * SOFTWARE.
 */
+#pragma once
 #include <stdio.h>
 #include <stdbool.h>
 
@@ -44,6 +45,7 @@
 #define CONSOLE_BAUD_RATE       (115200)
 #define ARROW_KEY_UP            (0x41)
 #define ARROW_KEY_DOWN          (0x42)
+#define PRESET_SAVE_KEY         (0x73)
 #define MEMORY_1                (0x31)
 #define MEMORY_2                (0x32)
 #define MEMORY_3                (0x33)
@@ -51,24 +53,68 @@
 #define MEMORY_5                (0x35)
 #define MEMORY_6                (0x36)
 #define MEMORY_7                (0x37)
-#define MEMORY_1_HEIGHT         (60)
-#define MEMORY_2_HEIGHT         (70)
-#define MEMORY_3_HEIGHT         (80)
-#define MEMORY_4_HEIGHT         (90)
-#define MEMORY_5_HEIGHT         (100)
-#define MEMORY_6_HEIGHT         (110)
-#define MEMORY_7_HEIGHT         (120)
-
-extern uint8_t current_desk_height;
-extern uint8_t target_desk_height;
-extern uint8_t desk_percentage;
+#define MEMORY_1_HEIGHT         (600)
+#define MEMORY_2_HEIGHT         (700)
+#define MEMORY_3_HEIGHT         (800)
+#define MEMORY_4_HEIGHT         (900)
+#define MEMORY_5_HEIGHT         (1000)
+#define MEMORY_6_HEIGHT         (1100)
+#define MEMORY_7_HEIGHT         (1200)
+#define DESK_HEIGHT_STEP        (10)
+#define DESK_NOTIFY_HEIGHT      (0x01)
+#define DESK_NOTIFY_TARGET      (0x02)
+#define DESK_NOTIFY_COMMAND     (0x04)
+#define DESK_COMMAND_QUEUE_SIZE (8)
+#define DESK_MOVE_TIMEOUT       (10)
+#define DESK_IDLE_TIMEOUT       (100)
+#define DESK_STATS_PERIOD_US    (1000000)
+#define DESK_LATENCY_SAMPLES    (64)
+#define DESK_LISTENERS          (4)
 
 extern uint8_t desk_ready;
 extern uint8_t desk_reset;
-extern uint8_t desk_control;
 
 QueueHandle_t uart_queue;
 
+typedef struct desk_state {
+    uint16_t current_height;
+    uint16_t target_height;
+    uint8_t percentage;
+    bool height_valid;
+    bool control;
+    int64_t height_timestamp;
+} desk_state_t;
+
+typedef enum desk_command_type {DESK_COMMAND_HEIGHT, DESK_COMMAND_OFFSET,
+                                DESK_COMMAND_PERCENTAGE, DESK_COMMAND_PRESET,
+                                DESK_COMMAND_PRESET_SAVE} desk_command_type_t;
+
+// A request from a front end, applied by move_task in the order it was sent
+typedef struct desk_command {
+    desk_command_type_t type;
+    int16_t value;
+    int64_t timestamp;
+} desk_command_t;
+
+typedef struct desk_command_stats {
+    uint32_t commands;
+    uint32_t superseded;
+    uint32_t dropped;
+    uint32_t queue_depth_max;
+    uint32_t latency_us;
+    uint32_t latency_max_us;
+} desk_command_stats_t;
+
+// Called from the task that changed the state, listeners must not block
+typedef void (*desk_listener_t)(const desk_state_t *state);
+
+typedef struct desk_move_stats {
+    uint32_t wakeups;
+    uint32_t decisions;
+    uint32_t wakeups_per_second;
+    uint32_t latency_median_us;
+} desk_move_stats_t;
+
 typedef struct keyboard {
     uint8_t memory;
     uint8_t reserved0[1];
@@ -81,12 +127,32 @@ void memory_init();
 
 void desk_handle_lin_frame(lin_frame_t *lin_frame, uint8_t *event_data, uint8_t event_size);
 
-void desk_update_height(status_frame_t *status_frame);
+void desk_handle_lin_bytes(lin_parser_t *lin_parser, uint8_t *data, int size);
+
+desk_state_t desk_get_state();
+
+void desk_state_init();
+
+desk_move_stats_t desk_get_move_stats();
+
+bool desk_add_listener(desk_listener_t listener);
+
+bool desk_send_command(desk_command_type_t type, int16_t value);
 
-void desk_set_target_height(uint8_t target_height);
+desk_command_stats_t desk_get_command_stats();
+
+void desk_update_height(uint16_t height);
+
+void desk_set_target_height(uint16_t target_height);
+
+void desk_set_target_offset(int16_t offset);
+
+bool desk_finish_move(uint16_t target_height);
 
 void desk_set_target_percentage(uint8_t target_percentage);
 
+uint8_t desk_height_percentage(uint16_t height);
+
 void rx_task(void *arg);
 
 void usb_task(void *arg);
@@ -0,0 +1,85 @@
+/* MIT License
+*
+* Copyright (c) 2022 ma-lwa-re
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+#include <stdlib.h>
+#include "events.h"
+#include "presets.h"
+
+// Kept free of HAP so the simulator decides on the same events as HomeKit does
+uint8_t events_position_state(const desk_state_t *desk_state) {
+
+    if(!desk_state->control || desk_state->target_height == desk_state->current_height) {
+        return EVENTS_POSITION_STOPPED;
+    }
+    return desk_state->target_height > desk_state->current_height ? EVENTS_POSITION_INCREASING
+                                                                  : EVENTS_POSITION_DECREASING;
+}
+
+// A preset reads as on while the desk heads for its height or rests within the tolerance of it
+bool events_preset_on(const desk_state_t *desk_state, uint8_t slot) {
+    uint16_t height = presets_get(slot);
+
+    if(desk_state->control) {
+        return desk_state->target_height == height;
+    }
+    return desk_state->height_valid && abs(desk_state->current_height - height) <= EVENTS_PRESET_TOLERANCE;
+}
+
+// A change goes out right away unless events went out less than EVENTS_INTERVAL_MS ago,
+// the end of that interval then picks up whatever changed meanwhile
+bool events_changed(const events_t *events) {
+    return !events->held;
+}
+
+// Returns the events to raise for what changed since the last ones, after any event the
+// caller holds the next ones back until it calls events_release at the end of the interval
+uint8_t events_notify(events_t *events, const desk_state_t *desk_state) {
+    uint8_t raised = 0x00;
+
+    if(desk_state->height_valid && desk_state->percentage != events->current_position) {
+        events->current_position = desk_state->percentage;
+        raised |= EVENTS_CURRENT_POSITION;
+    }
+
+    uint8_t position_state = events_position_state(desk_state);
+
+    if(position_state != events->position_state) {
+        events->position_state = position_state;
+        raised |= EVENTS_POSITION_STATE;
+    }
+
+    for(uint8_t i = 0; i < EVENTS_PRESETS; i++) {
+        bool on = events_preset_on(desk_state, i);
+
+        if(on != events->preset_on[i]) {
+            events->preset_on[i] = on;
+            raised |= EVENTS_PRESET_ON(i);
+        }
+    }
+
+    events->held = raised != 0x00;
+    return raised;
+}
+
+void events_release(events_t *events) {
+    events->held = false;
+}
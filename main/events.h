@@ -0,0 +1,56 @@
+/* MIT License
+*
+* Copyright (c) 2022 ma-lwa-re
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "dreamdesk.h"
+
+#define EVENTS_INTERVAL_MS          (1000)
+#define EVENTS_PRESETS              (4)
+#define EVENTS_PRESET_TOLERANCE     (5)
+#define EVENTS_POSITION_DECREASING  (0x00)
+#define EVENTS_POSITION_INCREASING  (0x01)
+#define EVENTS_POSITION_STOPPED     (0x02)
+
+#define EVENTS_CURRENT_POSITION     (0x01)
+#define EVENTS_POSITION_STATE       (0x02)
+#define EVENTS_PRESET_ON(slot)      (0x04 << (slot))
+
+// What the controllers were last told about the desk, held while the interval after the
+// last events runs so a whole move costs a bounded number of them
+typedef struct events {
+    int current_position;
+    uint8_t position_state;
+    bool preset_on[EVENTS_PRESETS];
+    bool held;
+} events_t;
+
+uint8_t events_position_state(const desk_state_t *desk_state);
+
+bool events_preset_on(const desk_state_t *desk_state, uint8_t slot);
+
+bool events_changed(const events_t *events);
+
+uint8_t events_notify(events_t *events, const desk_state_t *desk_state);
+
+void events_release(events_t *events);
@@ -23,7 +23,16 @@
 #include "homekit.h"
 #include "dreamdesk.h"
 #include "sensors.h"
+#include "presets.h"
+#include "events.h"
+#if defined(API_ON)
+#include "api.h"
+#endif
 #include "math.h"
+#include "stdatomic.h"
+#include "esp_system.h"
+#include "esp_heap_caps.h"
+#include "sdkconfig.h"
 
 #include "HAPPlatform+Init.h"
 #include "HAPPlatformAccessorySetup+Init.h"
@@ -47,7 +56,12 @@ static struct {
     HAPAccessoryServerOptions hapAccessoryServerOptions;
     HAPPlatform hapPlatform;
     HAPAccessoryServerCallbacks hapAccessoryServerCallbacks;
+    #if defined(HOMEKIT_TRANSPORT_IP)
     HAPPlatformTCPStreamManager tcpStreamManager;
+    #endif
+    #if defined(HOMEKIT_TRANSPORT_BLE)
+    HAPPlatformBLEPeripheralManager blePeripheralManager;
+    #endif
     HAPPlatformMFiHWAuth mfiHWAuth;
     HAPPlatformMFiTokenAuth mfiTokenAuth;
 } platform;
@@ -55,117 +69,105 @@ static struct {
 HAPAccessoryServerRef accessoryServer;
 AccessoryConfigurationT accessoryConfiguration;
 
-const HAPService accessoryInformationService = {
-    .iid = kIID_AccessoryInformation,
-    .serviceType = &kHAPServiceType_AccessoryInformation,
-    .debugDescription = kHAPServiceDebugDescription_AccessoryInformation,
-    .name = NULL,
-    .properties = { .primaryService = false, .hidden = false, .ble = { .supportsConfiguration = false } },
-    .linkedServices = NULL,
-    .characteristics = (const HAPCharacteristic* const[]) { &accessoryInformationFirmwareRevisionCharacteristic,
-                                                            &accessoryInformationIdentifyCharacteristic,
-                                                            &accessoryInformationManufacturerCharacteristic,
-                                                            &accessoryInformationModelCharacteristic,
-                                                            &accessoryInformationNameCharacteristic,
-                                                            &accessoryInformationSerialNumberCharacteristic,
-                                                            NULL }
+static atomic_bool deskNotificationScheduled = false;
+static HAPPlatformTimerRef deskNotificationTimer = 0;
+
+static atomic_bool accessoryStateDirty = false;
+static atomic_uint accessoryStateWrites = 0;
+static HAPPlatformTimerRef accessoryStateTimer = 0;
+static portMUX_TYPE accessoryStateLock = portMUX_INITIALIZER_UNLOCKED;
+static uint8_t savedAccessoryState[sizeof accessoryConfiguration.state];
+
+// Writes go through the lock so FlushAccessoryState never copies a half written field,
+// reads stay unlocked since only the run loop writes the state
+#define SET_ACCESSORY_STATE(field, value) \
+    do { \
+        __typeof__(accessoryConfiguration.state.field) _value = (value); \
+        portENTER_CRITICAL(&accessoryStateLock); \
+        accessoryConfiguration.state.field = _value; \
+        portEXIT_CRITICAL(&accessoryStateLock); \
+    } while(0)
+
+#if defined(SENSORS_ON)
+static atomic_bool sensorsNotificationScheduled = false;
+static sensors_values_t publishedSensorsValues;
+static enum air_quality_t publishedAirQuality;
+static bool sensorsPublished = false;
+#endif
+
+static events_t deskEvents;
+
+#define HOMEKIT_SERVICE(name, ...)
+#define HOMEKIT_CHARACTERISTIC(name, kind, type, flags, read, write, constraints) \
+static const HAP##kind##Characteristic name##Characteristic = { \
+    .format = kHAPCharacteristicFormat_##kind, \
+    .iid = kIID_##name, \
+    .characteristicType = &kHAPCharacteristicType_##type, \
+    .debugDescription = kHAPCharacteristicDebugDescription_##type, \
+    .manufacturerDescription = NULL, \
+    .properties = { .readable = HOMEKIT_FLAG(flags, HOMEKIT_READ), \
+                    .writable = HOMEKIT_FLAG(flags, HOMEKIT_WRITE), \
+                    .supportsEventNotification = HOMEKIT_FLAG(flags, HOMEKIT_EVENT), \
+                    .hidden = false, \
+                    .requiresTimedWrite = false, \
+                    .supportsAuthorizationData = false, \
+                    .ip = { .controlPoint = HOMEKIT_FLAG(flags, HOMEKIT_CONTROL_POINT), \
+                            .supportsWriteResponse = false }, \
+                    .ble = { .supportsBroadcastNotification = HOMEKIT_FLAG(flags, HOMEKIT_EVENT), \
+                             .supportsDisconnectedNotification = HOMEKIT_FLAG(flags, HOMEKIT_EVENT), \
+                             .readableWithoutSecurity = HOMEKIT_FLAG(flags, HOMEKIT_BLE_OPEN_READ), \
+                             .writableWithoutSecurity = HOMEKIT_FLAG(flags, HOMEKIT_BLE_OPEN_WRITE) } }, \
+    .callbacks = { .handleRead = read, .handleWrite = write }, \
+    HOMEKIT_UNPAREN constraints \
 };
-
-const HAPService hapProtocolInformationService = {
-    .iid = kIID_HAPProtocolInformation,
-    .serviceType = &kHAPServiceType_HAPProtocolInformation,
-    .debugDescription = kHAPServiceDebugDescription_HAPProtocolInformation,
-    .name = NULL,
-    .properties = { .primaryService = false, .hidden = false, .ble = { .supportsConfiguration = true } },
-    .linkedServices = NULL,
-    .characteristics = (const HAPCharacteristic* const[]) { &hapProtocolInformationServiceSignatureCharacteristic,
-                                                            &hapProtocolInformationVersionCharacteristic,
-                                                            NULL }
-};
-
-const HAPService pairingService = {
-    .iid = kIID_Pairing,
-    .serviceType = &kHAPServiceType_Pairing,
-    .debugDescription = kHAPServiceDebugDescription_Pairing,
-    .name = NULL,
-    .properties = { .primaryService = false, .hidden = false, .ble = { .supportsConfiguration = false } },
-    .linkedServices = NULL,
-    .characteristics = (const HAPCharacteristic* const[]) { &pairingPairSetupCharacteristic,
-                                                            &pairingPairVerifyCharacteristic,
-                                                            &pairingPairingFeaturesCharacteristic,
-                                                            &pairingPairingPairingsCharacteristic,
-                                                            NULL }
-};
-
-const HAPService dreamdeskService = {
-    .iid = kIID_Window,
-    .serviceType = &kHAPServiceType_WindowCovering,
-    .debugDescription = kHAPServiceDebugDescription_WindowCovering,
-    .name = "Dreamdesk Remote Control",
-    .properties = { .primaryService = true, .hidden = false, .ble = { .supportsConfiguration = false } },
-    .linkedServices = NULL,
-    .characteristics = (const HAPCharacteristic* const[]) { &dreamdeskServiceSignatureCharacteristic,
-                                                            &dreamdeskNameCharacteristic,
-                                                            &dreamdeskCurrentPositionCharacteristic,
-                                                            &dreamdeskTargetPositionCharacteristic,
-                                                            &dreamdeskPositionStateCharacteristic,
-                                                            NULL }
-};
-
-const HAPService temperatureSensorService = {
-    .iid = kIID_TemperatureSensor,
-    .serviceType = &kHAPServiceType_TemperatureSensor,
-    .debugDescription = kHAPServiceDebugDescription_TemperatureSensor,
-    .name = "Dreamdesk Temperature",
-    .properties = { .primaryService = false, .hidden = false, .ble = { .supportsConfiguration = false } },
-    .linkedServices = NULL,
-    .characteristics = (const HAPCharacteristic* const[]) { &temperatureSensorServiceSignatureCharacteristic,
-                                                            &temperatureSensorNameCharacteristic,
-                                                            &temperatureSensorCurrentTemperatureCharacteristic,
-                                                            &temperatureSensorTemperatureDisplayUnitsCharacteristic,
-                                                            NULL }
+#define HOMEKIT_RESERVED(name)
+#define HOMEKIT_SERVICE_END(name)
+#include "homekit_db.h"
+#undef HOMEKIT_SERVICE
+#undef HOMEKIT_CHARACTERISTIC
+#undef HOMEKIT_SERVICE_END
+
+#define HOMEKIT_SERVICE(name, ...)                      static const HAPCharacteristic* const name##Characteristics[] = {
+#define HOMEKIT_CHARACTERISTIC(name, ...)               (const HAPCharacteristic*) &name##Characteristic,
+#define HOMEKIT_SERVICE_END(name)                       NULL };
+#include "homekit_db.h"
+#undef HOMEKIT_SERVICE
+#undef HOMEKIT_CHARACTERISTIC
+#undef HOMEKIT_SERVICE_END
+
+#define HOMEKIT_SERVICE(service, type, label, flags, linked_services) \
+const HAPService service##Service = { \
+    .iid = kIID_##service##Service, \
+    .serviceType = &kHAPServiceType_##type, \
+    .debugDescription = kHAPServiceDebugDescription_##type, \
+    .name = label, \
+    .properties = { .primaryService = HOMEKIT_FLAG(flags, HOMEKIT_PRIMARY), \
+                    .hidden = false, \
+                    .ble = { .supportsConfiguration = HOMEKIT_FLAG(flags, HOMEKIT_BLE_CONFIGURATION) } }, \
+    .linkedServices = linked_services, \
+    .characteristics = service##Characteristics \
 };
-
-const HAPService humiditySensorService = {
-    .iid = kIID_HumiditySensor,
-    .serviceType = &kHAPServiceType_HumiditySensor,
-    .debugDescription = kHAPServiceDebugDescription_HumiditySensor,
-    .name = "Dreamdesk Humidity",
-    .properties = { .primaryService = false, .hidden = false, .ble = { .supportsConfiguration = false } },
-    .linkedServices = NULL,
-    .characteristics = (const HAPCharacteristic* const[]) { &humiditySensorServiceSignatureCharacteristic,
-                                                            &humiditySensorNameCharacteristic,
-                                                            &humiditySensorCurrentRelativeHumidityCharacteristic,
-                                                            NULL }
+#define HOMEKIT_CHARACTERISTIC(name, ...)
+#define HOMEKIT_SERVICE_END(name)
+#include "homekit_db.h"
+#undef HOMEKIT_SERVICE
+
+#define HOMEKIT_SERVICE(name, ...)                      &name##Service,
+static const HAPService* const accessoryServices[] = {
+#include "homekit_db.h"
+    NULL
 };
+#undef HOMEKIT_SERVICE
+#undef HOMEKIT_CHARACTERISTIC
+#undef HOMEKIT_RESERVED
+#undef HOMEKIT_SERVICE_END
 
-const HAPService carbonDioxideSensorService = {
-    .iid = kIID_CarbonDioxideSensor,
-    .serviceType = &kHAPServiceType_CarbonDioxideSensor,
-    .debugDescription = kHAPServiceDebugDescription_CarbonDioxideSensor,
-    .name = "Dreamdesk CO₂",
-    .properties = { .primaryService = false, .hidden = false, .ble = { .supportsConfiguration = false } },
-    .linkedServices = NULL,
-    .characteristics = (const HAPCharacteristic* const[]) { &carbonDioxideSensorServiceSignatureCharacteristic,
-                                                            &carbonDioxideDetectedCharacteristic,
-                                                            &carbonDioxideSensorNameCharacteristic,
-                                                            &carbonDioxideStatusActiveCharacteristic,
-                                                            &carbonDioxideLevelCharacteristic,
-                                                            &carbonDioxidePeakLevelCharacteristic,
-                                                            NULL }
+static const HAPService* const presetServices[EVENTS_PRESETS] = {
+    &preset1Service, &preset2Service, &preset3Service, &preset4Service
 };
 
-const HAPService airQualitySensorService = {
-    .iid = kIID_AirQualitySensor,
-    .serviceType = &kHAPServiceType_AirQualitySensor,
-    .debugDescription = kHAPServiceDebugDescription_AirQualitySensor,
-    .name = "Dreamdesk Air Quality",
-    .properties = { .primaryService = false, .hidden = false, .ble = { .supportsConfiguration = false } },
-    .linkedServices = NULL,
-    .characteristics = (const HAPCharacteristic* const[]) { &airQualitySensorServiceSignatureCharacteristic,
-                                                            &airQualitySensorNameCharacteristic,
-                                                            &airQualitySensorAirQualityCharacteristic,
-                                                            NULL }
+static const HAPBoolCharacteristic* const presetOnCharacteristics[EVENTS_PRESETS] = {
+    &preset1OnCharacteristic, &preset2OnCharacteristic, &preset3OnCharacteristic, &preset4OnCharacteristic
 };
 
 const HAPAccessory accessory = { .aid = 0x01,
@@ -176,15 +178,7 @@ const HAPAccessory accessory = { .aid = 0x01,
                                   .serialNumber = "DEADBEEFBABE",
                                   .firmwareVersion = "2.5",
                                   .hardwareVersion = "2.5",
-                                  .services = (const HAPService* const[]) {
-                                      &accessoryInformationService, &hapProtocolInformationService,
-                                      &pairingService, &dreamdeskService,
-                                      #if defined(SENSORS_ON)
-                                      &temperatureSensorService, &humiditySensorService,
-                                      &carbonDioxideSensorService, &airQualitySensorService,
-                                      #endif
-                                      NULL
-                                  },
+                                  .services = accessoryServices,
                                   .callbacks = { .identify = IdentifyAccessory }
 };
 
@@ -219,21 +213,83 @@ void LoadAccessoryState() {
         }
         HAPRawBufferZero(&accessoryConfiguration.state, sizeof accessoryConfiguration.state);
     }
+    HAPRawBufferCopyBytes(savedAccessoryState, &accessoryConfiguration.state, sizeof savedAccessoryState);
+    atomic_store(&accessoryStateDirty, false);
+
+    deskEvents.current_position = accessoryConfiguration.state.current_position;
+    deskEvents.position_state = accessoryConfiguration.state.position_state;
 }
 
-void SaveAccessoryState() {
+// Writes the state out only if it differs from what the key-value store already holds,
+// the run loop timer and the shutdown handler may both get here
+void FlushAccessoryState() {
     HAPPrecondition(accessoryConfiguration.keyValueStore);
 
+    if(!atomic_exchange(&accessoryStateDirty, false)) {
+        return;
+    }
+    uint8_t state[sizeof savedAccessoryState];
+
+    portENTER_CRITICAL(&accessoryStateLock);
+    HAPRawBufferCopyBytes(state, &accessoryConfiguration.state, sizeof state);
+    bool changed = !HAPRawBufferAreEqual(state, savedAccessoryState, sizeof state);
+
+    if(changed) {
+        HAPRawBufferCopyBytes(savedAccessoryState, state, sizeof state);
+    }
+    portEXIT_CRITICAL(&accessoryStateLock);
+
+    if(!changed) {
+        return;
+    }
+
     HAPError err = HAPPlatformKeyValueStoreSet(
         accessoryConfiguration.keyValueStore,
         kAppKeyValueStoreDomain_Configuration,
         kAppKeyValueStoreKey_Configuration_State,
-        &accessoryConfiguration.state,
-        sizeof accessoryConfiguration.state);
+        state,
+        sizeof state);
     if(err) {
         HAPAssert(err == kHAPError_Unknown);
         HAPFatalError();
     }
+    HAPLogDebug(&kHAPLog_Default, "Accessory state saved, %u flash writes.", atomic_fetch_add(&accessoryStateWrites, 1) + 1);
+}
+
+static void HandleAccessoryStateTimer(HAPPlatformTimerRef timer HAP_UNUSED, void* _Nullable context HAP_UNUSED) {
+    accessoryStateTimer = 0;
+    FlushAccessoryState();
+}
+
+// Only marks the state dirty, every further change pushes the write back so a slider
+// dragged in the Home app ends up as a single write once it is left alone
+void SaveAccessoryState() {
+    atomic_store(&accessoryStateDirty, true);
+
+    if(accessoryStateTimer != 0) {
+        HAPPlatformTimerDeregister(accessoryStateTimer);
+    }
+
+    HAPError err = HAPPlatformTimerRegister(&accessoryStateTimer,
+                                            HAPPlatformClockGetCurrent() + HOMEKIT_SAVE_QUIET_PERIOD_MS,
+                                            HandleAccessoryStateTimer, NULL);
+    if(err) {
+        HAPLogError(&kHAPLog_Default, "Accessory state timer not registered, saving now.");
+        accessoryStateTimer = 0;
+        FlushAccessoryState();
+    }
+}
+
+uint32_t GetAccessoryStateWrites() {
+    return atomic_load(&accessoryStateWrites);
+}
+
+// esp_restart runs this before an OTA reboot, a pending change is not lost with the timer
+static void HandleShutdown(void) {
+
+    if(accessoryConfiguration.keyValueStore != NULL) {
+        FlushAccessoryState();
+    }
 }
 
 void AppAccessoryServerStart(void) {
@@ -271,7 +327,12 @@ HAP_RESULT_USE_CHECK HAPError IdentifyAccessory(HAPAccessoryServerRef* server HA
 HAP_RESULT_USE_CHECK HAPError HandleCurrentPositionRead(HAPAccessoryServerRef* server HAP_UNUSED,
                                                         const HAPIntCharacteristicReadRequest* request HAP_UNUSED,
                                                         int* value, void* _Nullable context HAP_UNUSED) {
-    accessoryConfiguration.state.current_position = accessoryConfiguration.state.target_position;
+    desk_state_t desk_state = desk_get_state();
+
+    if(desk_state.height_valid) {
+        deskEvents.current_position = desk_state.percentage;
+        SET_ACCESSORY_STATE(current_position, desk_state.percentage);
+    }
     *value = accessoryConfiguration.state.current_position;
     HAPLogInfo(&kHAPLog_Default, "%s: %d", __func__, *value);
     return kHAPError_None;
@@ -289,9 +350,8 @@ HAP_RESULT_USE_CHECK HAPError HandleTargetPositionWrite(HAPAccessoryServerRef* s
                                                         const HAPIntCharacteristicWriteRequest* request,
                                                         int value, void* _Nullable context HAP_UNUSED) {
     if(accessoryConfiguration.state.target_position != value) {
-        accessoryConfiguration.state.target_position = value;
-        desk_set_target_percentage(value);
-        accessoryConfiguration.state.current_position = value;
+        SET_ACCESSORY_STATE(target_position, value);
+        desk_send_command(DESK_COMMAND_PERCENTAGE, value);
 
         SaveAccessoryState();
         HAPAccessoryServerRaiseEvent(server, request->characteristic, request->service, request->accessory);
@@ -303,16 +363,59 @@ HAP_RESULT_USE_CHECK HAPError HandleTargetPositionWrite(HAPAccessoryServerRef* s
 HAP_RESULT_USE_CHECK HAPError HandlePositionStateRead(HAPAccessoryServerRef* server HAP_UNUSED,
                                                       const HAPIntCharacteristicReadRequest* request HAP_UNUSED,
                                                       int* value, void* _Nullable context HAP_UNUSED) {
-    accessoryConfiguration.state.position_state = 0x02;
+    desk_state_t desk_state = desk_get_state();
+
+    deskEvents.position_state = events_position_state(&desk_state);
+    SET_ACCESSORY_STATE(position_state, deskEvents.position_state);
     *value = accessoryConfiguration.state.position_state;
     HAPLogInfo(&kHAPLog_Default, "%s: %d", __func__, *value);
     return kHAPError_None;
 }
 
+static uint8_t PresetSlot(uint64_t iid) {
+    return (iid - kIID_preset1On) / (kIID_preset2On - kIID_preset1On);
+}
+
+HAP_RESULT_USE_CHECK HAPError HandlePresetOnRead(HAPAccessoryServerRef* server HAP_UNUSED,
+                                                 const HAPBoolCharacteristicReadRequest* request,
+                                                 bool* value, void* _Nullable context HAP_UNUSED) {
+    uint8_t slot = PresetSlot(request->characteristic->iid);
+    desk_state_t desk_state = desk_get_state();
+
+    deskEvents.preset_on[slot] = events_preset_on(&desk_state, slot);
+    *value = deskEvents.preset_on[slot];
+    HAPLogInfo(&kHAPLog_Default, "%s: preset %d %d", __func__, slot + 1, *value);
+    return kHAPError_None;
+}
+
+// Turning a preset on recalls its exact height, turning it off leaves the desk where it is
+HAP_RESULT_USE_CHECK HAPError HandlePresetOnWrite(HAPAccessoryServerRef* server,
+                                                  const HAPBoolCharacteristicWriteRequest* request,
+                                                  bool value, void* _Nullable context HAP_UNUSED) {
+    uint8_t slot = PresetSlot(request->characteristic->iid);
+
+    if(value) {
+        desk_send_command(DESK_COMMAND_PRESET, slot);
+        deskEvents.preset_on[slot] = true;
+
+        int target_position = desk_height_percentage(presets_get(slot));
+
+        if(accessoryConfiguration.state.target_position != target_position) {
+            SET_ACCESSORY_STATE(target_position, target_position);
+            SaveAccessoryState();
+            HAPAccessoryServerRaiseEvent(server, (const HAPCharacteristic*) &dreamdeskTargetPositionCharacteristic,
+                                         &dreamdeskService, request->accessory);
+        }
+    }
+    HAPAccessoryServerRaiseEvent(server, request->characteristic, request->service, request->accessory);
+    HAPLogInfo(&kHAPLog_Default, "%s: preset %d %d", __func__, slot + 1, value);
+    return kHAPError_None;
+}
+
 HAP_RESULT_USE_CHECK HAPError HandleCurrentTemperatureRead(HAPAccessoryServerRef* server HAP_UNUSED,
                                                            const HAPFloatCharacteristicReadRequest* request HAP_UNUSED,
                                                            float* value, void* _Nullable context HAP_UNUSED) {
-    accessoryConfiguration.state.current_temperature = round(get_current_temperature() * 10.0) / 10.0;
+    SET_ACCESSORY_STATE(current_temperature, sensors_get_snapshot().rounded.temperature);
     *value = accessoryConfiguration.state.current_temperature;
     HAPLogInfo(&kHAPLog_Default, "%s: %f", __func__, *value);
     return kHAPError_None;
@@ -329,7 +432,7 @@ HAP_RESULT_USE_CHECK HAPError HandleTemperatureDisplayUnitsRead(HAPAccessoryServ
 HAP_RESULT_USE_CHECK HAPError HandleCurrentHumidityRead(HAPAccessoryServerRef* server HAP_UNUSED,
                                                         const HAPFloatCharacteristicReadRequest* request HAP_UNUSED,
                                                         float* value, void* _Nullable context HAP_UNUSED) {
-    accessoryConfiguration.state.current_relative_humidity = round(get_current_relative_humidity());
+    SET_ACCESSORY_STATE(current_relative_humidity, sensors_get_snapshot().rounded.humidity);
     *value = accessoryConfiguration.state.current_relative_humidity;
     HAPLogInfo(&kHAPLog_Default, "%s: %f", __func__, *value);
     return kHAPError_None;
@@ -338,7 +441,7 @@ HAP_RESULT_USE_CHECK HAPError HandleCurrentHumidityRead(HAPAccessoryServerRef* s
 HAP_RESULT_USE_CHECK HAPError HandleCarbonDioxideDetectedRead(HAPAccessoryServerRef* server HAP_UNUSED,
                                                               const HAPIntCharacteristicReadRequest* request HAP_UNUSED,
                                                               int* value, void* _Nullable context HAP_UNUSED) {
-    accessoryConfiguration.state.co2_detected = get_air_quality() == POOR ? 0x01 : 0x00;
+    SET_ACCESSORY_STATE(co2_detected, sensors_get_snapshot().air_quality == POOR ? 0x01 : 0x00);
     *value = accessoryConfiguration.state.co2_detected;
     HAPLogInfo(&kHAPLog_Default, "%s: %d", __func__, *value);
     return kHAPError_None;
@@ -347,7 +450,7 @@ HAP_RESULT_USE_CHECK HAPError HandleCarbonDioxideDetectedRead(HAPAccessoryServer
 HAP_RESULT_USE_CHECK HAPError HandleCarbonDioxideStatusActiveRead(HAPAccessoryServerRef* server HAP_UNUSED,
                                                                   const HAPBoolCharacteristicReadRequest* request HAP_UNUSED,
                                                                   bool* value, void* _Nullable context HAP_UNUSED) {
-    accessoryConfiguration.state.co2_active = true;
+    SET_ACCESSORY_STATE(co2_active, true);
     *value = accessoryConfiguration.state.co2_active;
     HAPLogInfo(&kHAPLog_Default, "%s: %d", __func__, *value);
     return kHAPError_None;
@@ -356,7 +459,7 @@ HAP_RESULT_USE_CHECK HAPError HandleCarbonDioxideStatusActiveRead(HAPAccessorySe
 HAP_RESULT_USE_CHECK HAPError HandleCarbonDioxideLevelRead(HAPAccessoryServerRef* server HAP_UNUSED,
                                                           const HAPFloatCharacteristicReadRequest* request HAP_UNUSED,
                                                           float* value, void* _Nullable context HAP_UNUSED) {
-    accessoryConfiguration.state.co2_level = round(get_co2_level());
+    SET_ACCESSORY_STATE(co2_level, sensors_get_snapshot().rounded.co2_level);
     *value = accessoryConfiguration.state.co2_level;
     HAPLogInfo(&kHAPLog_Default, "%s: %f", __func__, *value);
     return kHAPError_None;
@@ -365,7 +468,7 @@ HAP_RESULT_USE_CHECK HAPError HandleCarbonDioxideLevelRead(HAPAccessoryServerRef
 HAP_RESULT_USE_CHECK HAPError HandleAirQualityRead(HAPAccessoryServerRef* server HAP_UNUSED,
                                                    const HAPIntCharacteristicReadRequest* request HAP_UNUSED,
                                                    int* value, void* _Nullable context HAP_UNUSED) {
-    accessoryConfiguration.state.air_quality = get_air_quality();
+    SET_ACCESSORY_STATE(air_quality, sensors_get_snapshot().air_quality);
     *value = accessoryConfiguration.state.air_quality;
     HAPLogInfo(&kHAPLog_Default, "%s: %d", __func__, *value);
     return kHAPError_None;
@@ -374,7 +477,7 @@ HAP_RESULT_USE_CHECK HAPError HandleAirQualityRead(HAPAccessoryServerRef* server
 HAP_RESULT_USE_CHECK HAPError HandleCarbonDioxidePeakLevelRead(HAPAccessoryServerRef* server HAP_UNUSED,
                                                                const HAPFloatCharacteristicReadRequest* request HAP_UNUSED,
                                                                float* value, void* _Nullable context HAP_UNUSED) {
-    accessoryConfiguration.state.co2_peak_level = round(get_co2_peak_level());
+    SET_ACCESSORY_STATE(co2_peak_level, sensors_get_snapshot().rounded.co2_peak_level);
     *value = accessoryConfiguration.state.co2_peak_level;
     HAPLogInfo(&kHAPLog_Default, "%s: %f", __func__, *value);
     return kHAPError_None;
@@ -386,6 +489,149 @@ void AccessoryNotification(const HAPAccessory* accessory, const HAPService* serv
     HAPAccessoryServerRaiseEvent(accessoryConfiguration.server, characteristic, service, accessory);
 }
 
+static void HandleDeskNotificationTimer(HAPPlatformTimerRef timer, void* _Nullable context);
+
+// Raises the events for what changed since the last notification, events_notify then
+// holds any further event back until the timer ends the interval
+static void NotifyDeskState() {
+    desk_state_t desk_state = desk_get_state();
+    uint8_t raised = events_notify(&deskEvents, &desk_state);
+
+    if(raised & EVENTS_CURRENT_POSITION) {
+        SET_ACCESSORY_STATE(current_position, deskEvents.current_position);
+        HAPAccessoryServerRaiseEvent(accessoryConfiguration.server,
+                                     (const HAPCharacteristic*) &dreamdeskCurrentPositionCharacteristic,
+                                     &dreamdeskService, &accessory);
+    }
+
+    if(raised & EVENTS_POSITION_STATE) {
+        SET_ACCESSORY_STATE(position_state, deskEvents.position_state);
+        HAPAccessoryServerRaiseEvent(accessoryConfiguration.server,
+                                     (const HAPCharacteristic*) &dreamdeskPositionStateCharacteristic,
+                                     &dreamdeskService, &accessory);
+    }
+
+    for(uint8_t i = 0; i < EVENTS_PRESETS; i++) {
+
+        if(raised & EVENTS_PRESET_ON(i)) {
+            HAPAccessoryServerRaiseEvent(accessoryConfiguration.server,
+                                         (const HAPCharacteristic*) presetOnCharacteristics[i],
+                                         presetServices[i], &accessory);
+        }
+    }
+
+    if(deskEvents.held) {
+        HAPError err = HAPPlatformTimerRegister(&deskNotificationTimer,
+                                                HAPPlatformClockGetCurrent() + EVENTS_INTERVAL_MS,
+                                                HandleDeskNotificationTimer, NULL);
+        if(err) {
+            HAPLogError(&kHAPLog_Default, "Desk notification timer not registered.");
+            deskNotificationTimer = 0;
+            events_release(&deskEvents);
+        }
+    }
+}
+
+static void HandleDeskNotificationTimer(HAPPlatformTimerRef timer HAP_UNUSED, void* _Nullable context HAP_UNUSED) {
+    deskNotificationTimer = 0;
+    events_release(&deskEvents);
+    NotifyDeskState();
+}
+
+static void HandleDeskNotification(void* _Nullable context HAP_UNUSED, size_t contextSize HAP_UNUSED) {
+    atomic_store(&deskNotificationScheduled, false);
+
+    if(events_changed(&deskEvents)) {
+        NotifyDeskState();
+    }
+}
+
+// Runs on the desk tasks, only hands the change over to the run loop once
+static void HandleDeskStateChange(const desk_state_t *desk_state HAP_UNUSED) {
+
+    if(!atomic_exchange(&deskNotificationScheduled, true)) {
+        HAPError err = HAPPlatformRunLoopScheduleCallback(HandleDeskNotification, NULL, 0);
+
+        if(err) {
+            atomic_store(&deskNotificationScheduled, false);
+        }
+    }
+}
+
+#if defined(SENSORS_ON)
+// Only a value that left the band around the last published one is worth an event
+static bool SensorValueMoved(float value, float *published, float hysteresis) {
+
+    if(sensorsPublished && fabsf(value - *published) < hysteresis) {
+        return false;
+    }
+    *published = value;
+    return true;
+}
+
+static void RaiseSensorEvent(const HAPCharacteristic *characteristic, const HAPService *service) {
+    HAPAccessoryServerRaiseEvent(accessoryConfiguration.server, characteristic, service, &accessory);
+}
+
+static void HandleSensorsNotification(void* _Nullable context HAP_UNUSED, size_t contextSize HAP_UNUSED) {
+    atomic_store(&sensorsNotificationScheduled, false);
+
+    sensors_snapshot_t snapshot = sensors_get_snapshot();
+
+    if(SensorValueMoved(snapshot.values.temperature, &publishedSensorsValues.temperature, TEMPERATURE_HYSTERESIS)) {
+        SET_ACCESSORY_STATE(current_temperature, snapshot.rounded.temperature);
+        RaiseSensorEvent((const HAPCharacteristic*) &temperatureSensorCurrentTemperatureCharacteristic,
+                         &temperatureSensorService);
+    }
+
+    if(SensorValueMoved(snapshot.values.humidity, &publishedSensorsValues.humidity, HUMIDITY_HYSTERESIS)) {
+        SET_ACCESSORY_STATE(current_relative_humidity, snapshot.rounded.humidity);
+        RaiseSensorEvent((const HAPCharacteristic*) &humiditySensorCurrentRelativeHumidityCharacteristic,
+                         &humiditySensorService);
+    }
+
+    if(SensorValueMoved(snapshot.values.co2_level, &publishedSensorsValues.co2_level, CO2_HYSTERESIS)) {
+        SET_ACCESSORY_STATE(co2_level, snapshot.rounded.co2_level);
+        RaiseSensorEvent((const HAPCharacteristic*) &carbonDioxideLevelCharacteristic, &carbonDioxideSensorService);
+    }
+
+    if(SensorValueMoved(snapshot.values.co2_peak_level, &publishedSensorsValues.co2_peak_level, CO2_HYSTERESIS)) {
+        SET_ACCESSORY_STATE(co2_peak_level, snapshot.rounded.co2_peak_level);
+        RaiseSensorEvent((const HAPCharacteristic*) &carbonDioxidePeakLevelCharacteristic,
+                         &carbonDioxideSensorService);
+    }
+
+    // A change of class goes out right away, it is what automations are keyed on
+    if(!sensorsPublished || snapshot.air_quality != publishedAirQuality) {
+        publishedAirQuality = snapshot.air_quality;
+        SET_ACCESSORY_STATE(air_quality, snapshot.air_quality);
+        RaiseSensorEvent((const HAPCharacteristic*) &airQualitySensorAirQualityCharacteristic,
+                         &airQualitySensorService);
+
+        uint8_t co2_detected = snapshot.air_quality == POOR ? 0x01 : 0x00;
+
+        if(!sensorsPublished || co2_detected != accessoryConfiguration.state.co2_detected) {
+            SET_ACCESSORY_STATE(co2_detected, co2_detected);
+            RaiseSensorEvent((const HAPCharacteristic*) &carbonDioxideDetectedCharacteristic,
+                             &carbonDioxideSensorService);
+        }
+    }
+    sensorsPublished = true;
+}
+
+// Runs on sensors_task once per measurement cycle, the run loop picks up the latest snapshot itself
+static void HandleSensorsReading(const sensors_snapshot_t *snapshot HAP_UNUSED) {
+
+    if(!atomic_exchange(&sensorsNotificationScheduled, true)) {
+        HAPError err = HAPPlatformRunLoopScheduleCallback(HandleSensorsNotification, NULL, 0);
+
+        if(err) {
+            atomic_store(&sensorsNotificationScheduled, false);
+        }
+    }
+}
+#endif
+
 void AppCreate(HAPAccessoryServerRef* server, HAPPlatformKeyValueStoreRef keyValueStore) {
     HAPPrecondition(server);
     HAPPrecondition(keyValueStore);
@@ -454,14 +700,21 @@ void InitializePlatform() {
         .keyValueStore = &platform.factoryKeyValueStore });
     platform.hapPlatform.accessorySetup = &accessorySetup;
 
+    #if defined(HOMEKIT_TRANSPORT_IP)
     HAPPlatformTCPStreamManagerCreate(&platform.tcpStreamManager, &(const HAPPlatformTCPStreamManagerOptions) {
         .port = 0,
-        .maxConcurrentTCPStreams = 9
+        .maxConcurrentTCPStreams = HOMEKIT_IP_SESSIONS
     });
 
     static HAPPlatformServiceDiscovery serviceDiscovery;
     HAPPlatformServiceDiscoveryCreate(&serviceDiscovery, &(const HAPPlatformServiceDiscoveryOptions) {0});
     platform.hapPlatform.ip.serviceDiscovery = &serviceDiscovery;
+    #endif
+
+    #if defined(HOMEKIT_TRANSPORT_BLE)
+    HAPPlatformBLEPeripheralManagerCreate(&platform.blePeripheralManager, &(const HAPPlatformBLEPeripheralManagerOptions) {
+        .keyValueStore = &platform.keyValueStore });
+    #endif
 
     HAPPlatformMFiTokenAuthCreate(&platform.mfiTokenAuth, &(const HAPPlatformMFiTokenAuthOptions)
                                   { .keyValueStore = &platform.keyValueStore });
@@ -476,14 +729,87 @@ void InitializePlatform() {
 }
 
 void DeinitializePlatform() {
+    #if defined(HOMEKIT_TRANSPORT_IP)
     HAPPlatformTCPStreamManagerRelease(&platform.tcpStreamManager);
+    #endif
     HAPPlatformRunLoopRelease();
 }
 
+#if defined(HOMEKIT_TRANSPORT_IP)
+_Static_assert(HOMEKIT_IP_SESSIONS >= kHAPIPSessionStorage_MinimumNumElements,
+               "HOMEKIT_IP_SESSIONS is below the HAP minimum");
+_Static_assert(HOMEKIT_IP_INBOUND_BUFFER_SIZE >= kHAPIPSession_MinimumInboundBufferSize,
+               "HOMEKIT_IP_INBOUND_BUFFER_SIZE is below the HAP minimum");
+_Static_assert(HOMEKIT_IP_OUTBOUND_BUFFER_SIZE >= kHAPIPSession_MinimumOutboundBufferSize,
+               "HOMEKIT_IP_OUTBOUND_BUFFER_SIZE is below the HAP minimum");
+_Static_assert(HOMEKIT_IP_SCRATCH_BUFFER_SIZE >= kHAPIPSession_MinimumScratchBufferSize,
+               "HOMEKIT_IP_SCRATCH_BUFFER_SIZE is below the HAP minimum");
+_Static_assert(HOMEKIT_IP_SESSIONS + HOMEKIT_IP_LISTENER_SOCKETS + HOMEKIT_IP_RESERVED_SOCKETS <= CONFIG_LWIP_MAX_SOCKETS,
+               "HOMEKIT_IP_SESSIONS does not fit in CONFIG_LWIP_MAX_SOCKETS");
+_Static_assert(HOMEKIT_IP_SESSIONS + HOMEKIT_IP_RESERVED_SOCKETS <= CONFIG_LWIP_MAX_ACTIVE_TCP,
+               "HOMEKIT_IP_SESSIONS does not fit in CONFIG_LWIP_MAX_ACTIVE_TCP");
+#endif
+
+#if defined(HOMEKIT_TRANSPORT_BLE)
+#if !defined(CONFIG_BT_ENABLED) || !defined(CONFIG_BT_NIMBLE_ENABLED)
+#error "The BLE transport needs NimBLE, remove sdkconfig so sdkconfig.defaults.ble gets applied"
+#endif
+_Static_assert(HOMEKIT_BLE_SESSION_CACHE >= kHAPBLESessionCache_MinElements,
+               "HOMEKIT_BLE_SESSION_CACHE is below the HAP minimum");
+#endif
+
+// Computed for every transport, compiled in or not, so one boot log compares the three builds
+static size_t IPStorageSize(void) {
+    size_t session = sizeof(HAPIPSession) + HOMEKIT_IP_INBOUND_BUFFER_SIZE + HOMEKIT_IP_OUTBOUND_BUFFER_SIZE +
+                     kAttributeCount * sizeof(HAPIPEventNotificationRef);
+
+    return HOMEKIT_IP_SESSIONS * session +
+           kAttributeCount * (sizeof(HAPIPReadContextRef) + sizeof(HAPIPWriteContextRef)) +
+           HOMEKIT_IP_SCRATCH_BUFFER_SIZE;
+}
+
+static size_t BLEStorageSize(void) {
+    return kAttributeCount * sizeof(HAPBLEGATTTableElementRef) +
+           HOMEKIT_BLE_SESSION_CACHE * sizeof(HAPBLESessionCacheElementRef) + sizeof(HAPSessionRef) +
+           HOMEKIT_BLE_PROCEDURES * sizeof(HAPBLEProcedureRef) + HOMEKIT_BLE_PROCEDURE_BUFFER_SIZE;
+}
+
+static void ReportStorage(void) {
+    size_t ip = IPStorageSize();
+    size_t ble = BLEStorageSize();
+
+    #if defined(HOMEKIT_TRANSPORT_IP)
+    HAPLogInfo(&kHAPLog_Default, "IP storage: %zu sessions x (%zu in + %zu out) bytes, %zu attributes, %zu sockets of %d",
+               (size_t) HOMEKIT_IP_SESSIONS, (size_t) HOMEKIT_IP_INBOUND_BUFFER_SIZE,
+               (size_t) HOMEKIT_IP_OUTBOUND_BUFFER_SIZE, kAttributeCount,
+               (size_t) (HOMEKIT_IP_SESSIONS + HOMEKIT_IP_LISTENER_SOCKETS), CONFIG_LWIP_MAX_SOCKETS);
+    #endif
+
+    #if defined(HOMEKIT_TRANSPORT_BLE)
+    HAPLogInfo(&kHAPLog_Default, "BLE storage: %zu GATT elements, %zu cached sessions, %zu procedures, %zu procedure bytes",
+               kAttributeCount, (size_t) HOMEKIT_BLE_SESSION_CACHE, (size_t) HOMEKIT_BLE_PROCEDURES,
+               (size_t) HOMEKIT_BLE_PROCEDURE_BUFFER_SIZE);
+    #endif
+
+    #if defined(HOMEKIT_TRANSPORT_IP) && defined(HOMEKIT_TRANSPORT_BLE)
+    size_t used = ip + ble;
+    #elif defined(HOMEKIT_TRANSPORT_IP)
+    size_t used = ip;
+    #else
+    size_t used = ble;
+    #endif
+
+    HAPLogInfo(&kHAPLog_Default, "HAP storage: IP-only %zu, BLE-only %zu, dual %zu, this build %zu bytes",
+               ip, ble, ip + ble, used);
+    HAPLogInfo(&kHAPLog_Default, "HAP storage: %zu bytes of internal RAM still free",
+               heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+}
+
+#if defined(HOMEKIT_TRANSPORT_IP)
 void InitializeIP() {
-    static HAPIPSession ipSessions[kHAPIPSessionStorage_MinimumNumElements];
-    static uint8_t ipInboundBuffers[HAPArrayCount(ipSessions)][kHAPIPSession_MinimumInboundBufferSize];
-    static uint8_t ipOutboundBuffers[HAPArrayCount(ipSessions)][kHAPIPSession_MinimumOutboundBufferSize];
+    static HAPIPSession ipSessions[HOMEKIT_IP_SESSIONS];
+    static uint8_t ipInboundBuffers[HAPArrayCount(ipSessions)][HOMEKIT_IP_INBOUND_BUFFER_SIZE];
+    static uint8_t ipOutboundBuffers[HAPArrayCount(ipSessions)][HOMEKIT_IP_OUTBOUND_BUFFER_SIZE];
     static HAPIPEventNotificationRef ipEventNotifications[HAPArrayCount(ipSessions)][kAttributeCount];
 
     for(size_t i = 0; i < HAPArrayCount(ipSessions); i++) {
@@ -497,7 +823,7 @@ void InitializeIP() {
 
     static HAPIPReadContextRef ipReadContexts[kAttributeCount];
     static HAPIPWriteContextRef ipWriteContexts[kAttributeCount];
-    static uint8_t ipScratchBuffer[kHAPIPSession_MinimumScratchBufferSize];
+    static uint8_t ipScratchBuffer[HOMEKIT_IP_SCRATCH_BUFFER_SIZE];
     static HAPIPAccessoryServerStorage ipAccessoryServerStorage = {
         .sessions = ipSessions,
         .numSessions = HAPArrayCount(ipSessions),
@@ -513,15 +839,57 @@ void InitializeIP() {
     platform.hapPlatform.ip.tcpStreamManager = &platform.tcpStreamManager;
 }
 
+#endif
+
+#if defined(HOMEKIT_TRANSPORT_BLE)
+void InitializeBLE() {
+    static HAPBLEGATTTableElementRef gattTableElements[kAttributeCount];
+    static HAPBLESessionCacheElementRef sessionCacheElements[HOMEKIT_BLE_SESSION_CACHE];
+    static HAPSessionRef session;
+    static HAPBLEProcedureRef procedures[HOMEKIT_BLE_PROCEDURES];
+    static uint8_t procedureBytes[HOMEKIT_BLE_PROCEDURE_BUFFER_SIZE];
+    static HAPBLEAccessoryServerStorage bleAccessoryServerStorage = {
+        .gattTableElements = gattTableElements,
+        .numGATTTableElements = HAPArrayCount(gattTableElements),
+        .sessionCacheElements = sessionCacheElements,
+        .numSessionCacheElements = HAPArrayCount(sessionCacheElements),
+        .session = &session,
+        .procedures = procedures,
+        .numProcedures = HAPArrayCount(procedures),
+        .procedureBuffer = { .bytes = procedureBytes, .numBytes = sizeof procedureBytes }
+    };
+
+    platform.hapAccessoryServerOptions.ble.transport = &kHAPAccessoryServerTransport_BLE;
+    platform.hapAccessoryServerOptions.ble.accessoryServerStorage = &bleAccessoryServerStorage;
+    platform.hapAccessoryServerOptions.ble.preferredAdvertisingInterval = HOMEKIT_BLE_ADVERTISING_INTERVAL;
+    platform.hapAccessoryServerOptions.ble.preferredNotificationDuration = kHAPBLENotification_MinDuration;
+    platform.hapPlatform.ble.blePeripheralManager = &platform.blePeripheralManager;
+}
+#endif
+
 void home_task(void *arg) {
     HAPAssert(HAPGetCompatibilityVersion() == HAP_COMPATIBILITY_VERSION);
 
     InitializePlatform();
+
+    #if defined(HOMEKIT_TRANSPORT_IP)
     InitializeIP();
+    #endif
+
+    #if defined(HOMEKIT_TRANSPORT_BLE)
+    InitializeBLE();
+    #endif
+    ReportStorage();
 
     HAPAccessoryServerCreate(&accessoryServer, &platform.hapAccessoryServerOptions,
                              &platform.hapPlatform, &platform.hapAccessoryServerCallbacks, NULL);
     AppCreate(&accessoryServer, &platform.keyValueStore);
+    desk_add_listener(HandleDeskStateChange);
+
+    #if defined(SENSORS_ON)
+    sensors_add_listener(HandleSensorsReading);
+    #endif
+    esp_register_shutdown_handler(HandleShutdown);
 
     AppAccessoryServerStart();
     HAPPlatformRunLoopRun();
@@ -0,0 +1,175 @@
+/* MIT License
+*
+* Copyright (c) 2022 ma-lwa-re
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+/* The HomeKit attribute database, expanded by homekit.h and homekit.c with their own
+* definitions of the row macros. No include guard on purpose, every expansion includes it.
+*
+* HOMEKIT_SERVICE(name, type, label, flags, linked_services)
+* HOMEKIT_CHARACTERISTIC(name, kind, type, flags, read, write, constraints)
+* HOMEKIT_RESERVED(name)
+* HOMEKIT_SERVICE_END(name)
+*
+* Services get the IID 0x10 * their position in the table, the accessory information
+* is always 0x01. Characteristics follow their service one IID after the other, so only
+* append to a service or to the table, never reorder, or paired controllers lose track.
+*/
+HOMEKIT_SERVICE(accessoryInformation, AccessoryInformation, NULL, HOMEKIT_NONE, NULL)
+HOMEKIT_CHARACTERISTIC(accessoryInformationIdentify, Bool, Identify, HOMEKIT_WRITE,
+                       NULL, HAPHandleAccessoryInformationIdentifyWrite, ())
+HOMEKIT_CHARACTERISTIC(accessoryInformationManufacturer, String, Manufacturer, HOMEKIT_READ,
+                       HAPHandleAccessoryInformationManufacturerRead, NULL, (.constraints = { .maxLength = 64 }))
+HOMEKIT_CHARACTERISTIC(accessoryInformationModel, String, Model, HOMEKIT_READ,
+                       HAPHandleAccessoryInformationModelRead, NULL, (.constraints = { .maxLength = 64 }))
+HOMEKIT_CHARACTERISTIC(accessoryInformationName, String, Name, HOMEKIT_READ,
+                       HAPHandleAccessoryInformationNameRead, NULL, (.constraints = { .maxLength = 64 }))
+HOMEKIT_CHARACTERISTIC(accessoryInformationSerialNumber, String, SerialNumber, HOMEKIT_READ,
+                       HAPHandleAccessoryInformationSerialNumberRead, NULL, (.constraints = { .maxLength = 64 }))
+HOMEKIT_CHARACTERISTIC(accessoryInformationFirmwareRevision, String, FirmwareRevision, HOMEKIT_READ,
+                       HAPHandleAccessoryInformationFirmwareRevisionRead, NULL, (.constraints = { .maxLength = 64 }))
+HOMEKIT_SERVICE_END(accessoryInformation)
+
+HOMEKIT_SERVICE(hapProtocolInformation, HAPProtocolInformation, NULL, HOMEKIT_BLE_CONFIGURATION, NULL)
+HOMEKIT_CHARACTERISTIC(hapProtocolInformationServiceSignature, Data, ServiceSignature,
+                       HOMEKIT_READ | HOMEKIT_CONTROL_POINT,
+                       HAPHandleServiceSignatureRead, NULL, (.constraints = { .maxLength = 2097152 }))
+HOMEKIT_CHARACTERISTIC(hapProtocolInformationVersion, String, Version, HOMEKIT_READ,
+                       HAPHandleHAPProtocolInformationVersionRead, NULL, (.constraints = { .maxLength = 64 }))
+HOMEKIT_SERVICE_END(hapProtocolInformation)
+
+HOMEKIT_SERVICE(pairing, Pairing, NULL, HOMEKIT_NONE, NULL)
+HOMEKIT_RESERVED(pairingReserved)
+HOMEKIT_CHARACTERISTIC(pairingPairSetup, TLV8, PairSetup,
+                       HOMEKIT_CONTROL_POINT | HOMEKIT_BLE_OPEN_READ | HOMEKIT_BLE_OPEN_WRITE,
+                       HAPHandlePairingPairSetupRead, HAPHandlePairingPairSetupWrite, ())
+HOMEKIT_CHARACTERISTIC(pairingPairVerify, TLV8, PairVerify,
+                       HOMEKIT_CONTROL_POINT | HOMEKIT_BLE_OPEN_READ | HOMEKIT_BLE_OPEN_WRITE,
+                       HAPHandlePairingPairVerifyRead, HAPHandlePairingPairVerifyWrite, ())
+HOMEKIT_CHARACTERISTIC(pairingPairingFeatures, UInt8, PairingFeatures, HOMEKIT_BLE_OPEN_READ,
+                       HAPHandlePairingPairingFeaturesRead, NULL,
+                       (.units = kHAPCharacteristicUnits_None,
+                        .constraints = { .minimumValue = 0, .maximumValue = UINT8_MAX, .stepValue = 0,
+                                         .validValues = NULL, .validValuesRanges = NULL }))
+HOMEKIT_CHARACTERISTIC(pairingPairingPairings, TLV8, PairingPairings,
+                       HOMEKIT_READ | HOMEKIT_WRITE | HOMEKIT_CONTROL_POINT,
+                       HAPHandlePairingPairingPairingsRead, HAPHandlePairingPairingPairingsWrite, ())
+HOMEKIT_SERVICE_END(pairing)
+
+HOMEKIT_SERVICE(dreamdesk, WindowCovering, "Dreamdesk Remote Control", HOMEKIT_PRIMARY,
+                ((const uint16_t[]) { kIID_preset1Service, kIID_preset2Service,
+                                      kIID_preset3Service, kIID_preset4Service, 0 }))
+HOMEKIT_CHARACTERISTIC(dreamdeskServiceSignature, Data, ServiceSignature, HOMEKIT_READ | HOMEKIT_CONTROL_POINT,
+                       HAPHandleServiceSignatureRead, NULL, (.constraints = { .maxLength = 2097152 }))
+HOMEKIT_CHARACTERISTIC(dreamdeskName, String, Name, HOMEKIT_READ,
+                       HAPHandleNameRead, NULL, (.constraints = { .maxLength = 64 }))
+HOMEKIT_CHARACTERISTIC(dreamdeskCurrentPosition, Int, CurrentPosition, HOMEKIT_READ | HOMEKIT_EVENT,
+                       HandleCurrentPositionRead, NULL,
+                       (.units = kHAPCharacteristicUnits_None,
+                        .constraints = { .minimumValue = 0, .maximumValue = 100, .stepValue = 1 }))
+HOMEKIT_CHARACTERISTIC(dreamdeskTargetPosition, Int, TargetPosition, HOMEKIT_READ | HOMEKIT_WRITE | HOMEKIT_EVENT,
+                       HandleTargetPositionRead, HandleTargetPositionWrite,
+                       (.units = kHAPCharacteristicUnits_None,
+                        .constraints = { .minimumValue = 0, .maximumValue = 100, .stepValue = 1 }))
+HOMEKIT_CHARACTERISTIC(dreamdeskPositionState, Int, PositionState, HOMEKIT_READ | HOMEKIT_EVENT,
+                       HandlePositionStateRead, NULL,
+                       (.constraints = { .minimumValue = 0, .maximumValue = 2, .stepValue = 1 }))
+HOMEKIT_SERVICE_END(dreamdesk)
+
+#if defined(SENSORS_ON) || defined(HOMEKIT_DATABASE_ALL)
+HOMEKIT_SERVICE(temperatureSensor, TemperatureSensor, "Dreamdesk Temperature", HOMEKIT_NONE, NULL)
+HOMEKIT_CHARACTERISTIC(temperatureSensorServiceSignature, Data, ServiceSignature, HOMEKIT_READ | HOMEKIT_CONTROL_POINT,
+                       HAPHandleServiceSignatureRead, NULL, (.constraints = { .maxLength = 2097152 }))
+HOMEKIT_CHARACTERISTIC(temperatureSensorName, String, Name, HOMEKIT_READ,
+                       HAPHandleNameRead, NULL, (.constraints = { .maxLength = 64 }))
+HOMEKIT_CHARACTERISTIC(temperatureSensorCurrentTemperature, Float, CurrentTemperature, HOMEKIT_READ | HOMEKIT_EVENT,
+                       HandleCurrentTemperatureRead, NULL,
+                       (.constraints = { .minimumValue = 0, .maximumValue = 100, .stepValue = .1 }))
+HOMEKIT_CHARACTERISTIC(temperatureSensorTemperatureDisplayUnits, Int, TemperatureDisplayUnits,
+                       HOMEKIT_READ | HOMEKIT_EVENT, HandleTemperatureDisplayUnitsRead, NULL,
+                       (.constraints = { .minimumValue = 0, .maximumValue = 1, .stepValue = 1 }))
+HOMEKIT_SERVICE_END(temperatureSensor)
+
+HOMEKIT_SERVICE(humiditySensor, HumiditySensor, "Dreamdesk Humidity", HOMEKIT_NONE, NULL)
+HOMEKIT_CHARACTERISTIC(humiditySensorServiceSignature, Data, ServiceSignature, HOMEKIT_READ | HOMEKIT_CONTROL_POINT,
+                       HAPHandleServiceSignatureRead, NULL, (.constraints = { .maxLength = 2097152 }))
+HOMEKIT_CHARACTERISTIC(humiditySensorName, String, Name, HOMEKIT_READ,
+                       HAPHandleNameRead, NULL, (.constraints = { .maxLength = 64 }))
+HOMEKIT_CHARACTERISTIC(humiditySensorCurrentRelativeHumidity, Float, CurrentRelativeHumidity,
+                       HOMEKIT_READ | HOMEKIT_EVENT, HandleCurrentHumidityRead, NULL,
+                       (.constraints = { .minimumValue = 0, .maximumValue = 100, .stepValue = .1 }))
+HOMEKIT_SERVICE_END(humiditySensor)
+
+HOMEKIT_SERVICE(carbonDioxideSensor, CarbonDioxideSensor, "Dreamdesk CO₂", HOMEKIT_NONE, NULL)
+HOMEKIT_CHARACTERISTIC(carbonDioxideSensorServiceSignature, Data, ServiceSignature, HOMEKIT_READ | HOMEKIT_CONTROL_POINT,
+                       HAPHandleServiceSignatureRead, NULL, (.constraints = { .maxLength = 2097152 }))
+HOMEKIT_CHARACTERISTIC(carbonDioxideSensorName, String, Name, HOMEKIT_READ,
+                       HAPHandleNameRead, NULL, (.constraints = { .maxLength = 64 }))
+HOMEKIT_CHARACTERISTIC(carbonDioxideStatusActive, Bool, StatusActive, HOMEKIT_READ | HOMEKIT_EVENT,
+                       HandleCarbonDioxideStatusActiveRead, NULL, ())
+HOMEKIT_CHARACTERISTIC(carbonDioxideDetected, Int, CarbonDioxideDetected, HOMEKIT_READ | HOMEKIT_EVENT,
+                       HandleCarbonDioxideDetectedRead, NULL,
+                       (.constraints = { .minimumValue = 0, .maximumValue = 1, .stepValue = 1 }))
+HOMEKIT_CHARACTERISTIC(carbonDioxideLevel, Float, CarbonDioxideLevel, HOMEKIT_READ | HOMEKIT_EVENT,
+                       HandleCarbonDioxideLevelRead, NULL,
+                       (.constraints = { .minimumValue = 0, .maximumValue = 100000, .stepValue = 1 }))
+HOMEKIT_CHARACTERISTIC(carbonDioxidePeakLevel, Float, CarbonDioxidePeakLevel, HOMEKIT_READ | HOMEKIT_EVENT,
+                       HandleCarbonDioxidePeakLevelRead, NULL,
+                       (.constraints = { .minimumValue = 0, .maximumValue = 100000, .stepValue = 1 }))
+HOMEKIT_SERVICE_END(carbonDioxideSensor)
+
+HOMEKIT_SERVICE(airQualitySensor, AirQualitySensor, "Dreamdesk Air Quality", HOMEKIT_NONE, NULL)
+HOMEKIT_CHARACTERISTIC(airQualitySensorServiceSignature, Data, ServiceSignature, HOMEKIT_READ | HOMEKIT_CONTROL_POINT,
+                       HAPHandleServiceSignatureRead, NULL, (.constraints = { .maxLength = 2097152 }))
+HOMEKIT_CHARACTERISTIC(airQualitySensorName, String, Name, HOMEKIT_READ,
+                       HAPHandleNameRead, NULL, (.constraints = { .maxLength = 64 }))
+HOMEKIT_CHARACTERISTIC(airQualitySensorAirQuality, Int, AirQuality, HOMEKIT_READ | HOMEKIT_EVENT,
+                       HandleAirQualityRead, NULL,
+                       (.constraints = { .minimumValue = 0, .maximumValue = 5, .stepValue = 1 }))
+HOMEKIT_SERVICE_END(airQualitySensor)
+#endif
+
+HOMEKIT_SERVICE(preset1, Switch, "Dreamdesk Preset 1", HOMEKIT_NONE, NULL)
+HOMEKIT_CHARACTERISTIC(preset1Name, String, Name, HOMEKIT_READ,
+                       HAPHandleNameRead, NULL, (.constraints = { .maxLength = 64 }))
+HOMEKIT_CHARACTERISTIC(preset1On, Bool, On, HOMEKIT_READ | HOMEKIT_WRITE | HOMEKIT_EVENT,
+                       HandlePresetOnRead, HandlePresetOnWrite, ())
+HOMEKIT_SERVICE_END(preset1)
+
+HOMEKIT_SERVICE(preset2, Switch, "Dreamdesk Preset 2", HOMEKIT_NONE, NULL)
+HOMEKIT_CHARACTERISTIC(preset2Name, String, Name, HOMEKIT_READ,
+                       HAPHandleNameRead, NULL, (.constraints = { .maxLength = 64 }))
+HOMEKIT_CHARACTERISTIC(preset2On, Bool, On, HOMEKIT_READ | HOMEKIT_WRITE | HOMEKIT_EVENT,
+                       HandlePresetOnRead, HandlePresetOnWrite, ())
+HOMEKIT_SERVICE_END(preset2)
+
+HOMEKIT_SERVICE(preset3, Switch, "Dreamdesk Preset 3", HOMEKIT_NONE, NULL)
+HOMEKIT_CHARACTERISTIC(preset3Name, String, Name, HOMEKIT_READ,
+                       HAPHandleNameRead, NULL, (.constraints = { .maxLength = 64 }))
+HOMEKIT_CHARACTERISTIC(preset3On, Bool, On, HOMEKIT_READ | HOMEKIT_WRITE | HOMEKIT_EVENT,
+                       HandlePresetOnRead, HandlePresetOnWrite, ())
+HOMEKIT_SERVICE_END(preset3)
+
+HOMEKIT_SERVICE(preset4, Switch, "Dreamdesk Preset 4", HOMEKIT_NONE, NULL)
+HOMEKIT_CHARACTERISTIC(preset4Name, String, Name, HOMEKIT_READ,
+                       HAPHandleNameRead, NULL, (.constraints = { .maxLength = 64 }))
+HOMEKIT_CHARACTERISTIC(preset4On, Bool, On, HOMEKIT_READ | HOMEKIT_WRITE | HOMEKIT_EVENT,
+                       HandlePresetOnRead, HandlePresetOnWrite, ())
+HOMEKIT_SERVICE_END(preset4)
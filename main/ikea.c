@@ -20,9 +20,10 @@
 * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 * SOFTWARE.
 */
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "esp_log.h"
 #include "ikea.h"
-#include "math.h"
 
 #define LOG_LOCAL_LEVEL ESP_LOG_VERBOSE
 
@@ -61,29 +62,55 @@ response_frame_t keep_alive_frame = {
 volatile uint8_t msb0 = 0xAA;
 volatile uint8_t lsb0 = 0xBB;
 
-status_frame_t *status_frame_right = NULL;
-status_frame_t *status_frame_left = NULL;
+static volatile uint8_t move_request = DESK_IDLE;
+static volatile TickType_t move_request_time = 0;
+static uint8_t stop_frames = 0;
+static bool status_right = false;
+static bool status_left = false;
 
-void master_frames() {
-    master_start_frame(LIN_PROTECTED_ID_KEEP_ALIVE);
-    master_start_frame(LIN_PROTECTED_ID_STATUS_RIGHT);
-    master_start_frame(LIN_PROTECTED_ID_STATUS_LEFT);
-    master_start_frame(LIN_PROTECTED_ID_MOVE);
-}
+static void keep_alive_handler(uint8_t *frame, uint8_t size);
+static void status_handler(uint8_t *frame, uint8_t size);
+static void move_handler(uint8_t *frame, uint8_t size);
+
+static const lin_slot_t idle_slots[] = {
+    {.protected_id = LIN_PROTECTED_ID_STATUS_RIGHT, .delay_us = LIN_FRAME_SPACE_US, .handler = status_handler},
+    {.protected_id = LIN_PROTECTED_ID_STATUS_LEFT, .delay_us = LIN_FRAME_SPACE_US, .handler = status_handler}
+};
+
+static const lin_slot_t move_slots[] = {
+    {.protected_id = LIN_PROTECTED_ID_KEEP_ALIVE, .delay_us = LIN_FRAME_SPACE_US, .handler = keep_alive_handler},
+    {.protected_id = LIN_PROTECTED_ID_STATUS_RIGHT, .delay_us = LIN_FRAME_SPACE_US, .handler = status_handler},
+    {.protected_id = LIN_PROTECTED_ID_STATUS_LEFT, .delay_us = LIN_FRAME_SPACE_US, .handler = status_handler},
+    {.protected_id = LIN_PROTECTED_ID_MOVE, .delay_us = LIN_FRAME_SPACE_US, .handler = move_handler}
+};
+
+const lin_schedule_t desk_idle_schedule = {
+    .slots = idle_slots,
+    .size = sizeof(idle_slots) / sizeof(idle_slots[0]),
+    .period_ms = DESK_IDLE_PERIOD_MS
+};
+
+const lin_schedule_t desk_move_schedule = {
+    .slots = move_slots,
+    .size = sizeof(move_slots) / sizeof(move_slots[0]),
+    .period_ms = DESK_MOVE_PERIOD_MS
+};
 
 void desk_wake_up() {
-    master_frames();
+    lin_schedule_set(&desk_move_schedule);
     ESP_LOGI(IKEA_TAG, "Waking up desk!");
 }
 
+// move_task keeps refreshing the request, the schedule stops the desk once it expires
 void desk_move(uint8_t action) {
-    response_frame.action = (response_frame.action == DESK_IDLE) ? DESK_BEFORE_MOVE : action;
-    master_frames();
+    move_request_time = xTaskGetTickCount();
+    move_request = action;
+    lin_schedule_set(&desk_move_schedule);
 }
 
 void desk_move_up() {
 
-    if(response_frame.action == DESK_IDLE) {
+    if(move_request != DESK_UP) {
         ESP_LOGI(IKEA_TAG, "Moving desk up!");
     }
     desk_move(DESK_UP);
@@ -91,94 +118,113 @@ void desk_move_up() {
 
 void desk_move_down() {
 
-    if(response_frame.action == DESK_IDLE) {
+    if(move_request != DESK_DOWN) {
         ESP_LOGI(IKEA_TAG, "Moving desk down!");
     }
     desk_move(DESK_DOWN);
 }
 
 void desk_stop() {
-    ESP_LOGI(IKEA_TAG, "Stopping desk!");
-    response_frame.action = DESK_STOP;
-    master_frames();
-    master_frames();
-    master_frames();
-    response_frame.action = DESK_BEFORE_IDLE;
-    master_frames();
-    response_frame.action = DESK_IDLE;
-    master_frames();
+
+    if(move_request == DESK_UP || move_request == DESK_DOWN) {
+        ESP_LOGI(IKEA_TAG, "Stopping desk!");
+    }
+    move_request = DESK_STOP;
 }
 
-void desk_handle_lin_frame(lin_frame_t *lin_frame, uint8_t *event_data, uint8_t event_size) {
-    uint8_t protected_id = lin_frame->protected_id & 0x3F;
-    esp_log_level_set(IKEA_TAG, ESP_LOG_DEBUG);
+static void keep_alive_handler(uint8_t *frame, uint8_t size) {
 
-    if(protected_id == LIN_PROTECTED_ID_SYNC) {
-        // TODO INIT
-        /*
-        I (15234) lin: Desk height 203cm @ 162%
-        W (15234) lin: 00 55 92 f6 ff bf b6 
-        I (15334) lin: Desk height 203cm @ 162%
-        W (15334) lin: 00 55 92 f6 ff ff 76 
-        I (15434) lin: Desk height 102cm @ 81%
-        W (15434) lin: 00 55 92 66 0f fc fa 
-        */
-    } else if(protected_id == LIN_PROTECTED_ID_KEEP_ALIVE) {
-        uart_write_bytes(UART_PORT, &keep_alive_frame, sizeof(keep_alive_frame));
+    if(size == LIN_HEADER_SIZE) {
+        lin_respond(&keep_alive_frame, sizeof(keep_alive_frame));
         ESP_LOG_BUFFER_HEX_LEVEL(IKEA_TAG, &keep_alive_frame, sizeof(keep_alive_frame), ESP_LOG_DEBUG);
-    } else if(protected_id == LIN_PROTECTED_ID_MOVE) {
-
-        if(status_frame_right != NULL && status_frame_left != NULL) {
-            response_frame.height0 = msb0;
-            response_frame.height1 = lsb0;
-            response_frame.checksum = checksum((uint8_t*) &response_frame, lin_frame->protected_id);
-
-            /*
-            uint8_t ppp = 0x92;
-            response_frame.height0 = 0x05;
-            response_frame.height1 = 0x10;
-            response_frame.action = 0x86;
-            response_frame.checksum = checksum((uint8_t*) &response_frame, ppp);
-            */
-            uart_write_bytes(UART_PORT, &response_frame, sizeof(response_frame));
-
-            ESP_LOG_BUFFER_HEX_LEVEL(IKEA_TAG, &response_frame, sizeof(response_frame), ESP_LOG_DEBUG);
-            status_frame_right = status_frame_left = NULL;
-        }
-    } else if(protected_id == LIN_PROTECTED_ID_STATUS_RIGHT || protected_id == LIN_PROTECTED_ID_STATUS_LEFT) {
-
-        if(event_size < (LIN_HEADER_SIZE + LIN_DATA_SIZE + LIN_CHECKSUM_SIZE)) {
-            ESP_LOGW(IKEA_TAG, "Status event too small");
-            ESP_LOG_BUFFER_HEX_LEVEL(IKEA_TAG, event_data, event_size, ESP_LOG_WARN);
-            return;
-        }
-
-        if(protected_id == LIN_PROTECTED_ID_STATUS_LEFT) {
-            status_frame_left = (status_frame_t*) lin_frame;
-            return;
-        }
-
-        status_frame_right = (status_frame_t*) lin_frame;
-        uint16_t new_desk_height = status_frame_right->height0 + (status_frame_right->height1 << 8);
-        new_desk_height = round((6370.5 + new_desk_height) / 100.5);
-
-        msb0 = lin_frame->data[0];
-        lsb0 = lin_frame->data[1];
-
-        //response_frame.height0 = status_frame->height0;
-        //response_frame.height1 = status_frame->height1;
-
-        ESP_LOG_BUFFER_HEX_LEVEL(IKEA_TAG, &status_frame_right, sizeof(status_frame_right), ESP_LOG_DEBUG);
-
-        if(new_desk_height != current_desk_height) {
-
-            if(current_desk_height == 0xFF) {
-                target_desk_height = new_desk_height;
+    }
+}
+
+static void status_handler(uint8_t *frame, uint8_t size) {
+    lin_frame_t *lin_frame = (lin_frame_t*) frame;
+
+    // Wait for the controller response following the header
+    if(size < (LIN_HEADER_SIZE + LIN_DATA_SIZE + LIN_CHECKSUM_SIZE)) {
+        return;
+    }
+
+    if((lin_frame->protected_id & 0x3F) == LIN_PROTECTED_ID_STATUS_LEFT) {
+        status_left = true;
+        return;
+    }
+
+    status_frame_t *status_frame = (status_frame_t*) lin_frame;
+    uint16_t raw_desk_height = status_frame->height0 | (status_frame->height1 << 8);
+    status_right = true;
+
+    // Fixed point version of (6370.5 + raw) / 10.05, rounded to the nearest millimetre
+    desk_update_height((637050 + raw_desk_height * 100 + 502) / 1005);
+
+    msb0 = lin_frame->data[0];
+    lsb0 = lin_frame->data[1];
+
+    ESP_LOG_BUFFER_HEX_LEVEL(IKEA_TAG, status_frame, sizeof(status_frame_t), ESP_LOG_DEBUG);
+}
+
+// The controller expects a move announcement before the direction, and the stop
+// repeated a few times before going back to idle through the before idle action
+static uint8_t move_action() {
+    uint8_t request = move_request;
+
+    if((request == DESK_UP || request == DESK_DOWN) &&
+       xTaskGetTickCount() - move_request_time > DESK_MOVE_REQUEST_TIMEOUT) {
+        ESP_LOGW(IKEA_TAG, "Move request expired, stopping desk!");
+        request = move_request = DESK_STOP;
+    }
+
+    switch(request) {
+        case DESK_UP:
+        case DESK_DOWN:
+            stop_frames = 0;
+            return (response_frame.action == DESK_IDLE) ? DESK_BEFORE_MOVE : request;
+        case DESK_STOP:
+            if(response_frame.action == DESK_IDLE) {
+                move_request = DESK_IDLE;
+                return DESK_IDLE;
+            }
+
+            if(stop_frames < DESK_STOP_FRAMES) {
+                stop_frames++;
+                return DESK_STOP;
+            }
+
+            if(response_frame.action != DESK_BEFORE_IDLE) {
+                return DESK_BEFORE_IDLE;
             }
+            move_request = DESK_IDLE;
+            return DESK_IDLE;
+        default:
+            return DESK_IDLE;
+    }
+}
+
+static void move_handler(uint8_t *frame, uint8_t size) {
 
-            current_desk_height = new_desk_height;
-            desk_percentage = round((current_desk_height / (float)DESK_MAX_HEIGHT) * 100);
-            ESP_LOGI(IKEA_TAG, "Desk height %dcm @ %d%%", current_desk_height, desk_percentage);
-        }
+    if(size != LIN_HEADER_SIZE || !status_right || !status_left) {
+        return;
     }
+    status_right = status_left = false;
+
+    response_frame.action = move_action();
+    response_frame.height0 = msb0;
+    response_frame.height1 = lsb0;
+    response_frame.checksum = checksum((uint8_t*) &response_frame, frame[0]);
+
+    lin_respond(&response_frame, sizeof(response_frame));
+    ESP_LOG_BUFFER_HEX_LEVEL(IKEA_TAG, &response_frame, sizeof(response_frame), ESP_LOG_DEBUG);
+
+    // Keep polling the height at the idle rate once the desk is at rest
+    if(response_frame.action == DESK_IDLE && move_request == DESK_IDLE) {
+        lin_schedule_set(&desk_idle_schedule);
+    }
+}
+
+void desk_handle_lin_frame(lin_frame_t *lin_frame, uint8_t *event_data, uint8_t event_size) {
+    esp_log_level_set(IKEA_TAG, ESP_LOG_DEBUG);
+    lin_schedule_handle((uint8_t*) lin_frame, event_size);
 }
@@ -21,12 +21,15 @@
 * SOFTWARE.
 */
 #include <stdio.h>
+#include <stdbool.h>
 #include "lin.h"
 
-#define DESK_MIN_HEIGHT               (65)
-#define DESK_MAX_HEIGHT               (125)
+#define DESK_MIN_HEIGHT               (650)
+#define DESK_MAX_HEIGHT               (1250)
 
 #define UART_PORT                     (UART_NUM_2)
+#define LIN_MASTER                    (1)
+#define LIN_MASTER_SCHEDULE           (&desk_idle_schedule)
 
 #undef LIN_DATA_SIZE
 #define LIN_DATA_SIZE                 (0x03)
@@ -47,6 +50,10 @@
 #define DESK_STATUS_READY             (0x00)
 #define DESK_STATUS_START_MOVING      (0x02)
 #define DESK_STATUS_MOVING            (0x03)
+#define DESK_IDLE_PERIOD_MS           (100)
+#define DESK_MOVE_PERIOD_MS           (40)
+#define DESK_MOVE_REQUEST_TIMEOUT     (pdMS_TO_TICKS(250))
+#define DESK_STOP_FRAMES              (3)
 
 typedef struct height {
     uint8_t msb;
@@ -87,13 +94,13 @@ typedef struct response_frame {
     uint8_t checksum;
 } response_frame_t;
 
-extern uint8_t current_desk_height;
-extern uint8_t target_desk_height;
-extern uint8_t desk_percentage;
-
 extern uint8_t desk_ready;
 extern uint8_t desk_reset;
-extern uint8_t desk_control;
+
+extern const lin_schedule_t desk_idle_schedule;
+extern const lin_schedule_t desk_move_schedule;
+
+void desk_update_height(uint16_t height);
 
 void desk_wake_up();
 
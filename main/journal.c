@@ -0,0 +1,451 @@
+/* MIT License
+*
+* Copyright (c) 2022 ma-lwa-re
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/param.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_partition.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "journal.h"
+#include "sensors.h"
+
+#if defined(SENSORS_SCALE_F)
+#define JOURNAL_SCALE               (SCALE_FAHRENHEIT)
+#elif defined(SENSORS_SCALE_K)
+#define JOURNAL_SCALE               (SCALE_KELVIN)
+#else
+#define JOURNAL_SCALE               (SCALE_CELCIUS)
+#endif
+
+static const char *JOURNAL_TAG = "journal";
+
+static const esp_partition_t *journal_partition = NULL;
+static uint32_t journal_sectors = 0;
+static QueueHandle_t journal_queue = NULL;
+static SemaphoreHandle_t journal_lock = NULL;
+
+// Where the next record goes, and what all the records so far add up to
+static uint32_t tail_sector = 0;
+static uint32_t tail_sequence = 0;
+static uint32_t tail_offset = 0;
+static journal_record_t journal_state;
+static uint16_t journal_height = 0;
+
+static uint8_t journal_put_varint(uint8_t *data, uint32_t value) {
+    uint8_t size = 0;
+
+    while(value > 0x7F) {
+        data[size++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    data[size++] = value;
+    return size;
+}
+
+// Zigzag keeps the small negative deltas as short as the positive ones
+static uint8_t journal_put_delta(uint8_t *data, int32_t delta) {
+    return journal_put_varint(data, ((uint32_t) delta << 1) ^ (uint32_t) (delta >> 31));
+}
+
+static bool journal_get_varint(const uint8_t *data, uint8_t size, uint8_t *position, uint32_t *value) {
+    *value = 0;
+
+    for(uint8_t shift = 0; *position < size && shift < 35; shift += 7) {
+        uint8_t byte = data[(*position)++];
+        *value |= (uint32_t) (byte & 0x7F) << shift;
+
+        if(!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool journal_get_delta(const uint8_t *data, uint8_t size, uint8_t *position, int32_t *delta) {
+    uint32_t value;
+
+    if(!journal_get_varint(data, size, position, &value)) {
+        return false;
+    }
+    *delta = (int32_t) (value >> 1) ^ -(int32_t) (value & 1);
+    return true;
+}
+
+// A tag with the type in the high nibble and the payload size in the low one, then varints
+// of the changes since the previous record, a reading every 3 minutes takes 5 to 7 bytes
+static uint8_t journal_encode(const journal_record_t *record, const journal_record_t *state, uint8_t *data) {
+    uint8_t size = 1;
+
+    switch(record->type) {
+        case JOURNAL_BOOT:
+            size += journal_put_varint(data + size, record->boot);
+            size += journal_put_varint(data + size, record->time);
+            data[size++] = record->scale;
+            break;
+        case JOURNAL_SENSORS:
+            size += journal_put_varint(data + size, record->time - state->time);
+            size += journal_put_delta(data + size, record->co2 - state->co2);
+            size += journal_put_delta(data + size, record->temperature - state->temperature);
+            size += journal_put_delta(data + size, record->humidity - state->humidity);
+            break;
+        case JOURNAL_HEIGHT:
+            size += journal_put_varint(data + size, record->time - state->time);
+            size += journal_put_delta(data + size, record->height - state->height);
+            break;
+    }
+    data[0] = (record->type << 4) | (size - 1);
+    return size;
+}
+
+// Applies the record at data to state, returns its size or 0 where the written part ends
+static uint8_t journal_decode(const uint8_t *data, uint32_t available, journal_record_t *state) {
+    journal_record_t next = *state;
+    uint8_t size = 1 + (data[0] & 0x0F);
+    uint8_t position = 1;
+    uint32_t value;
+    int32_t deltas[3];
+
+    if(size > available) {
+        return 0;
+    }
+    next.type = data[0] >> 4;
+
+    switch(next.type) {
+        case JOURNAL_BOOT:
+
+            if(!journal_get_varint(data, size, &position, &next.boot) ||
+               !journal_get_varint(data, size, &position, &next.time) || position >= size) {
+                return 0;
+            }
+            next.scale = data[position++];
+            break;
+        case JOURNAL_SENSORS:
+
+            if(!journal_get_varint(data, size, &position, &value) ||
+               !journal_get_delta(data, size, &position, &deltas[0]) ||
+               !journal_get_delta(data, size, &position, &deltas[1]) ||
+               !journal_get_delta(data, size, &position, &deltas[2])) {
+                return 0;
+            }
+            next.time += value;
+            next.co2 += deltas[0];
+            next.temperature += deltas[1];
+            next.humidity += deltas[2];
+            break;
+        case JOURNAL_HEIGHT:
+
+            if(!journal_get_varint(data, size, &position, &value) ||
+               !journal_get_delta(data, size, &position, &deltas[0])) {
+                return 0;
+            }
+            next.time += value;
+            next.height += deltas[0];
+            break;
+        default:
+            // Erased flash reads 0xFF, the end of what was written
+            return 0;
+    }
+
+    // Anything left over or missing is a record a reset cut short
+    if(position != size) {
+        return 0;
+    }
+    *state = next;
+    return size;
+}
+
+static bool journal_read_header(const esp_partition_t *partition, uint32_t sector, journal_header_t *header) {
+    return esp_partition_read(partition, sector * JOURNAL_SECTOR_SIZE, header, sizeof(*header)) == ESP_OK &&
+           header->magic == JOURNAL_MAGIC;
+}
+
+static void journal_header_state(const journal_header_t *header, journal_record_t *state) {
+    *state = (journal_record_t) {.type = 0, .boot = header->boot, .time = header->time, .scale = header->scale,
+                                 .co2 = header->co2, .temperature = header->temperature,
+                                 .humidity = header->humidity, .height = header->height};
+}
+
+// Sectors are used in turn around the partition, so every one of them is erased as often
+static bool journal_start_sector(uint32_t sector, uint32_t sequence) {
+    journal_header_t header = {.sequence = sequence, .boot = journal_state.boot, .time = journal_state.time,
+                               .co2 = journal_state.co2, .temperature = journal_state.temperature,
+                               .humidity = journal_state.humidity, .height = journal_state.height,
+                               .scale = journal_state.scale, .magic = JOURNAL_MAGIC};
+    size_t address = sector * JOURNAL_SECTOR_SIZE;
+
+    // The magic goes in last on its own, a header cut short by a reset never reads back as valid
+    if(esp_partition_erase_range(journal_partition, address, JOURNAL_SECTOR_SIZE) != ESP_OK ||
+       esp_partition_write(journal_partition, address, &header, offsetof(journal_header_t, magic)) != ESP_OK ||
+       esp_partition_write(journal_partition, address + offsetof(journal_header_t, magic), &header.magic,
+                           sizeof(header.magic)) != ESP_OK) {
+        ESP_LOGE(JOURNAL_TAG, "Unable to start sector %u", sector);
+        return false;
+    }
+    tail_sector = sector;
+    tail_sequence = sequence;
+    tail_offset = sizeof(header);
+    metrics_count(METRICS_JOURNAL_SECTORS);
+    return true;
+}
+
+bool journal_write(const journal_record_t *record) {
+    uint8_t data[JOURNAL_RECORD_MAX_SIZE];
+    journal_record_t next = *record;
+    bool written = false;
+
+    if(journal_partition == NULL) {
+        return false;
+    }
+
+    xSemaphoreTake(journal_lock, portMAX_DELAY);
+
+    if(next.type != JOURNAL_BOOT) {
+        next.time = MAX(next.time, journal_state.time);
+    }
+    uint8_t size = journal_encode(&next, &journal_state, data);
+
+    if(tail_offset + size <= JOURNAL_SECTOR_SIZE ||
+       journal_start_sector((tail_sector + 1) % journal_sectors, tail_sequence + 1)) {
+
+        if(esp_partition_write(journal_partition, tail_sector * JOURNAL_SECTOR_SIZE + tail_offset, data,
+                               size) == ESP_OK) {
+            // The state moves on exactly as a reader will see it
+            journal_decode(data, size, &journal_state);
+            tail_offset += size;
+            written = true;
+        } else {
+            // Part of it may have been programmed, never write over it
+            tail_offset = JOURNAL_SECTOR_SIZE;
+        }
+    }
+    xSemaphoreGive(journal_lock);
+    return written;
+}
+
+// Positions the reader on the oldest sector holding sequence or anything written after it,
+// any partition laid out as a journal will do, a copy of one included
+bool journal_reader_init(journal_reader_t *reader, const esp_partition_t *partition, uint32_t sequence) {
+    journal_header_t header;
+    bool found = false;
+
+    reader->partition = partition;
+    reader->sectors = partition->size / JOURNAL_SECTOR_SIZE;
+    reader->offset = sizeof(journal_header_t);
+
+    for(uint32_t sector = 0; sector < reader->sectors; sector++) {
+
+        if(!journal_read_header(partition, sector, &header) || header.sequence < sequence) {
+            continue;
+        }
+
+        if(!found || header.sequence < reader->sequence) {
+            reader->sector = sector;
+            reader->sequence = header.sequence;
+            journal_header_state(&header, &reader->state);
+            found = true;
+        }
+    }
+    return found;
+}
+
+// Reads one record at a time straight from the flash, nothing but the reader is kept in RAM
+bool journal_read(journal_reader_t *reader, journal_record_t *record) {
+    uint8_t data[JOURNAL_RECORD_MAX_SIZE];
+    journal_header_t header;
+
+    for(;;) {
+        uint32_t available = MIN(sizeof(data), JOURNAL_SECTOR_SIZE - reader->offset);
+        uint8_t size = 0;
+
+        if(available > 0 && esp_partition_read(reader->partition, reader->sector * JOURNAL_SECTOR_SIZE +
+                                               reader->offset, data, available) == ESP_OK) {
+            size = journal_decode(data, available, &reader->state);
+        }
+
+        if(size > 0) {
+            reader->offset += size;
+            *record = reader->state;
+            return true;
+        }
+
+        // Nothing more in this sector, carry on with the one written after it
+        uint32_t next = (reader->sector + 1) % reader->sectors;
+
+        if(!journal_read_header(reader->partition, next, &header) || header.sequence != reader->sequence + 1) {
+            return false;
+        }
+        reader->sector = next;
+        reader->sequence = header.sequence;
+        reader->offset = sizeof(header);
+        journal_header_state(&header, &reader->state);
+    }
+}
+
+// Copies the sectors as they are on the flash from the oldest at or after the cursor up to where
+// the next record goes, the cursor holds the sequence of a sector times its size plus an offset
+size_t journal_export(char *buffer, size_t size, metrics_cursor_t *cursor) {
+    size_t used = 0;
+
+    cursor->done = journal_partition == NULL;
+
+    if(cursor->done) {
+        return 0;
+    }
+
+    xSemaphoreTake(journal_lock, portMAX_DELAY);
+    uint32_t oldest = tail_sequence >= journal_sectors ? tail_sequence - journal_sectors + 1 : 0;
+
+    while(used < size) {
+        uint32_t sequence = cursor->line / JOURNAL_SECTOR_SIZE;
+        uint32_t offset = cursor->line % JOURNAL_SECTOR_SIZE;
+
+        // Sectors erased since the export started are skipped
+        if(sequence < oldest) {
+            sequence = oldest;
+            offset = 0;
+        }
+        uint32_t end = sequence == tail_sequence ? tail_offset : JOURNAL_SECTOR_SIZE;
+
+        if(sequence > tail_sequence || (sequence == tail_sequence && offset >= end)) {
+            cursor->done = true;
+            break;
+        }
+
+        if(offset >= end) {
+            cursor->line = (sequence + 1) * JOURNAL_SECTOR_SIZE;
+            continue;
+        }
+        uint32_t sector = (tail_sector + journal_sectors - (tail_sequence - sequence)) % journal_sectors;
+        uint32_t count = MIN(size - used, end - offset);
+
+        if(esp_partition_read(journal_partition, sector * JOURNAL_SECTOR_SIZE + offset, buffer + used,
+                              count) != ESP_OK) {
+            cursor->done = true;
+            break;
+        }
+        used += count;
+        cursor->line = sequence * JOURNAL_SECTOR_SIZE + offset + count;
+    }
+    xSemaphoreGive(journal_lock);
+    return used;
+}
+
+// Picks up after the newest sector and starts the boot with a record of its own
+bool journal_init() {
+    journal_partition = esp_partition_find_first(JOURNAL_PARTITION_TYPE, JOURNAL_PARTITION_SUBTYPE,
+                                                 JOURNAL_PARTITION_LABEL);
+
+    if(journal_partition == NULL) {
+        ESP_LOGE(JOURNAL_TAG, "No journal partition!");
+        return false;
+    }
+    journal_sectors = journal_partition->size / JOURNAL_SECTOR_SIZE;
+
+    if(journal_lock == NULL) {
+        journal_lock = xSemaphoreCreateMutex();
+        journal_queue = xQueueCreate(JOURNAL_QUEUE_SIZE, sizeof(journal_record_t));
+    }
+
+    journal_header_t header;
+    bool found = false;
+
+    for(uint32_t sector = 0; sector < journal_sectors; sector++) {
+
+        if(journal_read_header(journal_partition, sector, &header) && (!found || header.sequence > tail_sequence)) {
+            tail_sector = sector;
+            tail_sequence = header.sequence;
+            found = true;
+        }
+    }
+    memset(&journal_state, 0x00, sizeof(journal_state));
+
+    if(found) {
+        journal_reader_t reader;
+        journal_record_t record;
+        uint8_t next = 0xFF;
+
+        journal_reader_init(&reader, journal_partition, tail_sequence);
+        while(journal_read(&reader, &record));
+        journal_state = reader.state;
+        tail_offset = reader.offset;
+
+        // A record cut short by a reset left programmed bytes behind, never write over them
+        if(tail_offset < JOURNAL_SECTOR_SIZE) {
+            esp_partition_read(journal_partition, tail_sector * JOURNAL_SECTOR_SIZE + tail_offset, &next, 1);
+        }
+        tail_offset = next == 0xFF ? tail_offset : JOURNAL_SECTOR_SIZE;
+    } else if(!journal_start_sector(0, 0)) {
+        journal_partition = NULL;
+        return false;
+    }
+    journal_height = journal_state.height;
+
+    journal_record_t boot = {.type = JOURNAL_BOOT, .boot = journal_state.boot + 1,
+                             .time = esp_timer_get_time() / 1000000, .scale = JOURNAL_SCALE};
+    bool written = journal_write(&boot);
+
+    ESP_LOGI(JOURNAL_TAG, "Journal of %u sectors, boot %u in sector %u at %u", journal_sectors,
+             journal_state.boot, tail_sector, tail_offset);
+    return written;
+}
+
+static void journal_add(const journal_record_t *record) {
+
+    if(journal_queue != NULL && xQueueSend(journal_queue, record, 0) != pdTRUE) {
+        metrics_count(METRICS_JOURNAL_DROPPED);
+    }
+}
+
+void journal_add_sensors(uint32_t time, uint16_t co2, int16_t temperature, int16_t humidity) {
+    journal_record_t record = {.type = JOURNAL_SENSORS, .time = time, .co2 = co2,
+                               .temperature = temperature, .humidity = humidity};
+    journal_add(&record);
+}
+
+// Only a height the desk settled at far enough from the previous one is a transition
+void journal_add_height(uint32_t time, uint16_t height) {
+
+    if(abs(height - journal_height) < JOURNAL_HEIGHT_THRESHOLD) {
+        return;
+    }
+    journal_height = height;
+
+    journal_record_t record = {.type = JOURNAL_HEIGHT, .time = time, .height = height};
+    journal_add(&record);
+}
+
+// Flash erases and writes stall the caches, they are kept away from the LIN and sensor tasks
+void journal_task(void *arg) {
+    journal_record_t record;
+
+    for(;;) {
+
+        if(xQueueReceive(journal_queue, &record, portMAX_DELAY) == pdTRUE && !journal_write(&record)) {
+            metrics_count(METRICS_JOURNAL_DROPPED);
+        }
+    }
+}
@@ -0,0 +1,96 @@
+/* MIT License
+*
+* Copyright (c) 2022 ma-lwa-re
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_partition.h"
+#include "metrics.h"
+
+#define JOURNAL_PARTITION_LABEL     ("journal")
+#define JOURNAL_PARTITION_TYPE      (0x40)
+#define JOURNAL_PARTITION_SUBTYPE   (0x00)
+#define JOURNAL_SECTOR_SIZE         (4096)
+#define JOURNAL_MAGIC               (0x4A4B4444)
+#define JOURNAL_RECORD_MAX_SIZE     (1 + 15)
+#define JOURNAL_QUEUE_SIZE          (8)
+#define JOURNAL_STACK_SIZE          (3072)
+#define JOURNAL_HEIGHT_SETTLE_US    (10 * 1000000)
+#define JOURNAL_HEIGHT_THRESHOLD    (10)
+
+typedef enum journal_type {JOURNAL_BOOT = 1, JOURNAL_SENSORS, JOURNAL_HEIGHT} journal_type_t;
+
+// What the journal knew after a record, sensor values in the fixed point of the statistics
+// (unsigned ppm up to the 40000 the SCD4x reads, hundredths of a degree and of a percent), height
+// in millimeters, time in seconds since boot
+typedef struct journal_record {
+    journal_type_t type;
+    uint32_t boot;
+    uint32_t time;
+    char scale;
+    uint16_t co2;
+    int16_t temperature;
+    int16_t humidity;
+    uint16_t height;
+} journal_record_t;
+
+// Starts every sector with the full state so it decodes on its own once older ones are erased,
+// the magic is programmed last and only reads back once the whole header made it to the flash
+typedef struct journal_header {
+    uint32_t sequence;
+    uint32_t boot;
+    uint32_t time;
+    uint16_t co2;
+    int16_t temperature;
+    int16_t humidity;
+    uint16_t height;
+    uint8_t scale;
+    uint8_t reserved[3];
+    uint32_t magic;
+} journal_header_t;
+
+// Walks the sectors in the order they were written, one record at a time
+typedef struct journal_reader {
+    const esp_partition_t *partition;
+    uint32_t sectors;
+    uint32_t sector;
+    uint32_t sequence;
+    uint32_t offset;
+    journal_record_t state;
+} journal_reader_t;
+
+bool journal_init();
+
+void journal_add_sensors(uint32_t time, uint16_t co2, int16_t temperature, int16_t humidity);
+
+void journal_add_height(uint32_t time, uint16_t height);
+
+bool journal_write(const journal_record_t *record);
+
+bool journal_reader_init(journal_reader_t *reader, const esp_partition_t *partition, uint32_t sequence);
+
+bool journal_read(journal_reader_t *reader, journal_record_t *record);
+
+size_t journal_export(char *buffer, size_t size, metrics_cursor_t *cursor);
+
+void journal_task(void *arg);
@@ -21,6 +21,12 @@
 * SOFTWARE.
 */
 #include <stdio.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "esp_log.h"
 #include "lin.h"
 #include "dreamdesk.h"
 
@@ -29,40 +35,258 @@ typedef struct master_frame {
     uint8_t pid;
 } master_frame_t;
 
+typedef struct lin_master {
+    esp_timer_handle_t timer;
+    SemaphoreHandle_t lock;
+    SemaphoreHandle_t done;
+    const lin_slot_t *slots;
+    size_t size;
+    size_t slot;
+    bool in_break;
+} lin_master_t;
+
 master_frame_t master_frame = {
     .sync = LIN_HEADER_SYNC,
     .pid = 0x00
 };
 
+static const char *LIN_TAG = "lin";
+
+static lin_master_t lin_master;
+static int64_t lin_header_time = 0;
+static uint32_t lin_latency[LIN_LATENCY_BUCKETS];
+static uint32_t lin_latency_count = 0;
+static uint32_t lin_latency_over_budget = 0;
+static const lin_schedule_t *volatile lin_schedule = NULL;
+static const lin_slot_t *volatile lin_header_slot = NULL;
+
+// Frame id with its parity bits, P0 = ID0 ^ ID1 ^ ID2 ^ ID4 and P1 = !(ID1 ^ ID3 ^ ID4 ^ ID5)
+static const uint8_t protected_ids[LIN_PROTECTED_ID_MAX + 1] = {
+    0x80, 0xC1, 0x42, 0x03, 0xC4, 0x85, 0x06, 0x47,
+    0x08, 0x49, 0xCA, 0x8B, 0x4C, 0x0D, 0x8E, 0xCF,
+    0x50, 0x11, 0x92, 0xD3, 0x14, 0x55, 0xD6, 0x97,
+    0xD8, 0x99, 0x1A, 0x5B, 0x9C, 0xDD, 0x5E, 0x1F,
+    0x20, 0x61, 0xE2, 0xA3, 0x64, 0x25, 0xA6, 0xE7,
+    0xA8, 0xE9, 0x6A, 0x2B, 0xEC, 0xAD, 0x2E, 0x6F,
+    0xF0, 0xB1, 0x32, 0x73, 0xB4, 0xF5, 0x76, 0x37,
+    0x78, 0x39, 0xBA, 0xFB, 0x3C, 0x7D, 0xFE, 0xBF
+};
+
+// Sums everything first and folds the carries back in twice, which covers the nine
+// bytes of any frame, so there is no branch per byte
 uint8_t checksum(uint8_t *lin_data, uint8_t protected_id) {
-    uint16_t checksum = (protected_id & 0x3F) | parity(protected_id);
+    uint8_t id = protected_id & LIN_PROTECTED_ID_MAX;
+    uint32_t enhanced = ((LIN_CLASSIC_CHECKSUM_IDS >> id) & 0x01) - 1;
+    uint32_t checksum = protected_ids[id] & enhanced;
+
     for(uint8_t i = 0; i < LIN_DATA_SIZE; i++) {
         checksum += lin_data[i];
-        if(checksum > 0xFF) {
-            checksum -= 0xFF;
-        }
     }
+    checksum = (checksum & 0xFF) + (checksum >> 8);
+    checksum = (checksum & 0xFF) + (checksum >> 8);
     return (~checksum & 0xFF);
 }
 
 uint8_t parity(uint8_t pid) {
-    uint8_t p0 = P(pid, 0) ^ P(pid, 1) ^ P(pid, 2) ^ P(pid, 4);
-    uint8_t p1 = ~(P(pid, 1) ^ P(pid, 3) ^ P(pid, 4) ^ P(pid, 5));
-    return (p0 | (p1 << 1)) << 6;
+    return protected_ids[pid & LIN_PROTECTED_ID_MAX] & 0xC0;
 }
 
-void master_start_frame(uint8_t pid) {
-    ets_delay_us(6000);
+// Slave responses go out through here so the time since the protected id was received
+// can be tracked, only rx_task answers headers so the histogram needs no locking
+int lin_respond(const void *data, size_t size) {
+    int written = uart_write_bytes(UART_PORT, data, size);
+    uint32_t latency = esp_timer_get_time() - lin_header_time;
 
-    master_frame.pid = pid | parity(pid);
+    lin_latency[MIN(latency / LIN_LATENCY_BUCKET_US, LIN_LATENCY_BUCKETS - 1)]++;
+    lin_latency_over_budget += latency > LIN_RESPONSE_BUDGET_US;
 
-    uart_flush_input(UART_PORT);
-    xQueueReset(uart_queue);
+    if(++lin_latency_count % LIN_LATENCY_REPORT == 0) {
+        ESP_LOGI(LIN_TAG, "Response latency p50 %dus - p90 %dus - p99 %dus - %d/%d over %dus",
+                 lin_response_latency(50), lin_response_latency(90), lin_response_latency(99),
+                 lin_latency_over_budget, lin_latency_count, LIN_RESPONSE_BUDGET_US);
+    }
+    return written;
+}
+
+// Upper bound of the bucket holding the percentile, 0 before the first response
+uint32_t lin_response_latency(uint8_t percentile) {
+    uint32_t rank = (lin_latency_count * percentile + 99) / 100;
+    uint32_t count = 0;
+
+    for(uint32_t i = 0; i < LIN_LATENCY_BUCKETS && rank > 0; i++) {
+        count += lin_latency[i];
+
+        if(count >= rank) {
+            return (i + 1) * LIN_LATENCY_BUCKET_US;
+        }
+    }
+    return 0;
+}
+
+// Runs from the esp_timer task, the break is held by inverting the TX line and the
+// timer is re-armed for the end of the break and then for the next slot of the table
+static void lin_master_timer(void *arg) {
+
+    if(!lin_master.in_break) {
+        uart_flush_input(UART_PORT);
+        xQueueReset(uart_queue);
+
+        uart_set_line_inverse(UART_PORT, UART_SIGNAL_TXD_INV);
+        lin_master.in_break = true;
+        esp_timer_start_once(lin_master.timer, LIN_HEADER_BREAK_DURATION);
+        return;
+    }
 
-    uart_set_line_inverse(UART_PORT, UART_SIGNAL_TXD_INV);
-    ets_delay_us(678);
     uart_set_line_inverse(UART_PORT, UART_SIGNAL_INV_DISABLE);
+    lin_master.in_break = false;
+
+    const lin_slot_t *slot = &lin_master.slots[lin_master.slot];
+    master_frame.pid = slot->protected_id | parity(slot->protected_id);
+
+    // The response belongs to the slot that sent the header, even if the schedule changes before it arrives
+    lin_header_slot = slot;
 
     xQueueSend(uart_queue, (void*) &(uart_event_t){.type = UART_BREAK}, 0);
     uart_write_bytes(UART_PORT, &master_frame, sizeof(master_frame));
+
+    if(++lin_master.slot < lin_master.size) {
+        esp_timer_start_once(lin_master.timer, lin_master.slots[lin_master.slot].delay_us);
+    } else {
+        xSemaphoreGive(lin_master.done);
+    }
+}
+
+void lin_master_init() {
+    lin_master.lock = xSemaphoreCreateMutex();
+    lin_master.done = xSemaphoreCreateBinary();
+
+    ESP_ERROR_CHECK(esp_timer_create(&(esp_timer_create_args_t){
+        .callback = lin_master_timer,
+        .name = "lin_master"
+    }, &lin_master.timer));
 }
+
+// Sends the headers of the slots, the caller sleeps until the last one is out
+void lin_master_run(const lin_slot_t *slots, size_t size) {
+
+    if(size == 0) {
+        return;
+    }
+
+    xSemaphoreTake(lin_master.lock, portMAX_DELAY);
+    lin_master.slots = slots;
+    lin_master.size = size;
+    lin_master.slot = 0;
+    lin_master.in_break = false;
+
+    esp_timer_start_once(lin_master.timer, slots[0].delay_us);
+    xSemaphoreTake(lin_master.done, portMAX_DELAY);
+    xSemaphoreGive(lin_master.lock);
+}
+
+// The new schedule takes over at the start of the next cycle
+void lin_schedule_set(const lin_schedule_t *schedule) {
+    lin_schedule = schedule;
+}
+
+bool lin_schedule_handle(uint8_t *frame, uint8_t size) {
+    const lin_slot_t *slot = lin_header_slot;
+
+    if(slot == NULL || slot->protected_id != (frame[0] & 0x3F) || slot->handler == NULL) {
+        return false;
+    }
+
+    slot->handler(frame, size);
+    return true;
+}
+
+// Runs one cycle of the active schedule and returns its period in ticks
+TickType_t lin_schedule_cycle() {
+    const lin_schedule_t *schedule = lin_schedule;
+
+    if(schedule == NULL) {
+        return pdMS_TO_TICKS(LIN_SCHEDULE_IDLE_PERIOD_MS);
+    }
+
+    lin_master_run(schedule->slots, schedule->size);
+    return pdMS_TO_TICKS(schedule->period_ms);
+}
+
+void lin_schedule_task(void *arg) {
+    lin_schedule_set((const lin_schedule_t*) arg);
+    TickType_t last_wake_time = xTaskGetTickCount();
+
+    for(;;) {
+        vTaskDelayUntil(&last_wake_time, lin_schedule_cycle());
+    }
+}
+
+void lin_parser_reset(lin_parser_t *parser) {
+    parser->state = LIN_STATE_BREAK;
+    parser->size = 0;
+    parser->buffer[0] = LIN_HEADER_BREAK;
+    parser->buffer[1] = LIN_HEADER_SYNC;
+}
+
+lin_event_t lin_parser_feed(lin_parser_t *parser, uint8_t byte) {
+    int64_t byte_time = parser->timestamp;
+    parser->timestamp += LIN_BYTE_US;
+
+    switch(parser->state) {
+        case LIN_STATE_BREAK:
+            // The break is not always captured, a bare sync byte also starts a frame
+            if(byte == LIN_HEADER_BREAK) {
+                parser->state = LIN_STATE_SYNC;
+            } else if(byte == LIN_HEADER_SYNC) {
+                parser->state = LIN_STATE_PID;
+            }
+            break;
+        case LIN_STATE_SYNC:
+            if(byte == LIN_HEADER_SYNC) {
+                parser->state = LIN_STATE_PID;
+            } else if(byte != LIN_HEADER_BREAK) {
+                parser->state = LIN_STATE_BREAK;
+            }
+            break;
+        case LIN_STATE_PID:
+            parser->buffer[LIN_HEADER_SIZE - 1] = byte;
+            parser->size = LIN_HEADER_SIZE;
+
+            if((byte & 0xC0) != parity(byte & 0x3F)) {
+                parser->state = LIN_STATE_BREAK;
+                return LIN_EVENT_PARITY_ERROR;
+            }
+            parser->state = LIN_STATE_DATA;
+            parser->header_time = byte_time;
+            lin_header_time = byte_time;
+            return LIN_EVENT_HEADER;
+        case LIN_STATE_DATA:
+            // Nobody answered the header when the next break or sync comes later than any
+            // response may start, the UART does not report every break
+            if(parser->size == LIN_HEADER_SIZE && byte_time - parser->header_time > LIN_RESPONSE_BUDGET_US + LIN_BYTE_US) {
+
+                if(byte == LIN_HEADER_BREAK) {
+                    parser->state = LIN_STATE_SYNC;
+                    break;
+                } else if(byte == LIN_HEADER_SYNC) {
+                    parser->state = LIN_STATE_PID;
+                    break;
+                }
+            }
+            parser->buffer[parser->size++] = byte;
+
+            if(parser->size == LIN_HEADER_SIZE + LIN_DATA_SIZE) {
+                parser->state = LIN_STATE_CHECKSUM;
+            }
+            break;
+        case LIN_STATE_CHECKSUM:
+            parser->buffer[parser->size++] = byte;
+            parser->state = LIN_STATE_BREAK;
+
+            if(checksum(&parser->buffer[LIN_HEADER_SIZE], parser->buffer[LIN_HEADER_SIZE - 1]) != byte) {
+                return LIN_EVENT_CHECKSUM_ERROR;
+            }
+            return LIN_EVENT_FRAME;
+    }
+    return LIN_EVENT_NONE;
+}
\ No newline at end of file
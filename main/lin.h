@@ -20,7 +20,9 @@
 * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 * SOFTWARE.
 */
+#pragma once
 #include <stdio.h>
+#include <stdbool.h>
 #include "driver/uart.h"
 
 #define LIN_BAUD_RATE               (19200)
@@ -32,11 +34,86 @@
 #define LIN_CHECKSUM_SIZE           (0x01)
 #define LIN_PROTECTED_ID_MIN        (0x00)
 #define LIN_PROTECTED_ID_MAX        (0x3F)
+#define LIN_PROTECTED_ID_DIAG_REQ   (0x3C)
+#define LIN_PROTECTED_ID_DIAG_RSP   (0x3D)
+#define LIN_MAX_DATA_SIZE           (0x08)
+#define LIN_FRAME_MAX_SIZE          (LIN_HEADER_SIZE + LIN_MAX_DATA_SIZE + LIN_CHECKSUM_SIZE)
+#define LIN_FRAME_TIMEOUT_US        (5000)
+#define LIN_BYTE_US                 ((10 * 1000000) / LIN_BAUD_RATE)
+#define LIN_EVENT_BUFFER_SIZE       (128)
+#define LIN_FRAME_SPACE_US          (6000)
+#define LIN_SCHEDULE_IDLE_PERIOD_MS (100)
+#define LIN_HEADER_BITS             (34)
+#define LIN_LATENCY_BUCKET_US       (50)
+#define LIN_LATENCY_BUCKETS         (128)
+#define LIN_LATENCY_REPORT          (1000)
 
-#define P(pid, shift) ((pid & (1 << shift)) >> shift)
+// The slack allowed by the maximum frame time (1.4 times the nominal one) for the response space
+#define LIN_RESPONSE_BUDGET_US      ((((LIN_HEADER_BITS + 10 * (LIN_DATA_SIZE + LIN_CHECKSUM_SIZE)) * 4) \
+                                      * 100000) / LIN_BAUD_RATE)
+
+// Frames using the LIN 1.x classic checksum over the data only, one bit per frame id,
+// the build can set it or a desk header can redefine it like LIN_DATA_SIZE
+#ifndef LIN_CLASSIC_CHECKSUM_IDS
+#define LIN_CLASSIC_CHECKSUM_IDS    ((1ULL << LIN_PROTECTED_ID_DIAG_REQ) | (1ULL << LIN_PROTECTED_ID_DIAG_RSP))
+#endif
+
+typedef enum lin_state {LIN_STATE_BREAK, LIN_STATE_SYNC, LIN_STATE_PID,
+                        LIN_STATE_DATA, LIN_STATE_CHECKSUM} lin_state_t;
+
+typedef enum lin_event {LIN_EVENT_NONE, LIN_EVENT_HEADER, LIN_EVENT_FRAME,
+                        LIN_EVENT_PARITY_ERROR, LIN_EVENT_CHECKSUM_ERROR} lin_event_t;
+
+// Byte level receive state machine, the buffer always holds break, sync, pid,
+// data and checksum so a completed frame can be handed out without copying.
+// The timestamp is set by the receiver to the arrival time of the next byte fed,
+// the parser moves it on by one byte time for every byte.
+typedef struct lin_parser {
+    lin_state_t state;
+    uint8_t size;
+    int64_t timestamp;
+    int64_t header_time;
+    uint8_t buffer[LIN_FRAME_MAX_SIZE];
+} lin_parser_t;
+
+// Called from rx_task with the frame starting at the protected id, size is the size
+// of the received event so the header alone can be answered before the full frame
+typedef void (*lin_handler_t)(uint8_t *frame, uint8_t size);
+
+// One entry of a master schedule table, the header is sent delay_us after the previous one
+typedef struct lin_slot {
+    uint8_t protected_id;
+    uint32_t delay_us;
+    lin_handler_t handler;
+} lin_slot_t;
+
+// The slots are sent in order once per period, a cycle longer than the period starts the next one late
+typedef struct lin_schedule {
+    const lin_slot_t *slots;
+    size_t size;
+    uint32_t period_ms;
+} lin_schedule_t;
 
 uint8_t checksum(uint8_t *lin_frame, uint8_t protected_id);
 
 uint8_t parity(uint8_t pid);
 
-void master_start_frame(uint8_t pid);
+int lin_respond(const void *data, size_t size);
+
+uint32_t lin_response_latency(uint8_t percentile);
+
+void lin_master_init();
+
+void lin_master_run(const lin_slot_t *slots, size_t size);
+
+void lin_schedule_set(const lin_schedule_t *schedule);
+
+bool lin_schedule_handle(uint8_t *frame, uint8_t size);
+
+TickType_t lin_schedule_cycle();
+
+void lin_schedule_task(void *arg);
+
+void lin_parser_reset(lin_parser_t *parser);
+
+lin_event_t lin_parser_feed(lin_parser_t *parser, uint8_t byte);
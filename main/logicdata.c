@@ -22,9 +22,10 @@
 */
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "stdlib.h"
 #include "esp_log.h"
-#include "math.h"
 #include "logicdata.h"
+#include "metrics.h"
 
 static const char *LOGICDATA_TAG = "logicdata";
 uint8_t desk_sleep = true;
@@ -39,8 +40,43 @@ response_frame_t response_frame = {
     .checksum = 0x00
 };
 
+// Responses to the move header are staged ahead of time, rx_task only sends the ready one
+static response_frame_t staged_frames[2];
+static volatile uint8_t staged_index = 0;
+static volatile bool staged_pending = false;
+static portMUX_TYPE staged_lock = portMUX_INITIALIZER_UNLOCKED;
+
 status_frame_t *status_frame = NULL;
 
+// The controller repeats its error in every status frame, only a new code is counted
+static uint8_t desk_error_code = 0x00;
+
+// Prepares the frame that is not being sent from the current move intent and a fresh random byte
+static void desk_stage_response() {
+    uint8_t random = rand() % 0xFF;
+
+    portENTER_CRITICAL(&staged_lock);
+    response_frame_t *staged = &staged_frames[staged_index ^ 0x01];
+    *staged = response_frame;
+    staged->random = random;
+    staged->checksum = checksum((uint8_t*) staged, LIN_PROTECTED_ID_MOVE | parity(LIN_PROTECTED_ID_MOVE));
+    staged_pending = true;
+    portEXIT_CRITICAL(&staged_lock);
+}
+
+static void desk_send_response() {
+    portENTER_CRITICAL(&staged_lock);
+
+    if(staged_pending) {
+        staged_index ^= 0x01;
+        staged_pending = false;
+    }
+    response_frame_t *response = &staged_frames[staged_index];
+    portEXIT_CRITICAL(&staged_lock);
+
+    lin_respond(response, sizeof(*response));
+}
+
 void desk_wake_up() {
     uint8_t cafebabe[] = {0xCA, 0xFE, 0xBA, 0xBE};
     uart_write_bytes(UART_PORT, cafebabe, sizeof(cafebabe));
@@ -52,6 +88,7 @@ void desk_move(uint8_t direction) {
     if(response_frame.action == DESK_IDLE) {
         response_frame.direction = direction;
         response_frame.action = DESK_MOVE;
+        desk_stage_response();
 
         if(desk_sleep) {
             desk_wake_up();
@@ -82,8 +119,10 @@ void desk_stop() {
     }
     ESP_LOGI(LOGICDATA_TAG, "Stopping desk!");
     response_frame.action = DESK_STOP;
+    desk_stage_response();
     vTaskDelay(10);
     response_frame.action = DESK_IDLE;
+    desk_stage_response();
 }
 
 void desk_handle_lin_frame(lin_frame_t *lin_frame, uint8_t *event_data, uint8_t event_size) {
@@ -93,39 +132,28 @@ void desk_handle_lin_frame(lin_frame_t *lin_frame, uint8_t *event_data, uint8_t
     if(protected_id == LIN_PROTECTED_ID_SYNC) {
 
         if(event_size > LIN_HEADER_SIZE) {
-            ESP_LOGI(LOGICDATA_TAG, "Pairing sequence %d%%", (uint8_t)((lin_frame->data[0] / 7.0) * 100));
+            ESP_LOGI(LOGICDATA_TAG, "Pairing sequence %d%%", (lin_frame->data[0] * 100) / 7);
             ESP_LOG_BUFFER_HEX_LEVEL(LOGICDATA_TAG, event_data, event_size, ESP_LOG_DEBUG);
         }
     } else if(protected_id == LIN_PROTECTED_ID_MOVE) {
 
-        if(response_frame.action != DESK_IDLE) {
-            response_frame.random = rand() % 0xFF;                        
-            response_frame.checksum = checksum((uint8_t*) &response_frame, lin_frame->protected_id);
-            uart_write_bytes(UART_PORT, &response_frame, sizeof(response_frame));
+        if(event_size == LIN_HEADER_SIZE && response_frame.action != DESK_IDLE) {
+            desk_send_response();
+            // The next frame gets its own random byte once this one is on the wire
+            desk_stage_response();
         }
     } else if(protected_id == LIN_PROTECTED_ID_STATUS) {
 
+        // Wait for the controller response following the header
         if(event_size < (LIN_HEADER_SIZE + LIN_DATA_SIZE + LIN_CHECKSUM_SIZE)) {
-            ESP_LOGW(LOGICDATA_TAG, "Status event too small");
-            ESP_LOG_BUFFER_HEX_LEVEL(LOGICDATA_TAG, event_data, event_size, ESP_LOG_WARN);
             return;
         }
 
         status_frame = (status_frame_t*) lin_frame;
 
         if(status_frame->ready == DESK_READY) {
-            uint8_t new_desk_height = round(((lin_frame->data[3] << 8) + lin_frame->data[4]) / 10.0);
-
-            if(new_desk_height != current_desk_height) {
-
-                if(current_desk_height == 0xFF) {
-                    target_desk_height = new_desk_height;
-                }
-
-                current_desk_height = new_desk_height;
-                desk_percentage = round((lin_frame->data[5] / 255.0) * 100);
-                ESP_LOGI(LOGICDATA_TAG, "Desk height %dcm @ %d%%", current_desk_height, desk_percentage);
-            }
+            desk_error_code = 0x00;
+            desk_update_height((lin_frame->data[3] << 8) | lin_frame->data[4]);
         } else if(status_frame->ready == DESK_NOT_READY) {
 
             if(status_frame->status == DESK_PAIRING) {
@@ -143,6 +171,11 @@ void desk_handle_lin_frame(lin_frame_t *lin_frame, uint8_t *event_data, uint8_t
                 }
             } else if(status_frame->status == DESK_ERROR) {
 
+                if(status_frame->error_code != desk_error_code) {
+                    desk_error_code = status_frame->error_code;
+                    metrics_count_desk_error(desk_error_code);
+                }
+
                 switch(status_frame->error_code) {
                     case 0x01:
                         ESP_LOGE(LOGICDATA_TAG, "Firmware Error: Disconnect the Power Unit "
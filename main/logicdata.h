@@ -21,10 +21,11 @@
 * SOFTWARE.
 */
 #include <stdio.h>
+#include <stdbool.h>
 #include "lin.h"
 
-#define DESK_MIN_HEIGHT         (60)
-#define DESK_MAX_HEIGHT         (120)
+#define DESK_MIN_HEIGHT         (600)
+#define DESK_MAX_HEIGHT         (1200)
 
 #define UART_PORT               (UART_NUM_2)
 
@@ -77,13 +78,10 @@ typedef struct response_frame {
     uint8_t checksum;
 } response_frame_t;
 
-extern uint8_t current_desk_height;
-extern uint8_t target_desk_height;
-extern uint8_t desk_percentage;
-
 extern uint8_t desk_ready;
 extern uint8_t desk_reset;
-extern uint8_t desk_control;
+
+void desk_update_height(uint16_t height);
 
 void desk_wake_up();
 
@@ -21,11 +21,15 @@
 * SOFTWARE.
 */
 #include "dreamdesk.h"
+#include "motion.h"
+#include "presets.h"
+#include "metrics.h"
 #if defined(WIFI_ON)
 #include "wifi.h"
 #endif
 #if defined(SENSORS_ON)
 #include "sensors.h"
+#include "statistics.h"
 #endif
 #if defined(OTA_UPDATES_ON)
 #include "ota.h"
@@ -36,6 +40,12 @@
 #if defined(HOMEKIT)
 #include "homekit.h"
 #endif
+#if defined(API_ON)
+#include "api.h"
+#endif
+#if defined(JOURNAL_ON)
+#include "journal.h"
+#endif
 #include "esp_log.h"
 #include "string.h"
 #include "freertos/FreeRTOS.h"
@@ -45,11 +55,20 @@
 static const char *DREAMDESK_TAG = "dreamdesk";
 
 void app_main() {
+    TaskHandle_t task = NULL;
+
     esp_log_level_set(DREAMDESK_TAG, ESP_LOG_INFO);
     ESP_LOGI(DREAMDESK_TAG, "Hello there!");
 
     chip_info();
     memory_init();
+    motion_init();
+    presets_init();
+    desk_state_init();
+
+    #if defined(LIN_MASTER)
+    lin_master_init();
+    #endif
 
     #if defined(WIFI_ON)
     app_wifi_credentials();
@@ -57,17 +76,36 @@ void app_main() {
     app_wifi_connect();
     #endif
 
+    #if defined(JOURNAL_ON)
+    if(journal_init()) {
+        xTaskCreate(journal_task, "journal_task", JOURNAL_STACK_SIZE, NULL, configMAX_PRIORITIES-10, &task);
+        metrics_add_task(task);
+    }
+    #endif
+
     #if defined(SENSORS_ON)
-    xTaskCreate(sensors_task, "sensors_task", UART_STACK_SIZE, NULL, configMAX_PRIORITIES-9, NULL);
+    statistics_init();
+    xTaskCreate(sensors_task, "sensors_task", UART_STACK_SIZE, NULL, configMAX_PRIORITIES-9, &task);
+    metrics_add_task(task);
     #endif
 
     #if defined(HOMEKIT) || defined(NEST) || defined(ALEXA)
-    xTaskCreate(home_task, "home_task", HOMEKIT_STACK_SIZE, NULL, configMAX_PRIORITIES-7, NULL);
+    xTaskCreate(home_task, "home_task", HOMEKIT_STACK_SIZE, NULL, configMAX_PRIORITIES-7, &task);
+    metrics_add_task(task);
     #endif
 
-    xTaskCreate(usb_task, "usb_task", UART_STACK_SIZE, NULL, configMAX_PRIORITIES-5, NULL);
-    xTaskCreate(move_task, "move_task", UART_STACK_SIZE, NULL, configMAX_PRIORITIES-3, NULL);
-    xTaskCreate(rx_task, "rx_task", UART_STACK_SIZE, NULL, configMAX_PRIORITIES-1, NULL);
+    xTaskCreate(usb_task, "usb_task", UART_STACK_SIZE, NULL, configMAX_PRIORITIES-5, &task);
+    metrics_add_task(task);
+    xTaskCreate(move_task, "move_task", UART_STACK_SIZE, NULL, configMAX_PRIORITIES-3, &task);
+    metrics_add_task(task);
+    xTaskCreate(rx_task, "rx_task", UART_STACK_SIZE, NULL, configMAX_PRIORITIES-1, &task);
+    metrics_add_task(task);
+
+    #if defined(LIN_MASTER)
+    xTaskCreate(lin_schedule_task, "lin_schedule_task", UART_STACK_SIZE, (void*) LIN_MASTER_SCHEDULE,
+                configMAX_PRIORITIES-2, &task);
+    metrics_add_task(task);
+    #endif
 
     #if defined(OTA_UPDATES_ON)
     const esp_partition_t *running_partition = esp_ota_get_running_partition();
@@ -89,11 +127,18 @@ void app_main() {
             }
         }
     }
-    xTaskCreate(ota_task, "ota_task", OTA_STACK_SIZE, NULL, configMAX_PRIORITIES-8, NULL);
+    xTaskCreate(ota_task, "ota_task", OTA_STACK_SIZE, NULL, configMAX_PRIORITIES-8, &task);
+    metrics_add_task(task);
     #endif
 
     #if defined(DDNS_ON)
-    xTaskCreate(ddns_task, "ddns_task", OTA_STACK_SIZE, NULL, configMAX_PRIORITIES-9, NULL);
+    xTaskCreate(ddns_task, "ddns_task", OTA_STACK_SIZE, NULL, configMAX_PRIORITIES-9, &task);
+    metrics_add_task(task);
+    #endif
+
+    #if defined(API_ON)
+    xTaskCreate(api_task, "api_task", API_STACK_SIZE, NULL, configMAX_PRIORITIES-9, &task);
+    metrics_add_task(task);
     #endif
 
     gpio_config(&(gpio_config_t){
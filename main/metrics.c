@@ -0,0 +1,233 @@
+/* MIT License
+*
+* Copyright (c) 2022 ma-lwa-re
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "dreamdesk.h"
+#include "metrics.h"
+
+typedef struct metrics_writer {
+    char *buffer;
+    size_t size;
+    size_t length;
+    uint32_t line;
+    uint32_t skip;
+    bool full;
+} metrics_writer_t;
+
+typedef struct metrics_histogram_data {
+    atomic_uint buckets[METRICS_HISTOGRAM_BUCKETS + 1];
+    atomic_llong sum;
+} metrics_histogram_data_t;
+
+#define METRICS_NAME(id, name, help) name,
+#define METRICS_HELP(id, name, help) help,
+
+static const char *metrics_counter_names[] = {METRICS_COUNTERS(METRICS_NAME)};
+static const char *metrics_counter_help[] = {METRICS_COUNTERS(METRICS_HELP)};
+static const char *metrics_histogram_names[] = {METRICS_HISTOGRAMS(METRICS_NAME)};
+static const char *metrics_histogram_help[] = {METRICS_HISTOGRAMS(METRICS_HELP)};
+
+// Upper bounds of every bucket but the last one, which catches everything above
+static const int32_t metrics_bounds[METRICS_HISTOGRAM_COUNT][METRICS_HISTOGRAM_BUCKETS] = {
+    [METRICS_MOVE_LATENCY] = {1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000},
+    [METRICS_MOVE_OVERSHOOT] = {-10, -5, -2, 0, 2, 5, 10, 20}
+};
+
+static atomic_uint metrics_counters[METRICS_COUNTER_COUNT];
+static atomic_uint metrics_lin_frames[METRICS_LIN_IDS];
+static atomic_uint metrics_desk_errors[METRICS_DESK_ERRORS];
+static metrics_histogram_data_t metrics_histograms[METRICS_HISTOGRAM_COUNT];
+static TaskHandle_t metrics_tasks[METRICS_TASKS];
+static uint8_t metrics_task_count = 0;
+
+// Relaxed increments only, safe from rx_task and any other task without a lock
+void metrics_count(metrics_counter_t counter) {
+    atomic_fetch_add_explicit(&metrics_counters[counter], 1, memory_order_relaxed);
+}
+
+void metrics_count_lin_frame(uint8_t protected_id) {
+    atomic_fetch_add_explicit(&metrics_lin_frames[protected_id & LIN_PROTECTED_ID_MAX], 1, memory_order_relaxed);
+}
+
+// Codes past the table are counted as 0x00, which the desks never report
+void metrics_count_desk_error(uint8_t error_code) {
+    error_code = error_code < METRICS_DESK_ERRORS ? error_code : 0x00;
+    atomic_fetch_add_explicit(&metrics_desk_errors[error_code], 1, memory_order_relaxed);
+}
+
+void metrics_observe(metrics_histogram_t histogram, int32_t value) {
+    metrics_histogram_data_t *data = &metrics_histograms[histogram];
+    uint8_t bucket = 0;
+
+    while(bucket < METRICS_HISTOGRAM_BUCKETS && value > metrics_bounds[histogram][bucket]) {
+        bucket++;
+    }
+    atomic_fetch_add_explicit(&data->buckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&data->sum, value, memory_order_relaxed);
+}
+
+// Tasks are registered once at startup, before the first scrape, and never deleted afterwards
+bool metrics_add_task(TaskHandle_t task) {
+
+    if(task == NULL || metrics_task_count >= METRICS_TASKS) {
+        return false;
+    }
+    metrics_tasks[metrics_task_count++] = task;
+    return true;
+}
+
+// Every line keeps its place in the scrape even when it is left out, so a scrape
+// resumed in the next buffer never repeats or loses a line
+static void metrics_line(metrics_writer_t *writer, bool emit, const char *format, ...) {
+
+    if(writer->full) {
+        return;
+    }
+
+    if(emit && writer->line >= writer->skip) {
+        va_list args;
+        va_start(args, format);
+        int length = vsnprintf(writer->buffer + writer->length, writer->size - writer->length, format, args);
+        va_end(args);
+
+        if(length < 0 || length >= writer->size - writer->length) {
+            writer->buffer[writer->length] = '\0';
+            writer->full = true;
+            return;
+        }
+        writer->length += length;
+    }
+    writer->line++;
+}
+
+static void metrics_type(metrics_writer_t *writer, const char *name, const char *help, const char *type) {
+    metrics_line(writer, true, "# HELP %s %s\n", name, help);
+    metrics_line(writer, true, "# TYPE %s %s\n", name, type);
+}
+
+static void metrics_export_desk(metrics_writer_t *writer) {
+    desk_state_t state = desk_get_state();
+    desk_command_stats_t command_stats = desk_get_command_stats();
+    desk_move_stats_t move_stats = desk_get_move_stats();
+
+    metrics_type(writer, "dreamdesk_height_mm", "Last height reported by the desk", "gauge");
+    metrics_line(writer, state.height_valid, "dreamdesk_height_mm %u\n", state.current_height);
+    metrics_type(writer, "dreamdesk_target_mm", "Height the desk is moving to", "gauge");
+    metrics_line(writer, state.height_valid, "dreamdesk_target_mm %u\n", state.target_height);
+    metrics_type(writer, "dreamdesk_commands_total", "Commands applied by move_task", "counter");
+    metrics_line(writer, true, "dreamdesk_commands_total %u\n", command_stats.commands);
+    metrics_type(writer, "dreamdesk_commands_dropped_total", "Commands dropped on a full queue", "counter");
+    metrics_line(writer, true, "dreamdesk_commands_dropped_total %u\n", command_stats.dropped);
+    metrics_type(writer, "dreamdesk_command_latency_max_us", "Slowest command to motion decision", "gauge");
+    metrics_line(writer, true, "dreamdesk_command_latency_max_us %u\n", command_stats.latency_max_us);
+    metrics_type(writer, "dreamdesk_move_wakeups_total", "Times move_task woke up", "counter");
+    metrics_line(writer, true, "dreamdesk_move_wakeups_total %u\n", move_stats.wakeups);
+}
+
+static void metrics_export_counters(metrics_writer_t *writer) {
+
+    for(uint8_t i = 0; i < METRICS_COUNTER_COUNT; i++) {
+        metrics_type(writer, metrics_counter_names[i], metrics_counter_help[i], "counter");
+        metrics_line(writer, true, "%s %u\n", metrics_counter_names[i],
+                     atomic_load_explicit(&metrics_counters[i], memory_order_relaxed));
+    }
+
+    // Only the ids and codes seen on this bus are listed
+    metrics_type(writer, "dreamdesk_lin_frames_total", "Complete LIN frames by frame id", "counter");
+
+    for(uint8_t i = 0; i < METRICS_LIN_IDS; i++) {
+        uint32_t frames = atomic_load_explicit(&metrics_lin_frames[i], memory_order_relaxed);
+        metrics_line(writer, frames > 0, "dreamdesk_lin_frames_total{id=\"0x%02x\"} %u\n", i, frames);
+    }
+    metrics_type(writer, "dreamdesk_desk_errors_total", "Errors reported by the desk controller by code", "counter");
+
+    for(uint8_t i = 0; i < METRICS_DESK_ERRORS; i++) {
+        uint32_t errors = atomic_load_explicit(&metrics_desk_errors[i], memory_order_relaxed);
+        metrics_line(writer, errors > 0, "dreamdesk_desk_errors_total{code=\"0x%02x\"} %u\n", i, errors);
+    }
+}
+
+static void metrics_export_histograms(metrics_writer_t *writer) {
+
+    for(uint8_t i = 0; i < METRICS_HISTOGRAM_COUNT; i++) {
+        const char *name = metrics_histogram_names[i];
+        uint32_t count = 0;
+
+        metrics_type(writer, name, metrics_histogram_help[i], "histogram");
+
+        for(uint8_t bucket = 0; bucket < METRICS_HISTOGRAM_BUCKETS; bucket++) {
+            count += atomic_load_explicit(&metrics_histograms[i].buckets[bucket], memory_order_relaxed);
+            metrics_line(writer, true, "%s_bucket{le=\"%d\"} %u\n", name, metrics_bounds[i][bucket], count);
+        }
+        count += atomic_load_explicit(&metrics_histograms[i].buckets[METRICS_HISTOGRAM_BUCKETS], memory_order_relaxed);
+        metrics_line(writer, true, "%s_bucket{le=\"+Inf\"} %u\n", name, count);
+        metrics_line(writer, true, "%s_sum %lld\n", name,
+                     (long long) atomic_load_explicit(&metrics_histograms[i].sum, memory_order_relaxed));
+        metrics_line(writer, true, "%s_count %u\n", name, count);
+    }
+}
+
+static void metrics_export_system(metrics_writer_t *writer) {
+    metrics_type(writer, "dreamdesk_uptime_seconds", "Time since boot", "gauge");
+    metrics_line(writer, true, "dreamdesk_uptime_seconds %lld\n", (long long) esp_timer_get_time() / 1000000);
+    metrics_type(writer, "dreamdesk_heap_free_bytes", "Heap free right now", "gauge");
+    metrics_line(writer, true, "dreamdesk_heap_free_bytes %u\n", esp_get_free_heap_size());
+    metrics_type(writer, "dreamdesk_heap_min_free_bytes", "Lowest heap free since boot", "gauge");
+    metrics_line(writer, true, "dreamdesk_heap_min_free_bytes %u\n", esp_get_minimum_free_heap_size());
+    metrics_type(writer, "dreamdesk_task_stack_min_free_bytes", "Lowest stack free since the task started", "gauge");
+
+    for(uint8_t i = 0; i < METRICS_TASKS; i++) {
+        bool registered = i < metrics_task_count;
+
+        metrics_line(writer, registered, "dreamdesk_task_stack_min_free_bytes{task=\"%s\"} %u\n",
+                     registered ? pcTaskGetName(metrics_tasks[i]) : "",
+                     registered ? uxTaskGetStackHighWaterMark(metrics_tasks[i]) : 0);
+    }
+}
+
+// Writes as many whole lines as fit in the buffer, from where the previous call stopped.
+// The buffer is always NUL terminated and the cursor is done once the last line is out.
+size_t metrics_export(char *buffer, size_t size, metrics_cursor_t *cursor) {
+    metrics_writer_t writer = {.buffer = buffer, .size = size, .skip = cursor->line};
+
+    if(size == 0) {
+        return 0;
+    }
+    buffer[0] = '\0';
+
+    metrics_export_desk(&writer);
+    metrics_export_counters(&writer);
+    metrics_export_histograms(&writer);
+    metrics_export_system(&writer);
+
+    // A line longer than the whole buffer is dropped rather than stalling the scrape
+    if(writer.full && writer.length == 0) {
+        writer.line++;
+    }
+    cursor->line = writer.line;
+    cursor->done = !writer.full;
+    return writer.length;
+}
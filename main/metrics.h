@@ -0,0 +1,79 @@
+/* MIT License
+*
+* Copyright (c) 2022 ma-lwa-re
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define METRICS_LIN_IDS                 (64)
+#define METRICS_DESK_ERRORS             (32)
+#define METRICS_HISTOGRAM_BUCKETS       (8)
+#define METRICS_TASKS                   (10)
+
+// COUNTER(id, name, help), every counter only ever goes up and wraps at 2^32
+#define METRICS_COUNTERS(COUNTER) \
+    COUNTER(LIN_PARITY_ERRORS, "dreamdesk_lin_parity_errors_total", "LIN headers with a bad protected id parity") \
+    COUNTER(LIN_CHECKSUM_ERRORS, "dreamdesk_lin_checksum_errors_total", "LIN frames dropped on a bad checksum") \
+    COUNTER(LIN_OVERFLOWS, "dreamdesk_lin_overflows_total", "UART overflows that flushed the LIN input") \
+    COUNTER(SENSORS_READ_ERRORS, "dreamdesk_sensors_read_errors_total", "SCD4x measurements that failed to read") \
+    COUNTER(SENSORS_EEPROM_WRITES, "dreamdesk_sensors_eeprom_writes_total", "SCD4x settings written to its EEPROM") \
+    COUNTER(OTA_CHECKS, "dreamdesk_ota_checks_total", "Update checks against the OTA server") \
+    COUNTER(OTA_FAILURES, "dreamdesk_ota_failures_total", "Update downloads that did not complete or validate") \
+    COUNTER(WIFI_RECONNECTS, "dreamdesk_wifi_reconnects_total", "Reconnections after losing the access point") \
+    COUNTER(API_CONNECTIONS, "dreamdesk_api_connections_total", "Local API connections accepted") \
+    COUNTER(API_REJECTED, "dreamdesk_api_rejected_total", "Local API connections closed with every slot busy") \
+    COUNTER(API_REQUESTS, "dreamdesk_api_requests_total", "Local API requests handled") \
+    COUNTER(API_ERRORS, "dreamdesk_api_errors_total", "Local API requests answered with an error") \
+    COUNTER(JOURNAL_SECTORS, "dreamdesk_journal_sectors_total", "Journal flash sectors erased and started") \
+    COUNTER(JOURNAL_DROPPED, "dreamdesk_journal_dropped_total", "Journal records lost to a full queue or a flash error")
+
+// HISTOGRAM(id, name, help), the bucket bounds are set in metrics.c
+#define METRICS_HISTOGRAMS(HISTOGRAM) \
+    HISTOGRAM(MOVE_LATENCY, "dreamdesk_move_latency_us", "Time from a queued command to the first motion decision") \
+    HISTOGRAM(MOVE_OVERSHOOT, "dreamdesk_move_overshoot_mm", "Distance the desk came to rest past its target")
+
+#define METRICS_ID(id, name, help) METRICS_##id,
+
+typedef enum metrics_counter {METRICS_COUNTERS(METRICS_ID) METRICS_COUNTER_COUNT} metrics_counter_t;
+
+typedef enum metrics_histogram {METRICS_HISTOGRAMS(METRICS_ID) METRICS_HISTOGRAM_COUNT} metrics_histogram_t;
+
+// Resumes a scrape that did not fit in one buffer, line is the first line not sent yet
+typedef struct metrics_cursor {
+    uint32_t line;
+    bool done;
+} metrics_cursor_t;
+
+void metrics_count(metrics_counter_t counter);
+
+void metrics_count_lin_frame(uint8_t protected_id);
+
+void metrics_count_desk_error(uint8_t error_code);
+
+void metrics_observe(metrics_histogram_t histogram, int32_t value);
+
+bool metrics_add_task(TaskHandle_t task);
+
+size_t metrics_export(char *buffer, size_t size, metrics_cursor_t *cursor);
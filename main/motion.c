@@ -0,0 +1,212 @@
+/* MIT License
+*
+* Copyright (c) 2022 ma-lwa-re
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "nvs_flash.h"
+#include "nvs.h"
+#include "string.h"
+#include "motion.h"
+#include "metrics.h"
+
+static const char *MOTION_TAG = "motion";
+
+// rx_task feeds the heights while move_task decides on them, on either core, so every
+// access goes through the lock and nothing logs or touches NVS while holding it
+static portMUX_TYPE motion_lock = portMUX_INITIALIZER_UNLOCKED;
+static motion_t motion;
+
+void motion_init() {
+    uint16_t stop_time[2] = {MOTION_DEFAULT_STOP_TIME, MOTION_DEFAULT_STOP_TIME};
+    nvs_handle_t nvs_handle;
+    bool found = nvs_open(MOTION_NVS_NAMESPACE, NVS_READONLY, &nvs_handle) == ESP_OK;
+
+    if(found) {
+        nvs_get_u16(nvs_handle, MOTION_NVS_KEY_UP, &stop_time[MOTION_UP]);
+        nvs_get_u16(nvs_handle, MOTION_NVS_KEY_DOWN, &stop_time[MOTION_DOWN]);
+        nvs_close(nvs_handle);
+    }
+
+    portENTER_CRITICAL(&motion_lock);
+    memset(&motion, 0x00, sizeof(motion));
+    motion.stop_time[MOTION_UP] = stop_time[MOTION_UP];
+    motion.stop_time[MOTION_DOWN] = stop_time[MOTION_DOWN];
+    portEXIT_CRITICAL(&motion_lock);
+
+    if(!found) {
+        ESP_LOGW(MOTION_TAG, "No learned stopping time, using %dms", MOTION_DEFAULT_STOP_TIME);
+        return;
+    }
+    ESP_LOGI(MOTION_TAG, "Stopping time %dms up - %dms down", stop_time[MOTION_UP], stop_time[MOTION_DOWN]);
+}
+
+// Called with the lock held, returns the distance the desk took to stop or -1 when it was too slow to tell
+static int32_t motion_learn(int32_t height, int32_t *stop_time) {
+    int32_t stop_velocity = abs(motion.stop_velocity);
+    motion.stopping = false;
+
+    if(stop_velocity < MOTION_MIN_VELOCITY) {
+        return -1;
+    }
+
+    uint8_t direction = motion.stop_velocity > 0 ? MOTION_UP : MOTION_DOWN;
+
+    // Positive past the target in the direction of travel, negative when it stopped short
+    metrics_observe(METRICS_MOVE_OVERSHOOT, direction == MOTION_UP ? height - motion.stop_target
+                                                                   : motion.stop_target - height);
+    int32_t stop_distance = abs(height - motion.stop_height);
+    *stop_time = (stop_distance * 1000) / stop_velocity;
+    *stop_time = (motion.stop_time[direction] * 3 + *stop_time) / 4;
+    *stop_time = *stop_time > MOTION_MAX_STOP_TIME ? MOTION_MAX_STOP_TIME : *stop_time;
+
+    if(*stop_time != motion.stop_time[direction]) {
+        motion.stop_time[direction] = *stop_time;
+        motion.learned = true;
+    }
+    return stop_distance;
+}
+
+// Returns true once a new stopping time was learned and waits for motion_persist
+bool motion_update(int32_t height, int64_t timestamp) {
+    int32_t stop_distance = -1, stop_time = 0, stop_velocity = 0;
+
+    portENTER_CRITICAL(&motion_lock);
+    motion_sample_t *latest = &motion.samples[(motion.sample_index + MOTION_SAMPLES - 1) % MOTION_SAMPLES];
+
+    // The desk settled once the height stays the same for long enough after a stop
+    if(motion.sample_count > 0 && height == latest->height) {
+
+        if(motion.stopping && timestamp - motion.settle_timestamp > MOTION_SETTLE_US) {
+            stop_velocity = motion.stop_velocity;
+            stop_distance = motion_learn(height, &stop_time);
+        }
+    } else {
+        motion.settle_timestamp = timestamp;
+    }
+
+    motion.samples[motion.sample_index] = (motion_sample_t) {.height = height, .timestamp = timestamp};
+    motion.sample_index = (motion.sample_index + 1) % MOTION_SAMPLES;
+    motion.sample_count = motion.sample_count < MOTION_SAMPLES ? motion.sample_count + 1 : MOTION_SAMPLES;
+
+    // Estimate the velocity over the oldest sample still inside the window
+    motion_sample_t *oldest = NULL;
+
+    for(uint8_t i = motion.sample_count; i > 0; i--) {
+        oldest = &motion.samples[(motion.sample_index + MOTION_SAMPLES - i) % MOTION_SAMPLES];
+
+        if(timestamp - oldest->timestamp <= MOTION_VELOCITY_WINDOW_US) {
+            break;
+        }
+    }
+
+    if(timestamp > oldest->timestamp) {
+        motion.velocity = ((height - oldest->height) * 1000000LL) / (timestamp - oldest->timestamp);
+    } else {
+        motion.velocity = 0;
+    }
+    bool learned = motion.learned;
+    portEXIT_CRITICAL(&motion_lock);
+
+    if(stop_distance >= 0) {
+        ESP_LOGI(MOTION_TAG, "Stopped %dmm after %dmm/s, stopping time %dms %s", stop_distance,
+                 abs(stop_velocity), stop_time, stop_velocity > 0 ? "up" : "down");
+    }
+    return learned;
+}
+
+bool motion_valid() {
+    portENTER_CRITICAL(&motion_lock);
+    bool valid = motion.sample_count > 0;
+    portEXIT_CRITICAL(&motion_lock);
+    return valid;
+}
+
+static int32_t motion_latest_height() {
+    return motion.samples[(motion.sample_index + MOTION_SAMPLES - 1) % MOTION_SAMPLES].height;
+}
+
+int32_t motion_height() {
+    portENTER_CRITICAL(&motion_lock);
+    int32_t height = motion_latest_height();
+    portEXIT_CRITICAL(&motion_lock);
+    return height;
+}
+
+int32_t motion_velocity() {
+    portENTER_CRITICAL(&motion_lock);
+    int32_t velocity = motion.velocity;
+    portEXIT_CRITICAL(&motion_lock);
+    return velocity;
+}
+
+bool motion_should_stop(int32_t target_height) {
+    portENTER_CRITICAL(&motion_lock);
+    int32_t remaining = target_height - motion_latest_height();
+    int32_t velocity = motion.velocity;
+    uint8_t direction = velocity > 0 ? MOTION_UP : MOTION_DOWN;
+    int32_t stop_distance = (abs(velocity) * motion.stop_time[direction]) / 1000;
+    portEXIT_CRITICAL(&motion_lock);
+
+    if(abs(velocity) < MOTION_MIN_VELOCITY) {
+        return false;
+    }
+
+    if(direction == MOTION_DOWN) {
+        remaining = -remaining;
+    }
+    return remaining <= stop_distance;
+}
+
+void motion_stop(int32_t target_height) {
+    portENTER_CRITICAL(&motion_lock);
+    motion.stop_height = motion_latest_height();
+    motion.stop_target = target_height;
+    motion.stop_velocity = motion.velocity;
+    motion.stopping = true;
+    portEXIT_CRITICAL(&motion_lock);
+}
+
+void motion_persist() {
+    portENTER_CRITICAL(&motion_lock);
+    bool learned = motion.learned;
+    uint16_t stop_time[2] = {motion.stop_time[MOTION_UP], motion.stop_time[MOTION_DOWN]};
+    motion.learned = false;
+    portEXIT_CRITICAL(&motion_lock);
+
+    if(!learned) {
+        return;
+    }
+
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(MOTION_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+
+    if(err != ESP_OK) {
+        ESP_LOGE(MOTION_TAG, "Error opening NVS handle: %s", esp_err_to_name(err));
+        return;
+    }
+
+    ESP_ERROR_CHECK_WITHOUT_ABORT(nvs_set_u16(nvs_handle, MOTION_NVS_KEY_UP, stop_time[MOTION_UP]));
+    ESP_ERROR_CHECK_WITHOUT_ABORT(nvs_set_u16(nvs_handle, MOTION_NVS_KEY_DOWN, stop_time[MOTION_DOWN]));
+    ESP_ERROR_CHECK_WITHOUT_ABORT(nvs_commit(nvs_handle));
+    nvs_close(nvs_handle);
+}
@@ -0,0 +1,72 @@
+/* MIT License
+*
+* Copyright (c) 2022 ma-lwa-re
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MOTION_NVS_NAMESPACE        ("motion")
+#define MOTION_NVS_KEY_UP           ("stop_up")
+#define MOTION_NVS_KEY_DOWN         ("stop_down")
+#define MOTION_SAMPLES              (8)
+#define MOTION_VELOCITY_WINDOW_US   (250000)
+#define MOTION_SETTLE_US            (400000)
+#define MOTION_MIN_VELOCITY         (5)
+#define MOTION_DEFAULT_STOP_TIME    (250)
+#define MOTION_MAX_STOP_TIME        (1000)
+#define MOTION_UP                   (0x00)
+#define MOTION_DOWN                 (0x01)
+
+typedef struct motion_sample {
+    int32_t height;
+    int64_t timestamp;
+} motion_sample_t;
+
+typedef struct motion {
+    motion_sample_t samples[MOTION_SAMPLES];
+    uint8_t sample_index;
+    uint8_t sample_count;
+    int32_t velocity;
+    uint16_t stop_time[2];
+    int32_t stop_height;
+    int32_t stop_target;
+    int32_t stop_velocity;
+    int64_t settle_timestamp;
+    bool stopping;
+    bool learned;
+} motion_t;
+
+void motion_init();
+
+bool motion_update(int32_t height, int64_t timestamp);
+
+bool motion_valid();
+
+int32_t motion_height();
+
+int32_t motion_velocity();
+
+bool motion_should_stop(int32_t target_height);
+
+void motion_stop(int32_t target_height);
+
+void motion_persist();
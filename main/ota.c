@@ -21,6 +21,7 @@
 * SOFTWARE.
 */
 #include "ota.h"
+#include "metrics.h"
 #include "esp_log.h"
 #include "esp_crt_bundle.h"
 
@@ -91,6 +92,7 @@ void ota_task(void *arg) {
 
     for(;;) {
         ESP_LOGI(OTA_TAG, "Checking for updates...");
+        metrics_count(METRICS_OTA_CHECKS);
         esp_https_ota_handle_t https_ota_handle = NULL;
 
         if(validate_image_header(&https_ota_handle) == ESP_OK) {
@@ -110,12 +112,21 @@ void ota_task(void *arg) {
                     vTaskDelay(SLEEP_INTERVAL_10_SEC / portTICK_PERIOD_MS);
                     esp_restart();
                 } else {
+                    metrics_count(METRICS_OTA_FAILURES);
+
                     if(ota_finish_err == ESP_ERR_OTA_VALIDATE_FAILED) {
                         ESP_LOGE(OTA_TAG, "Image validation failed, image is corrupted!");
                     }
                     ESP_LOGE(OTA_TAG, "OTA update failed with error: %s", esp_err_to_name(ota_finish_err));
                 }
+            } else {
+                metrics_count(METRICS_OTA_FAILURES);
+                ESP_LOGE(OTA_TAG, "OTA update download incomplete!");
+                esp_https_ota_abort(https_ota_handle);
             }
+        } else if(https_ota_handle != NULL) {
+            // The header was read but the image is not taken, the connection is still open
+            esp_https_ota_abort(https_ota_handle);
         }
         vTaskDelay(SLEEP_INTERVAL_12_HOURS / portTICK_PERIOD_MS);
     }
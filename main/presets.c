@@ -0,0 +1,94 @@
+/* MIT License
+*
+* Copyright (c) 2022 ma-lwa-re
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+#include <stdio.h>
+#include "esp_log.h"
+#include "nvs_flash.h"
+#include "nvs.h"
+#include "presets.h"
+#include "dreamdesk.h"
+
+static const char *PRESETS_TAG = "presets";
+
+static const uint16_t default_presets[PRESETS_COUNT] = {MEMORY_1_HEIGHT, MEMORY_2_HEIGHT, MEMORY_3_HEIGHT,
+                                                         MEMORY_4_HEIGHT, MEMORY_5_HEIGHT, MEMORY_6_HEIGHT,
+                                                         MEMORY_7_HEIGHT};
+static uint16_t presets[PRESETS_COUNT];
+
+void presets_init() {
+    nvs_handle_t nvs_handle;
+    char key[NVS_KEY_NAME_MAX_SIZE];
+
+    for(uint8_t i = 0; i < PRESETS_COUNT; i++) {
+        presets[i] = default_presets[i];
+    }
+
+    if(nvs_open(PRESETS_NVS_NAMESPACE, NVS_READONLY, &nvs_handle) != ESP_OK) {
+        ESP_LOGI(PRESETS_TAG, "No stored presets, using the default heights");
+        return;
+    }
+
+    for(uint8_t i = 0; i < PRESETS_COUNT; i++) {
+        uint16_t height = 0;
+        snprintf(key, sizeof(key), PRESETS_NVS_KEY_FORMAT, i + 1);
+
+        if(nvs_get_u16(nvs_handle, key, &height) == ESP_OK && height >= DESK_MIN_HEIGHT && height <= DESK_MAX_HEIGHT) {
+            presets[i] = height;
+        }
+    }
+    nvs_close(nvs_handle);
+}
+
+uint16_t presets_get(uint8_t slot) {
+    return slot < PRESETS_COUNT ? presets[slot] : 0;
+}
+
+// Called from move_task only, the presets are read by every front end but have one writer
+bool presets_set(uint8_t slot, uint16_t height) {
+
+    if(slot >= PRESETS_COUNT || height < DESK_MIN_HEIGHT || height > DESK_MAX_HEIGHT) {
+        ESP_LOGE(PRESETS_TAG, "Preset %d at %dmm is out of range!", slot + 1, height);
+        return false;
+    }
+
+    if(presets[slot] == height) {
+        return true;
+    }
+
+    nvs_handle_t nvs_handle;
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    esp_err_t err = nvs_open(PRESETS_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+
+    if(err != ESP_OK) {
+        ESP_LOGE(PRESETS_TAG, "Error opening NVS handle: %s", esp_err_to_name(err));
+        return false;
+    }
+
+    snprintf(key, sizeof(key), PRESETS_NVS_KEY_FORMAT, slot + 1);
+    ESP_ERROR_CHECK_WITHOUT_ABORT(nvs_set_u16(nvs_handle, key, height));
+    ESP_ERROR_CHECK_WITHOUT_ABORT(nvs_commit(nvs_handle));
+    nvs_close(nvs_handle);
+
+    presets[slot] = height;
+    ESP_LOGI(PRESETS_TAG, "Preset %d set to %d.%dcm", slot + 1, height / 10, height % 10);
+    return true;
+}
@@ -20,61 +20,131 @@
 * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 * SOFTWARE.
 */
+#include <math.h>
+#include <stdatomic.h>
 #include "sensors.h"
+#include "metrics.h"
+#include "acquisition.h"
+#include "statistics.h"
+#if defined(JOURNAL_ON)
+#include "journal.h"
+#endif
+#include "esp_timer.h"
 #include "esp_log.h"
-#include "scd4x.h"
+#include "freertos/queue.h"
 #include "driver/i2c.h"
 
 static const char *SENSORS_TAG = "sensors";
 
-char scale = SCALE_CELCIUS;
-float temperature = 0.0;
-float humidity = 0.0;
-float co2_level = 0.0;
-float co2_peak_level = 0.0;
-enum air_quality_t air_quality = UNKNOWN;
-
-char get_temperature_scale() {
-    return scale;
+static char scale = SCALE_CELCIUS;
+static portMUX_TYPE sensors_snapshot_lock = portMUX_INITIALIZER_UNLOCKED;
+static atomic_uint sensors_snapshot_sequence = 0;
+static sensors_snapshot_t sensors_snapshot;
+
+static QueueHandle_t sensors_request_queue = NULL;
+static portMUX_TYPE sensors_calibration_lock = portMUX_INITIALIZER_UNLOCKED;
+static sensors_calibration_t sensors_calibration;
+
+static sensors_listener_t sensors_listeners[SENSORS_LISTENERS];
+static atomic_uint sensors_listener_count = 0;
+
+// Same scheme as the desk state, sensors_task is the only writer and is never preempted
+// while the sequence is odd, readers copy the snapshot and retry only if it moved under them
+static void sensors_publish(sensors_snapshot_t *snapshot) {
+    portENTER_CRITICAL(&sensors_snapshot_lock);
+    atomic_store_explicit(&sensors_snapshot_sequence, sensors_snapshot_sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    snapshot->version = sensors_snapshot.version + 1;
+    sensors_snapshot = *snapshot;
+    atomic_store_explicit(&sensors_snapshot_sequence, sensors_snapshot_sequence + 1, memory_order_release);
+    portEXIT_CRITICAL(&sensors_snapshot_lock);
 }
 
-float get_current_temperature() {
-    return temperature;
-}
+sensors_snapshot_t sensors_get_snapshot() {
+    sensors_snapshot_t snapshot;
+    unsigned int sequence;
+
+    do {
+        sequence = atomic_load_explicit(&sensors_snapshot_sequence, memory_order_acquire);
+        snapshot = *(volatile sensors_snapshot_t*) &sensors_snapshot;
+        atomic_thread_fence(memory_order_acquire);
+    } while((sequence & 0x01) ||
+            sequence != atomic_load_explicit(&sensors_snapshot_sequence, memory_order_relaxed));
 
-float get_current_relative_humidity() {
-    return humidity;
+    return snapshot;
 }
 
-float get_co2_level() {
-    return co2_level;
+sensors_calibration_t sensors_get_calibration() {
+    portENTER_CRITICAL(&sensors_calibration_lock);
+    sensors_calibration_t calibration = sensors_calibration;
+    portEXIT_CRITICAL(&sensors_calibration_lock);
+    return calibration;
 }
 
-float get_co2_peak_level() {
-    return co2_peak_level;
+static void sensors_publish_calibration(const acquisition_calibration_t *sensor, int64_t first_reading_time) {
+    portENTER_CRITICAL(&sensors_calibration_lock);
+    uint32_t persists = sensor->persists - sensors_calibration.sensor.persists;
+    sensors_calibration.sensor = *sensor;
+    sensors_calibration.first_reading_time = first_reading_time;
+    portEXIT_CRITICAL(&sensors_calibration_lock);
+
+    for(uint32_t i = 0; i < persists; i++) {
+        metrics_count(METRICS_SENSORS_EEPROM_WRITES);
+    }
 }
 
-void set_co2_peak_level(float co2_level) {
-    co2_peak_level = co2_level > co2_peak_level ? co2_level : co2_peak_level;
+// Runs on the caller, sensors_task takes the request on its next wake up and the outcome shows in the calibration
+bool sensors_send_command(acquisition_step_t step, uint16_t argument) {
+    sensors_request_t request = {.step = step, .argument = argument};
+    acquisition_status_t status = sensors_get_calibration().sensor.status;
+
+    if(sensors_request_queue == NULL || status == ACQUISITION_STATUS_PENDING ||
+       status == ACQUISITION_STATUS_RUNNING) {
+        return false;
+    }
+    return xQueueSend(sensors_request_queue, &request, 0) == pdTRUE;
 }
 
-enum air_quality_t get_air_quality() {
-    return air_quality;
+// Rolling peak over the last 24 hours, a bad day no longer pins it forever
+static float sensors_co2_peak_level(float co2_level) {
+    statistics_summary_t summary = statistics_get(STATISTICS_CO2, STATISTICS_24H);
+    return summary.count > 0 && summary.max > co2_level ? summary.max : co2_level;
 }
 
-void set_air_quality(float co2_level) {
+static enum air_quality_t sensors_air_quality(float co2_level) {
     if(co2_level <= CO2_LEVEL_UNKNOWN) {
-        air_quality = UNKNOWN;
+        return UNKNOWN;
     } else if(co2_level <= CO2_LEVEL_EXCELLENT) {
-        air_quality = EXCELLENT;
+        return EXCELLENT;
     } else if(co2_level <= CO2_LEVEL_GOOD) {
-        air_quality = GOOD;
+        return GOOD;
     } else if(co2_level <= CO2_LEVEL_FAIR) {
-        air_quality = FAIR;
+        return FAIR;
     } else if(co2_level <= CO2_LEVEL_INFERIOR) {
-        air_quality = INFERIOR;
+        return INFERIOR;
     } else {
-        air_quality = POOR;
+        return POOR;
+    }
+}
+
+// Same as the desk listeners, sensors_task may already be notifying while one is added
+bool sensors_add_listener(sensors_listener_t listener) {
+    uint32_t count = atomic_load_explicit(&sensors_listener_count, memory_order_relaxed);
+
+    if(count >= SENSORS_LISTENERS) {
+        ESP_LOGE(SENSORS_TAG, "Too many sensors listeners!");
+        return false;
+    }
+    sensors_listeners[count] = listener;
+    atomic_store_explicit(&sensors_listener_count, count + 1, memory_order_release);
+    return true;
+}
+
+static void sensors_notify_listeners(const sensors_snapshot_t *snapshot) {
+    uint32_t count = atomic_load_explicit(&sensors_listener_count, memory_order_acquire);
+
+    for(uint32_t i = 0; i < count; i++) {
+        sensors_listeners[i](snapshot);
     }
 }
 
@@ -100,92 +170,53 @@ void sensors_task(void *arg) {
     scale = SCALE_KELVIN;
     #endif
 
-    vTaskDelay(SENSORS_INIT_DELAY / portTICK_PERIOD_MS);
-    ESP_LOGI(SENSORS_TAG, "Sensor serial number 0x%012llX", scd4x_get_serial_number());
-
-    vTaskDelay(SENSORS_INIT_DELAY / portTICK_PERIOD_MS);
-    float temperature_offset = scd4x_get_temperature_offset();
-
-    vTaskDelay(SENSORS_INIT_DELAY / portTICK_PERIOD_MS);
-    uint16_t sensor_altitude = scd4x_get_sensor_altitude();
-
-    if(temperature_offset != SCD41_READ_ERROR && sensor_altitude != SCD41_READ_ERROR) {
+    // The settings are checked by the acquisition itself before the first start, nothing sleeps on them
+    acquisition_t acquisition;
+    acquisition_init(&acquisition, I2C_MASTER_NUM, ACQUISITION_MODE);
+    sensors_publish_calibration(&acquisition.calibration, 0);
+    int64_t first_reading_time = 0;
 
-        if(temperature_offset != TEMPERATURE_OFFSET) {
-            ESP_LOGW(SENSORS_TAG, "Temperature offset calibration from %.1f °%c to %.1f °%c",
-                     temperature_offset, scale, TEMPERATURE_OFFSET, scale);
+    sensors_request_queue = xQueueCreate(SENSORS_REQUEST_QUEUE_SIZE, sizeof(sensors_request_t));
 
-            vTaskDelay(SENSORS_INIT_DELAY / portTICK_PERIOD_MS);
-            ESP_ERROR_CHECK_WITHOUT_ABORT(scd4x_set_temperature_offset(TEMPERATURE_OFFSET));
+    for(;;) {
+        acquisition_sample_t sample;
+        sensors_request_t request;
+        int64_t delay = acquisition.next_time - esp_timer_get_time();
+        TickType_t ticks = delay > 0 ? (delay + portTICK_PERIOD_MS * 1000 - 1) / (portTICK_PERIOD_MS * 1000) : 0;
 
-            vTaskDelay(SENSORS_INIT_DELAY / portTICK_PERIOD_MS);
-            ESP_ERROR_CHECK_WITHOUT_ABORT(scd4x_persist_settings());
+        // Sleep until the sensor has something new or a calibration step comes in, the bus
+        // stays free for everyone else. The request can bring the next run forward.
+        if(xQueueReceive(sensors_request_queue, &request, ticks) == pdTRUE) {
 
-            vTaskDelay(SENSORS_INIT_DELAY / portTICK_PERIOD_MS);
-            temperature_offset = scd4x_get_temperature_offset();
+            if(!acquisition_request(&acquisition, request.step, request.argument, esp_timer_get_time())) {
+                ESP_LOGW(SENSORS_TAG, "Sensor calibration busy, dropping request!");
+            }
+            sensors_publish_calibration(&acquisition.calibration, first_reading_time);
+            continue;
         }
+        uint32_t calibration_version = acquisition.calibration.version;
+        acquisition_result_t result = acquisition_run(&acquisition, esp_timer_get_time(), &sample);
 
-        if(sensor_altitude != SENSOR_ALTITUDE) {
-            ESP_LOGW(SENSORS_TAG, "Sensor altitude calibration from %d m to %d m",
-                     sensor_altitude, SENSOR_ALTITUDE);
-
-            vTaskDelay(SENSORS_INIT_DELAY / portTICK_PERIOD_MS);
-            ESP_ERROR_CHECK_WITHOUT_ABORT(scd4x_set_sensor_altitude(SENSOR_ALTITUDE));
-
-            vTaskDelay(SENSORS_INIT_DELAY / portTICK_PERIOD_MS);
-            ESP_ERROR_CHECK_WITHOUT_ABORT(scd4x_persist_settings());
-
-            vTaskDelay(SENSORS_INIT_DELAY / portTICK_PERIOD_MS);
-            sensor_altitude = scd4x_get_sensor_altitude();
+        if(result == ACQUISITION_ERROR) {
+            metrics_count(METRICS_SENSORS_READ_ERRORS);
         }
-        ESP_LOGI(SENSORS_TAG, "Temperature offset %.1f °%c - Sensor altitude %d %s",
-                 temperature_offset, scale, sensor_altitude, scale == SCALE_CELCIUS ? "m" : "ft");
-    } else {
-        ESP_LOGE(SENSORS_TAG, "Sensor offset/altitude read error!");
-    }
 
-    vTaskDelay(SENSORS_INIT_DELAY / portTICK_PERIOD_MS);
+        bool first_reading = result == ACQUISITION_READING && first_reading_time == 0;
 
-    for(;;) {
-        scd4x_start_periodic_measurement();
-
-        uint16_t average_co2_level = 0.0;
-        float average_temperature = 0.0;
-        float average_humidity = 0.0;
-
-        for(uint8_t i = 0; i < MEASUREMENT_COUNT + 2; i++) {
-            scd4x_sensors_values_t sensors_values = {
-                .co2 = 0x00,
-                .temperature = 0x00,
-                .humidity = 0x00
-            };
-            vTaskDelay(READ_SAMPLES_DELAY / portTICK_PERIOD_MS);
-
-            if(scd4x_read_measurement(&sensors_values) != ESP_OK) {
-                ESP_LOGE(SENSORS_TAG, "Sensors read measurement error!");
-                break;
-            }
-
-            // Discard the first two sensor read outputs
-            if(i < 2) {
-                continue;
-            }
-
-            ESP_LOGD(SENSORS_TAG, "CO₂ %4d ppm - Temperature %2.1f °%c - Humidity %2.1f%%",
-                     sensors_values.co2, sensors_values.temperature, scale, sensors_values.humidity);
+        if(first_reading) {
+            first_reading_time = esp_timer_get_time();
+            ESP_LOGI(SENSORS_TAG, "First reading %lld ms after boot", (long long) first_reading_time / 1000);
+        }
 
-            average_co2_level += sensors_values.co2;
-            average_temperature += sensors_values.temperature;
-            average_humidity += sensors_values.humidity;
+        if(acquisition.calibration.version != calibration_version || first_reading) {
+            sensors_publish_calibration(&acquisition.calibration, first_reading_time);
+        }
 
-            ESP_LOG_BUFFER_HEX_LEVEL(SENSORS_TAG, &sensors_values, sizeof(sensors_values), ESP_LOG_DEBUG);
+        if(result != ACQUISITION_READING) {
+            continue;
         }
 
-        temperature = (average_temperature / MEASUREMENT_COUNT);
-        humidity = (average_humidity / MEASUREMENT_COUNT);
-        co2_level = (average_co2_level / MEASUREMENT_COUNT);
-        set_air_quality(co2_level);
-        set_co2_peak_level(co2_level);
+        float temperature = sample.temperature;
 
         #if defined(SENSORS_SCALE_F)
         temperature = FAHRENHEIT(temperature);
@@ -193,21 +224,46 @@ void sensors_task(void *arg) {
         temperature = KELVIN(temperature);
         #endif
 
-        scd4x_stop_periodic_measurement();
+        sensors_snapshot_t snapshot = {
+            .timestamp = esp_timer_get_time(),
+            .samples = sample.samples,
+            .scale = scale,
+            .air_quality = sensors_air_quality(sample.co2),
+            .values = {.temperature = temperature, .humidity = sample.humidity, .co2_level = sample.co2}
+        };
+        snapshot.valid = snapshot.air_quality != UNKNOWN;
         esp_log_level_t air_quality_level = ESP_LOG_ERROR;
 
-        if(air_quality == UNKNOWN) {
+        if(!snapshot.valid) {
             ESP_LOGE(SENSORS_TAG, "Sensors read measurement error!");
         } else {
-            if(air_quality < FAIR) {
+            statistics_sample_t slot;
+
+            if(statistics_add(snapshot.timestamp / 1000000, sample.co2, temperature, sample.humidity, &slot)) {
+                #if defined(JOURNAL_ON)
+                journal_add_sensors(slot.time, slot.co2, slot.temperature, slot.humidity);
+                #endif
+            }
+
+            if(snapshot.air_quality < FAIR) {
                 air_quality_level = ESP_LOG_INFO;
-            } else if(air_quality < POOR) {
+            } else if(snapshot.air_quality < POOR) {
                 air_quality_level = ESP_LOG_WARN;
             }
 
-            ESP_LOG_LEVEL(air_quality_level, SENSORS_TAG, "CO₂ %4.0f ppm - Temperature %2.1f °%c - Humidity %2.1f%%",
-                          co2_level, temperature, scale, humidity);
+            ESP_LOG_LEVEL(air_quality_level, SENSORS_TAG, "CO₂ %4d ppm - Temperature %2.1f °%c - Humidity %2.1f%%",
+                          sample.co2, temperature, scale, sample.humidity);
         }
-        vTaskDelay(SLEEP_DELAY / portTICK_PERIOD_MS);
+        snapshot.values.co2_peak_level = sensors_co2_peak_level(sample.co2);
+
+        // Rounded here once per reading rather than on every HomeKit read
+        snapshot.rounded = (sensors_values_t) {
+            .temperature = roundf(temperature * 10.0) / 10.0,
+            .humidity = roundf(sample.humidity),
+            .co2_level = sample.co2,
+            .co2_peak_level = roundf(snapshot.values.co2_peak_level)
+        };
+        sensors_publish(&snapshot);
+        sensors_notify_listeners(&snapshot);
     }
 }
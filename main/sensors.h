@@ -22,38 +22,73 @@
 */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "acquisition.h"
 
-#define TEMPERATURE_OFFSET                  (SENSORS_TEMPERATURE_OFFSET)
-#define SENSOR_ALTITUDE                     (SENSORS_SENSOR_ALTITUDE)
+#define TEMPERATURE_HYSTERESIS              (SENSORS_TEMPERATURE_HYSTERESIS)
+#define HUMIDITY_HYSTERESIS                 (SENSORS_HUMIDITY_HYSTERESIS)
+#define CO2_HYSTERESIS                      (SENSORS_CO2_HYSTERESIS)
+#define SENSORS_LISTENERS                   (2)
+#define SENSORS_REQUEST_QUEUE_SIZE          (1)
 #define FAHRENHEIT(celcius)                 (((celcius * 9.0) / 5.0) + 32.0)
 #define KELVIN(celcius)                     (celcius + 273.15)
 #define SCALE_CELCIUS                       ('C')
 #define SCALE_FAHRENHEIT                    ('F')
 #define SCALE_KELVIN                        ('K')
-#define MEASUREMENT_COUNT                   (5.0)
 #define CO2_LEVEL_UNKNOWN                   (200)
 #define CO2_LEVEL_EXCELLENT                 (600)
 #define CO2_LEVEL_GOOD                      (1000)
 #define CO2_LEVEL_FAIR                      (1400)
 #define CO2_LEVEL_INFERIOR                  (1800)
 #define CO2_LEVEL_POOR                      (2200)
-#define SLEEP_DELAY                         (1000 * 60 * 15)
-#define READ_SAMPLES_DELAY                  (1000 * 15)
-#define SENSORS_INIT_DELAY                  (1000 * 10)
+#define CO2_REFERENCE_MIN                   (400)
+#define CO2_REFERENCE_MAX                   (2000)
 
 enum air_quality_t {UNKNOWN, EXCELLENT, GOOD,
                     FAIR, INFERIOR, POOR};
 
-char get_temperature_scale();
+typedef struct sensors_values {
+    float temperature;
+    float humidity;
+    float co2_level;
+    float co2_peak_level;
+} sensors_values_t;
 
-float get_current_temperature();
+// One reading as a whole, published once per measurement cycle; version counts the readings
+// since boot and stays 0 until the first one, rounded holds the steps HomeKit shows
+// (a tenth of a degree, whole percents and ppm) so readers never have to round themselves
+typedef struct sensors_snapshot {
+    uint32_t version;
+    int64_t timestamp;
+    bool valid;
+    uint8_t samples;
+    char scale;
+    enum air_quality_t air_quality;
+    sensors_values_t values;
+    sensors_values_t rounded;
+} sensors_snapshot_t;
 
-float get_current_relative_humidity();
+typedef struct sensors_request {
+    acquisition_step_t step;
+    uint16_t argument;
+} sensors_request_t;
 
-float get_co2_level();
+// The sensor settings and the last calibration step as sensors_task last saw them,
+// first_reading_time stays 0 until the first reading since boot
+typedef struct sensors_calibration {
+    acquisition_calibration_t sensor;
+    int64_t first_reading_time;
+} sensors_calibration_t;
 
-float get_co2_peak_level();
+typedef void (*sensors_listener_t)(const sensors_snapshot_t *snapshot);
 
-enum air_quality_t get_air_quality();
+sensors_snapshot_t sensors_get_snapshot();
+
+sensors_calibration_t sensors_get_calibration();
+
+bool sensors_send_command(acquisition_step_t step, uint16_t argument);
+
+bool sensors_add_listener(sensors_listener_t listener);
 
 void sensors_task(void *arg);
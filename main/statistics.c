@@ -0,0 +1,291 @@
+/* MIT License
+*
+* Copyright (c) 2022 ma-lwa-re
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+#include <math.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "statistics.h"
+
+#define STATISTICS_MAX              (1)
+#define STATISTICS_MIN              (-1)
+
+static const uint32_t statistics_windows[STATISTICS_WINDOWS] = {3600, 8 * 3600, 24 * 3600};
+static const float statistics_scales[STATISTICS_QUANTITIES] = {STATISTICS_CO2_SCALE, STATISTICS_TEMPERATURE_SCALE,
+                                                               STATISTICS_HUMIDITY_SCALE};
+
+// Slots are at least STATISTICS_SLOT_S apart, so a sample is out of every window before it is overwritten
+_Static_assert(STATISTICS_HISTORY_SIZE * STATISTICS_SLOT_S > 24 * 3600, "History shorter than the longest window");
+_Static_assert(STATISTICS_HISTORY_SIZE <= UINT16_MAX, "History positions do not fit the deques");
+_Static_assert((int64_t) STATISTICS_HISTORY_SIZE * UINT16_MAX <= INT32_MAX, "Window sums overflow");
+
+static SemaphoreHandle_t statistics_lock = NULL;
+static statistics_sample_t history[STATISTICS_HISTORY_SIZE];
+static uint32_t history_total = 0;
+static uint32_t window_start[STATISTICS_WINDOWS];
+static int32_t window_sum[STATISTICS_QUANTITIES][STATISTICS_WINDOWS];
+static statistics_deque_t maxima[STATISTICS_QUANTITIES];
+static statistics_deque_t minima[STATISTICS_QUANTITIES];
+static statistics_summary_t summaries[STATISTICS_QUANTITIES][STATISTICS_WINDOWS];
+
+// The readings of the slot still open, it counts in the summaries as one sample of their average
+static uint32_t slot_start = 0;
+static uint32_t slot_count = 0;
+static float slot_sum[STATISTICS_QUANTITIES];
+
+void statistics_init() {
+
+    if(statistics_lock == NULL) {
+        statistics_lock = xSemaphoreCreateMutex();
+    }
+    history_total = 0;
+    slot_count = 0;
+    memset(window_start, 0x00, sizeof(window_start));
+    memset(window_sum, 0x00, sizeof(window_sum));
+    memset(maxima, 0x00, sizeof(maxima));
+    memset(minima, 0x00, sizeof(minima));
+    memset(summaries, 0x00, sizeof(summaries));
+}
+
+int32_t statistics_raw(const statistics_sample_t *sample, statistics_quantity_t quantity) {
+
+    switch(quantity) {
+        case STATISTICS_CO2:
+            return sample->co2;
+        case STATISTICS_TEMPERATURE:
+            return sample->temperature;
+        default:
+            return sample->humidity;
+    }
+}
+
+float statistics_value(const statistics_sample_t *sample, statistics_quantity_t quantity) {
+    return statistics_raw(sample, quantity) / statistics_scales[quantity];
+}
+
+// Rounds to the fixed point of the quantity and clamps to what its field holds
+static void statistics_store(statistics_sample_t *sample, statistics_quantity_t quantity, float value) {
+    value = roundf(value * statistics_scales[quantity]);
+
+    switch(quantity) {
+        case STATISTICS_CO2:
+            sample->co2 = value > UINT16_MAX ? UINT16_MAX : value < 0 ? 0 : value;
+            break;
+        case STATISTICS_TEMPERATURE:
+            sample->temperature = value > INT16_MAX ? INT16_MAX : value < INT16_MIN ? INT16_MIN : value;
+            break;
+        default:
+            sample->humidity = value > INT16_MAX ? INT16_MAX : value < INT16_MIN ? INT16_MIN : value;
+            break;
+    }
+}
+
+static bool statistics_expired(uint16_t position, uint32_t time, statistics_window_t window) {
+    return (int64_t) history[position].time <= (int64_t) time - statistics_windows[window];
+}
+
+// Drops the back entries the new sample outranks, they can never be the extreme again
+static void statistics_deque_push(statistics_deque_t *deque, int8_t sign, statistics_quantity_t quantity,
+                                  uint16_t position) {
+    int32_t value = sign * statistics_raw(&history[position], quantity);
+
+    while(deque->count > 0) {
+        uint16_t back = deque->positions[(deque->head + deque->count - 1) % STATISTICS_HISTORY_SIZE];
+
+        if(sign * statistics_raw(&history[back], quantity) > value) {
+            break;
+        }
+        deque->count--;
+    }
+
+    for(uint8_t window = 0; window < STATISTICS_WINDOWS; window++) {
+        deque->skip[window] = deque->skip[window] < deque->count ? deque->skip[window] : deque->count;
+    }
+    deque->positions[(deque->head + deque->count) % STATISTICS_HISTORY_SIZE] = position;
+    deque->count++;
+}
+
+// The longest window pops the front, the shorter ones only move their skip past it
+static void statistics_deque_expire(statistics_deque_t *deque, uint32_t time) {
+
+    while(deque->count > 0 && statistics_expired(deque->positions[deque->head], time, STATISTICS_24H)) {
+        deque->head = (deque->head + 1) % STATISTICS_HISTORY_SIZE;
+        deque->count--;
+
+        for(uint8_t window = 0; window < STATISTICS_WINDOWS; window++) {
+            deque->skip[window] -= deque->skip[window] > 0;
+        }
+    }
+
+    for(uint8_t window = 0; window < STATISTICS_24H; window++) {
+
+        while(deque->skip[window] < deque->count && statistics_expired(
+              deque->positions[(deque->head + deque->skip[window]) % STATISTICS_HISTORY_SIZE], time, window)) {
+            deque->skip[window]++;
+        }
+    }
+}
+
+static bool statistics_deque_front(statistics_deque_t *deque, statistics_window_t window,
+                                   statistics_quantity_t quantity, float *value) {
+
+    if(deque->skip[window] >= deque->count) {
+        return false;
+    }
+    uint16_t position = deque->positions[(deque->head + deque->skip[window]) % STATISTICS_HISTORY_SIZE];
+    *value = statistics_value(&history[position], quantity);
+    return true;
+}
+
+static void statistics_expire(uint32_t time) {
+
+    for(uint8_t window = 0; window < STATISTICS_WINDOWS; window++) {
+
+        while(window_start[window] < history_total &&
+              statistics_expired(window_start[window] % STATISTICS_HISTORY_SIZE, time, window)) {
+            statistics_sample_t *sample = &history[window_start[window] % STATISTICS_HISTORY_SIZE];
+
+            for(uint8_t quantity = 0; quantity < STATISTICS_QUANTITIES; quantity++) {
+                window_sum[quantity][window] -= statistics_raw(sample, quantity);
+            }
+            window_start[window]++;
+        }
+    }
+
+    for(uint8_t quantity = 0; quantity < STATISTICS_QUANTITIES; quantity++) {
+        statistics_deque_expire(&maxima[quantity], time);
+        statistics_deque_expire(&minima[quantity], time);
+    }
+}
+
+static const statistics_sample_t *statistics_push(uint32_t time, const float *values) {
+    uint16_t position = history_total % STATISTICS_HISTORY_SIZE;
+    statistics_sample_t *sample = &history[position];
+
+    sample->time = time;
+
+    for(uint8_t quantity = 0; quantity < STATISTICS_QUANTITIES; quantity++) {
+        statistics_store(sample, quantity, values[quantity]);
+
+        for(uint8_t window = 0; window < STATISTICS_WINDOWS; window++) {
+            window_sum[quantity][window] += statistics_raw(sample, quantity);
+        }
+        statistics_deque_push(&maxima[quantity], STATISTICS_MAX, quantity, position);
+        statistics_deque_push(&minima[quantity], STATISTICS_MIN, quantity, position);
+    }
+    history_total++;
+    return sample;
+}
+
+static void statistics_summarize() {
+
+    for(uint8_t quantity = 0; quantity < STATISTICS_QUANTITIES; quantity++) {
+        float slot_value = slot_count > 0 ? slot_sum[quantity] / slot_count : 0.0;
+
+        for(uint8_t window = 0; window < STATISTICS_WINDOWS; window++) {
+            statistics_summary_t *summary = &summaries[quantity][window];
+            uint32_t count = history_total - window_start[window];
+            float sum = window_sum[quantity][window] / statistics_scales[quantity];
+
+            summary->count = count + (slot_count > 0);
+            summary->min = summary->max = slot_value;
+
+            if(count > 0) {
+                statistics_deque_front(&minima[quantity], window, quantity, &summary->min);
+                statistics_deque_front(&maxima[quantity], window, quantity, &summary->max);
+            }
+
+            if(slot_count > 0) {
+                summary->min = slot_value < summary->min ? slot_value : summary->min;
+                summary->max = slot_value > summary->max ? slot_value : summary->max;
+                sum += slot_value;
+            }
+            summary->mean = summary->count > 0 ? sum / summary->count : 0.0;
+        }
+    }
+}
+
+// Readings are averaged into slots of STATISTICS_SLOT_S, every summary is kept up to date
+// in constant time per reading whatever the length of its window, returns true with the slot
+// the reading closed
+bool statistics_add(uint32_t time, float co2, float temperature, float humidity, statistics_sample_t *closed) {
+    float values[STATISTICS_QUANTITIES] = {co2, temperature, humidity};
+    bool pushed = false;
+
+    xSemaphoreTake(statistics_lock, portMAX_DELAY);
+
+    if(slot_count > 0 && time - slot_start >= STATISTICS_SLOT_S) {
+
+        for(uint8_t quantity = 0; quantity < STATISTICS_QUANTITIES; quantity++) {
+            slot_sum[quantity] /= slot_count;
+        }
+        statistics_expire(time);
+        *closed = *statistics_push(slot_start, slot_sum);
+        slot_count = 0;
+        pushed = true;
+    }
+
+    if(slot_count == 0) {
+        slot_start = time;
+        memset(slot_sum, 0x00, sizeof(slot_sum));
+    }
+
+    for(uint8_t quantity = 0; quantity < STATISTICS_QUANTITIES; quantity++) {
+        slot_sum[quantity] += values[quantity];
+    }
+    slot_count++;
+
+    statistics_expire(time);
+    statistics_summarize();
+    xSemaphoreGive(statistics_lock);
+    return pushed;
+}
+
+statistics_summary_t statistics_get(statistics_quantity_t quantity, statistics_window_t window) {
+    xSemaphoreTake(statistics_lock, portMAX_DELAY);
+    statistics_summary_t summary = summaries[quantity][window];
+    xSemaphoreGive(statistics_lock);
+    return summary;
+}
+
+// Walks the closed slots newer than since from the oldest, without copying them out
+uint32_t statistics_visit(uint32_t since, statistics_visitor_t visitor, void *arg) {
+    uint32_t visited = 0;
+
+    xSemaphoreTake(statistics_lock, portMAX_DELAY);
+    uint32_t index = history_total > STATISTICS_HISTORY_SIZE ? history_total - STATISTICS_HISTORY_SIZE : 0;
+
+    for(; index < history_total; index++) {
+        statistics_sample_t *sample = &history[index % STATISTICS_HISTORY_SIZE];
+
+        if(sample->time <= since) {
+            continue;
+        }
+
+        if(!visitor(sample, arg)) {
+            break;
+        }
+        visited++;
+    }
+    xSemaphoreGive(statistics_lock);
+    return visited;
+}
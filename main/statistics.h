@@ -0,0 +1,79 @@
+/* MIT License
+*
+* Copyright (c) 2022 ma-lwa-re
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define STATISTICS_SLOT_S           (180)
+#define STATISTICS_HISTORY_SIZE     (512)
+#define STATISTICS_CO2_SCALE        (1)
+#define STATISTICS_TEMPERATURE_SCALE (100)
+#define STATISTICS_HUMIDITY_SCALE   (100)
+
+typedef enum statistics_quantity {STATISTICS_CO2, STATISTICS_TEMPERATURE,
+                                  STATISTICS_HUMIDITY, STATISTICS_QUANTITIES} statistics_quantity_t;
+
+typedef enum statistics_window {STATISTICS_1H, STATISTICS_8H,
+                                STATISTICS_24H, STATISTICS_WINDOWS} statistics_window_t;
+
+// One slot of history in fixed point, ppm and hundredths of a degree or a percent,
+// timed in seconds since boot when the slot started. CO₂ is unsigned, the SCD4x reads
+// up to 40000 ppm which would not fit next to the signed temperature
+typedef struct statistics_sample {
+    uint32_t time;
+    uint16_t co2;
+    int16_t temperature;
+    int16_t humidity;
+} statistics_sample_t;
+
+typedef struct statistics_summary {
+    float min;
+    float max;
+    float mean;
+    uint32_t count;
+} statistics_summary_t;
+
+// Monotonic queue of history positions, values only ever decrease (or increase) from the
+// front, skip counts the front entries that are already out of each shorter window
+typedef struct statistics_deque {
+    uint16_t positions[STATISTICS_HISTORY_SIZE];
+    uint16_t head;
+    uint16_t count;
+    uint16_t skip[STATISTICS_WINDOWS];
+} statistics_deque_t;
+
+// Called for every sample in place with the history locked, returns false to stop early
+typedef bool (*statistics_visitor_t)(const statistics_sample_t *sample, void *arg);
+
+void statistics_init();
+
+bool statistics_add(uint32_t time, float co2, float temperature, float humidity, statistics_sample_t *closed);
+
+statistics_summary_t statistics_get(statistics_quantity_t quantity, statistics_window_t window);
+
+uint32_t statistics_visit(uint32_t since, statistics_visitor_t visitor, void *arg);
+
+int32_t statistics_raw(const statistics_sample_t *sample, statistics_quantity_t quantity);
+
+float statistics_value(const statistics_sample_t *sample, statistics_quantity_t quantity);
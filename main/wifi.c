@@ -27,6 +27,7 @@
 #include "lwip/sys.h"
 #include "nvs_flash.h"
 #include "wifi.h"
+#include "metrics.h"
 
 static const char *WIFI_TAG = "wifi_station";
 
@@ -80,6 +81,7 @@ static void event_handler(void* arg, esp_event_base_t event_base, int32_t event_
         esp_wifi_connect();
     } else if(event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
         esp_wifi_connect();
+        metrics_count(METRICS_WIFI_RECONNECTS);
         ESP_LOGW(WIFI_TAG, "Connect to the AP failed, retrying");
     } else if(event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
         ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
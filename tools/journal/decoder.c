@@ -0,0 +1,430 @@
+/* MIT License
+*
+* Copyright (c) 2022 ma-lwa-re
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_partition.h"
+#include "journal.h"
+
+#define DECODER_DEFAULT_KB          (672)
+#define DECODER_DEFAULT_DAYS        (400)
+#define DECODER_REBOOT_DAYS         (7)
+#define DECODER_SLOT_S              (180)
+#define DECODER_DAY_S               (24 * 3600)
+#define DECODER_CO2_MAX             (40000)
+
+static const char *DECODER_TAG = "decoder";
+
+// A flash partition in RAM, a write only clears bits like the real thing
+typedef struct flash {
+    esp_partition_t partition;
+    uint8_t *data;
+    uint32_t *erases;
+    uint64_t written;
+    uint32_t overwrites;
+    int32_t tear_after;
+} flash_t;
+
+esp_log_level_t simulator_log_level = ESP_LOG_NONE;
+
+static int64_t decoder_time = 0;
+static flash_t flash;
+static flash_t copy;
+
+int64_t esp_timer_get_time() {
+    return decoder_time;
+}
+
+void metrics_count(metrics_counter_t counter) {
+}
+
+// Single threaded, records go straight to journal_write and nothing waits on the lock
+SemaphoreHandle_t xSemaphoreCreateMutex() {
+    static int mutex;
+    return (SemaphoreHandle_t) &mutex;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks) {
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+    return pdTRUE;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+    static int queue;
+    return &queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks) {
+    return journal_write(item) ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks) {
+    return pdFALSE;
+}
+
+static flash_t *flash_of(const esp_partition_t *partition) {
+    return partition == &copy.partition ? &copy : &flash;
+}
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype,
+                                                const char *label) {
+    return flash.data != NULL && type == JOURNAL_PARTITION_TYPE && subtype == JOURNAL_PARTITION_SUBTYPE &&
+           strcmp(label, JOURNAL_PARTITION_LABEL) == 0 ? &flash.partition : NULL;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size) {
+
+    if(src_offset + size > partition->size) {
+        return ESP_FAIL;
+    }
+    memcpy(dst, flash_of(partition)->data + src_offset, size);
+    return ESP_OK;
+}
+
+// A reset in the middle of a write leaves only the first bytes programmed
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t dst_offset, const void *src, size_t size) {
+    flash_t *target = flash_of(partition);
+    const uint8_t *data = src;
+
+    if(dst_offset + size > partition->size) {
+        return ESP_FAIL;
+    }
+
+    for(size_t i = 0; i < size; i++) {
+
+        if(target->tear_after == 0) {
+            target->tear_after = -1;
+            return ESP_FAIL;
+        }
+        target->tear_after -= target->tear_after > 0;
+
+        target->overwrites += (target->data[dst_offset + i] & data[i]) != data[i];
+        target->data[dst_offset + i] &= data[i];
+    }
+    target->written += size;
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size) {
+    flash_t *target = flash_of(partition);
+
+    if(offset % JOURNAL_SECTOR_SIZE != 0 || size % JOURNAL_SECTOR_SIZE != 0 || offset + size > partition->size) {
+        return ESP_FAIL;
+    }
+    memset(target->data + offset, 0xFF, size);
+
+    for(size_t sector = offset / JOURNAL_SECTOR_SIZE; sector < (offset + size) / JOURNAL_SECTOR_SIZE; sector++) {
+        target->erases[sector]++;
+    }
+    return ESP_OK;
+}
+
+static void flash_init(flash_t *target, size_t size) {
+    size = ((size + JOURNAL_SECTOR_SIZE - 1) / JOURNAL_SECTOR_SIZE) * JOURNAL_SECTOR_SIZE;
+    free(target->data);
+    free(target->erases);
+
+    *target = (flash_t) {.partition = {.type = JOURNAL_PARTITION_TYPE, .subtype = JOURNAL_PARTITION_SUBTYPE,
+                                       .size = size, .label = JOURNAL_PARTITION_LABEL}, .tear_after = -1,
+                         .data = malloc(size), .erases = calloc(size / JOURNAL_SECTOR_SIZE, sizeof(uint32_t))};
+    memset(target->data, 0xFF, size);
+}
+
+static const char *decoder_type(journal_type_t type) {
+    switch(type) {
+        case JOURNAL_BOOT:
+            return "boot";
+        case JOURNAL_SENSORS:
+            return "sensors";
+        case JOURNAL_HEIGHT:
+            return "height";
+        default:
+            return "unknown";
+    }
+}
+
+// One CSV line per record with everything known at that point, values before the first
+// reading of a kind are whatever the oldest sector started with
+static uint32_t decoder_print(const esp_partition_t *partition) {
+    journal_reader_t reader;
+    journal_record_t record;
+    uint32_t records = 0;
+
+    printf("boot,time_s,type,co2_ppm,temperature,scale,humidity_percent,height_mm\n");
+
+    if(!journal_reader_init(&reader, partition, 0)) {
+        return 0;
+    }
+
+    while(journal_read(&reader, &record)) {
+        printf("%u,%u,%s,%u,%.2f,%c,%.2f,%u\n", record.boot, record.time, decoder_type(record.type), record.co2,
+               record.temperature / 100.0, record.scale ? record.scale : '?', record.humidity / 100.0,
+               record.height);
+        records++;
+    }
+    return records;
+}
+
+static bool decoder_same(const journal_record_t *expected, const journal_record_t *record) {
+
+    if(expected->type != record->type || expected->time != record->time) {
+        return false;
+    }
+
+    switch(expected->type) {
+        case JOURNAL_BOOT:
+            return expected->boot == record->boot && expected->scale == record->scale;
+        case JOURNAL_SENSORS:
+            return expected->co2 == record->co2 && expected->temperature == record->temperature &&
+                   expected->humidity == record->humidity;
+        default:
+            return expected->height == record->height;
+    }
+}
+
+// The decoded records have to be exactly the last ones written, in order and without a gap
+static uint32_t decoder_check(const esp_partition_t *partition, const journal_record_t *expected, uint32_t count,
+                              uint32_t *decoded, uint32_t *readings, uint32_t *peaks) {
+    journal_reader_t reader;
+    journal_record_t record;
+    uint32_t first = count, mismatches = 0;
+
+    *decoded = *readings = *peaks = 0;
+
+    if(!journal_reader_init(&reader, partition, 0)) {
+        return 1;
+    }
+
+    while(journal_read(&reader, &record)) {
+
+        // The oldest record still on the flash sets where the comparison starts
+        if(first == count) {
+            for(first = 0; first < count && !decoder_same(&expected[first], &record); first++);
+        }
+
+        if(first + *decoded >= count || !decoder_same(&expected[first + *decoded], &record)) {
+            mismatches++;
+        }
+        *readings += record.type == JOURNAL_SENSORS;
+        *peaks += record.type == JOURNAL_SENSORS && record.co2 == DECODER_CO2_MAX;
+        (*decoded)++;
+    }
+    return mismatches + (first + *decoded != count);
+}
+
+// Writes days of a desk used on workdays through the journal, with a reboot every few days
+// and optionally a reset in the middle of a write before some of them
+static uint32_t decoder_simulate(uint32_t days, size_t size, uint32_t reboot_days, uint32_t tear_every,
+                                 const char *output) {
+    uint32_t capacity = days * (DECODER_DAY_S / DECODER_SLOT_S + 64) + 64;
+    journal_record_t *expected = malloc(capacity * sizeof(journal_record_t));
+    uint32_t count = 0, failures = 0, boots = 0, tears = 0;
+    int64_t uptime_origin = 0;
+    uint16_t height = 720;
+
+    flash_init(&flash, size);
+    srand(1);
+
+    for(uint64_t now = 0; now < (uint64_t) days * DECODER_DAY_S; now += DECODER_SLOT_S) {
+        uint32_t day = now / DECODER_DAY_S, second = now % DECODER_DAY_S;
+
+        // A reset while a record is programmed, the boot that follows must not write over it
+        if(now % ((uint64_t) reboot_days * DECODER_DAY_S) == 0) {
+
+            if(boots > 0 && tear_every > 0 && boots % tear_every == 0) {
+                journal_record_t torn = {.type = JOURNAL_SENSORS, .time = decoder_time / 1000000, .co2 = 4000};
+                flash.tear_after = 1 + rand() % 4;
+                journal_write(&torn);
+                flash.tear_after = -1;
+                tears++;
+            }
+            uptime_origin = now;
+            decoder_time = 0;
+
+            if(!journal_init()) {
+                ESP_LOG_LEVEL(ESP_LOG_NONE, DECODER_TAG, "Boot %u failed to start the journal", boots + 1);
+                failures++;
+            }
+            expected[count++] = (journal_record_t) {.type = JOURNAL_BOOT, .boot = ++boots, .time = 0,
+                                                    .scale = 'C'};
+        }
+        decoder_time = (now - uptime_origin) * 1000000LL;
+        uint32_t time = decoder_time / 1000000;
+
+        double phase = 2.0 * M_PI * second / DECODER_DAY_S;
+        bool office = second > 8 * 3600 && second < 18 * 3600 && day % 7 < 5;
+        journal_record_t reading = {.type = JOURNAL_SENSORS, .time = time,
+                                    .co2 = (office ? 900 : 500) + 300 * sin(phase * 3) + rand() % 30,
+                                    .temperature = 2150 + 150 * sin(phase) + rand() % 10,
+                                    .humidity = 4500 + 500 * cos(phase) + rand() % 20};
+
+        // The top of the sensor range once a day, above what a signed field would hold
+        if(second == DECODER_DAY_S / 2) {
+            reading.co2 = DECODER_CO2_MAX;
+        }
+
+        failures += !journal_write(&reading);
+        expected[count++] = reading;
+
+        // Standing up and sitting down about every 45 minutes during office hours
+        if(office && rand() % 15 == 0) {
+            height = height < 900 ? 1050 + rand() % 100 : 700 + rand() % 50;
+            journal_record_t move = {.type = JOURNAL_HEIGHT, .time = time + 60, .height = height};
+            failures += !journal_write(&move);
+            expected[count++] = move;
+        }
+    }
+
+    uint32_t decoded, readings, peaks;
+    uint32_t mismatches = decoder_check(&flash.partition, expected, count, &decoded, &readings, &peaks);
+
+    // What the local API sends has to decode to the same records
+    metrics_cursor_t cursor = {.line = 0, .done = false};
+    char buffer[1000];
+    size_t exported = 0, chunk;
+
+    flash_init(&copy, size);
+    while(!cursor.done && (chunk = journal_export(buffer, sizeof(buffer), &cursor)) > 0) {
+        memcpy(copy.data + exported, buffer, MIN(chunk, copy.partition.size - exported));
+        exported += chunk;
+    }
+
+    uint32_t exported_decoded, exported_readings, exported_peaks;
+    uint32_t export_mismatches = decoder_check(&copy.partition, expected, count, &exported_decoded,
+                                               &exported_readings, &exported_peaks);
+    export_mismatches += exported_decoded != decoded || exported_peaks != peaks;
+
+    uint32_t sectors = flash.partition.size / JOURNAL_SECTOR_SIZE, erases_min = UINT32_MAX, erases_max = 0;
+    uint64_t erases = 0;
+
+    for(uint32_t sector = 0; sector < sectors; sector++) {
+        erases_min = MIN(erases_min, flash.erases[sector]);
+        erases_max = MAX(erases_max, flash.erases[sector]);
+        erases += flash.erases[sector];
+    }
+    uint64_t records_size = flash.written - erases * sizeof(journal_header_t);
+
+    ESP_LOG_LEVEL(ESP_LOG_NONE, DECODER_TAG, "%u days in %zuK: %u records (%.2f bytes each), %u boots, %u torn writes, "
+                  "%u records decoded covering %.1f days, %u at %u ppm, %zu bytes exported, sector erases %u to %u, "
+                  "%u failures, %u overwrites, %u mismatches, %u export mismatches", days, size / 1024, count,
+                  (double) records_size / count, boots, tears, decoded,
+                  (double) readings * DECODER_SLOT_S / DECODER_DAY_S, peaks, DECODER_CO2_MAX, exported, erases_min, erases_max, failures,
+                  flash.overwrites, mismatches, export_mismatches);
+
+    if(output != NULL) {
+        FILE *file = fopen(output, "wb");
+
+        if(file == NULL || fwrite(flash.data, 1, flash.partition.size, file) != flash.partition.size) {
+            perror(output);
+            failures++;
+        }
+
+        if(file != NULL) {
+            fclose(file);
+        }
+    }
+
+    free(expected);
+    return failures + flash.overwrites + mismatches + export_mismatches + (decoded == 0) + (peaks == 0);
+}
+
+static bool decoder_load(const char *path) {
+    FILE *file = fopen(path, "rb");
+
+    if(file == NULL) {
+        perror(path);
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    flash_init(&flash, size > 0 ? size : JOURNAL_SECTOR_SIZE);
+    bool loaded = size <= 0 || fread(flash.data, 1, size, file) == (size_t) size;
+    fclose(file);
+    return loaded;
+}
+
+void usage(const char *name) {
+    printf("Usage: %s journal.bin | -s days [-k partition_kb] [-r reboot_days] [-t tear_every_nth_boot] "
+           "[-o journal.bin] [-v]\n", name);
+}
+
+int main(int argc, char **argv) {
+    uint32_t days = 0, reboot_days = DECODER_REBOOT_DAYS, tear_every = 0;
+    size_t size = DECODER_DEFAULT_KB * 1024;
+    const char *output = NULL;
+    int option;
+
+    while((option = getopt(argc, argv, "s:k:r:t:o:vh")) != -1) {
+        switch(option) {
+            case 's':
+                days = atoi(optarg) > 0 ? atoi(optarg) : DECODER_DEFAULT_DAYS;
+                break;
+            case 'k':
+                size = atoi(optarg) * 1024;
+                break;
+            case 'r':
+                reboot_days = MAX(1, atoi(optarg));
+                break;
+            case 't':
+                tear_every = atoi(optarg);
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'v':
+                simulator_log_level = ESP_LOG_INFO;
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if(days > 0) {
+        return decoder_simulate(days, size, reboot_days, tear_every, output) ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if(optind != argc - 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if(!decoder_load(argv[optind])) {
+        return EXIT_FAILURE;
+    }
+    decoder_print(&flash.partition);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,648 @@
+/* MIT License
+*
+* Copyright (c) 2022 ma-lwa-re
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "acquisition.h"
+#include "statistics.h"
+
+#define EMULATOR_TICK_US            (portTICK_PERIOD_MS * 1000)
+#define EMULATOR_I2C_FREQ_HZ        (100000)
+#define EMULATOR_COMMAND_US         (1000)
+#define EMULATOR_DATA_READY         (0x8006)
+#define EMULATOR_NOT_READY          (0x8000)
+#define EMULATOR_PERIOD_S           (3600.0)
+#define EMULATOR_DEFAULT_HOURS      (4)
+#define EMULATOR_SERIAL_NUMBER      (0x0123456789ABULL)
+#define EMULATOR_STALE_OFFSET       (0x0000)
+#define EMULATOR_STALE_ALTITUDE     (350)
+#define EMULATOR_REFERENCE_PPM      (420)
+#define EMULATOR_CO2_MAX            (40000)
+#define EMULATOR_SATURATED_S        (300)
+
+static const char *EMULATOR_TAG = "emulator";
+
+typedef enum scd4x_mode {SCD4X_IDLE, SCD4X_PERIODIC, SCD4X_LOW_POWER} scd4x_mode_t;
+
+typedef enum scd4x_setting {SCD4X_OFFSET, SCD4X_ALTITUDE, SCD4X_ASC, SCD4X_SETTINGS} scd4x_setting_t;
+
+// The sensor as seen from the bus, timings and mode restrictions follow the SCD4x datasheet
+typedef struct scd4x {
+    scd4x_mode_t mode;
+    int64_t busy_until;
+    int64_t next_sample;
+    int64_t single_shot_due;
+    bool data_ready;
+    uint8_t response[ACQUISITION_MEASUREMENT_WORDS * ACQUISITION_WORD_SIZE];
+    uint8_t response_size;
+    uint16_t co2;
+    uint16_t temperature;
+    uint16_t humidity;
+    int64_t measuring_since;
+    int64_t stopped_at;
+    uint16_t settings[SCD4X_SETTINGS];
+    uint16_t eeprom[SCD4X_SETTINGS];
+    uint32_t persists;
+    int16_t correction;
+} scd4x_t;
+
+// A calibration request sent by the emulated API at a given time, and the status it has to end with
+typedef struct request {
+    int64_t time;
+    acquisition_step_t step;
+    uint16_t argument;
+    bool single_shot_fails;
+} request_t;
+
+typedef struct bus {
+    uint32_t transactions;
+    uint32_t reads;
+    int64_t busy_time;
+    int64_t longest;
+    uint32_t violations;
+    uint32_t corrupt_every;
+} bus_t;
+
+// The range of what the firmware read since its previous reading, the average has to fall inside
+typedef struct window {
+    float co2_min, co2_max;
+    float temperature_min, temperature_max;
+    float humidity_min, humidity_max;
+} window_t;
+
+// Every slot ever closed plus the open one, summed up the slow way to check the rolling statistics
+typedef struct reference {
+    statistics_sample_t *slots;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t slot_start;
+    uint32_t slot_readings;
+    float slot_sum[STATISTICS_QUANTITIES];
+} reference_t;
+
+esp_log_level_t simulator_log_level = ESP_LOG_NONE;
+
+static int64_t emulator_time = 0;
+static scd4x_t scd4x;
+static bus_t bus;
+static window_t window;
+static reference_t reference;
+
+int64_t esp_timer_get_time() {
+    return emulator_time;
+}
+
+void vTaskDelay(TickType_t ticks) {
+    emulator_time += (int64_t) ticks * EMULATOR_TICK_US;
+}
+
+// The emulator is single threaded, the statistics lock never waits
+SemaphoreHandle_t xSemaphoreCreateMutex() {
+    static int mutex;
+    return (SemaphoreHandle_t) &mutex;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks) {
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+    return pdTRUE;
+}
+
+static void window_reset() {
+    window = (window_t) {.co2_min = INFINITY, .co2_max = -INFINITY, .temperature_min = INFINITY,
+                         .temperature_max = -INFINITY, .humidity_min = INFINITY, .humidity_max = -INFINITY};
+}
+
+// Slow daily like swings of the room, one period per hour to keep the runs short, with a few
+// minutes at the top of the sensor range to catch a history that cannot hold them
+static void scd4x_measure() {
+    double seconds = emulator_time / 1000000.0;
+    double phase = 2.0 * M_PI * seconds / EMULATOR_PERIOD_S;
+
+    scd4x.co2 = fmod(seconds, EMULATOR_PERIOD_S) < EMULATOR_SATURATED_S ? EMULATOR_CO2_MAX : 900.0 + 400.0 * sin(phase);
+    scd4x.temperature = ((22.0 + 2.0 * sin(phase / 2.0) + 45.0) * 65535.0) / 175.0;
+    scd4x.humidity = ((45.0 + 5.0 * cos(phase)) * 65535.0) / 100.0;
+    scd4x.data_ready = true;
+}
+
+static void scd4x_update() {
+    int64_t interval = scd4x.mode == SCD4X_LOW_POWER ? ACQUISITION_LOW_POWER_MS : ACQUISITION_PERIODIC_MS;
+
+    if(scd4x.mode != SCD4X_IDLE) {
+
+        while(scd4x.next_sample <= emulator_time) {
+            scd4x_measure();
+            scd4x.next_sample += interval * 1000;
+        }
+    } else if(scd4x.single_shot_due != 0 && scd4x.single_shot_due <= emulator_time) {
+        scd4x.single_shot_due = 0;
+        scd4x_measure();
+    }
+}
+
+static void scd4x_respond(const uint16_t *words, uint8_t count) {
+
+    for(uint8_t i = 0; i < count; i++) {
+        uint8_t *word = &scd4x.response[i * ACQUISITION_WORD_SIZE];
+        word[0] = words[i] >> 8;
+        word[1] = words[i] & 0xFF;
+        word[2] = acquisition_crc(word, 2);
+    }
+    scd4x.response_size = count * ACQUISITION_WORD_SIZE;
+}
+
+static void bus_transfer(size_t size) {
+    int64_t duration = ((size + 1) * 9 * 1000000LL) / EMULATOR_I2C_FREQ_HZ;
+
+    bus.transactions++;
+    bus.busy_time += duration;
+    bus.longest = MAX(bus.longest, duration);
+    emulator_time += duration;
+}
+
+static esp_err_t scd4x_violation(const char *reason, uint16_t command) {
+    ESP_LOG_LEVEL(ESP_LOG_NONE, EMULATOR_TAG, "%.3fs: %s (0x%04x)", emulator_time / 1000000.0, reason, command);
+    bus.violations++;
+    return ESP_FAIL;
+}
+
+esp_err_t i2c_master_write_to_device(i2c_port_t port, uint8_t address, const uint8_t *data, size_t size,
+                                     TickType_t ticks) {
+    bus_transfer(size);
+    scd4x_update();
+
+    if(address != ACQUISITION_ADDRESS || (size != 2 && size != 2 + ACQUISITION_WORD_SIZE)) {
+        return ESP_FAIL;
+    }
+
+    uint16_t command = (data[0] << 8) | data[1];
+    uint16_t argument = size > 2 ? (data[2] << 8) | data[3] : 0;
+    uint16_t words[ACQUISITION_MEASUREMENT_WORDS];
+    scd4x.response_size = 0;
+
+    if(size > 2 && acquisition_crc(&data[2], 2) != data[4]) {
+        return scd4x_violation("Argument with a bad CRC", command);
+    }
+
+    if(emulator_time < scd4x.busy_until) {
+        return scd4x_violation("Command while the sensor is busy", command);
+    }
+
+    // Only these are understood while measuring, a stop is refused while idle
+    if(scd4x.mode != SCD4X_IDLE && command != SCD4X_COMMAND_READ_MEASUREMENT &&
+       command != SCD4X_COMMAND_GET_DATA_READY && command != SCD4X_COMMAND_STOP_PERIODIC) {
+        return scd4x_violation("Command refused while measuring", command);
+    }
+
+    switch(command) {
+        case SCD4X_COMMAND_START_PERIODIC:
+        case SCD4X_COMMAND_START_LOW_POWER:
+            scd4x.mode = command == SCD4X_COMMAND_START_PERIODIC ? SCD4X_PERIODIC : SCD4X_LOW_POWER;
+            scd4x.next_sample = emulator_time + (scd4x.mode == SCD4X_PERIODIC ? ACQUISITION_PERIODIC_MS
+                                                                               : ACQUISITION_LOW_POWER_MS) * 1000LL;
+            scd4x.data_ready = false;
+            scd4x.measuring_since = emulator_time;
+            break;
+        case SCD4X_COMMAND_STOP_PERIODIC:
+
+            if(scd4x.mode == SCD4X_IDLE) {
+                return ESP_FAIL;
+            }
+            scd4x.mode = SCD4X_IDLE;
+            scd4x.stopped_at = emulator_time;
+            scd4x.data_ready = false;
+            scd4x.busy_until = emulator_time + ACQUISITION_STOP_MS * 1000LL;
+            break;
+        case SCD4X_COMMAND_MEASURE_SINGLE_SHOT:
+            scd4x.single_shot_due = emulator_time + ACQUISITION_SINGLE_SHOT_MS * 1000LL;
+            scd4x.busy_until = scd4x.single_shot_due;
+            break;
+        case SCD4X_COMMAND_GET_DATA_READY:
+            words[0] = scd4x.data_ready ? EMULATOR_DATA_READY : EMULATOR_NOT_READY;
+            scd4x_respond(words, 1);
+            scd4x.busy_until = emulator_time + EMULATOR_COMMAND_US;
+            break;
+        case SCD4X_COMMAND_READ_MEASUREMENT:
+
+            if(!scd4x.data_ready) {
+                return scd4x_violation("Measurement read before it was ready", command);
+            }
+            words[0] = scd4x.co2;
+            words[1] = scd4x.temperature;
+            words[2] = scd4x.humidity;
+            scd4x_respond(words, ACQUISITION_MEASUREMENT_WORDS);
+            scd4x.data_ready = false;
+            scd4x.busy_until = emulator_time + EMULATOR_COMMAND_US;
+
+            window.co2_min = MIN(window.co2_min, scd4x.co2);
+            window.co2_max = MAX(window.co2_max, scd4x.co2);
+            window.temperature_min = MIN(window.temperature_min, -45.0 + (175.0 * scd4x.temperature) / 65535.0);
+            window.temperature_max = MAX(window.temperature_max, -45.0 + (175.0 * scd4x.temperature) / 65535.0);
+            window.humidity_min = MIN(window.humidity_min, (100.0 * scd4x.humidity) / 65535.0);
+            window.humidity_max = MAX(window.humidity_max, (100.0 * scd4x.humidity) / 65535.0);
+            break;
+        case SCD4X_COMMAND_GET_SERIAL_NUMBER:
+            words[0] = EMULATOR_SERIAL_NUMBER >> 32;
+            words[1] = (EMULATOR_SERIAL_NUMBER >> 16) & 0xFFFF;
+            words[2] = EMULATOR_SERIAL_NUMBER & 0xFFFF;
+            scd4x_respond(words, 3);
+            scd4x.busy_until = emulator_time + EMULATOR_COMMAND_US;
+            break;
+        case SCD4X_COMMAND_GET_TEMPERATURE_OFFSET:
+        case SCD4X_COMMAND_GET_SENSOR_ALTITUDE:
+        case SCD4X_COMMAND_GET_ASC_ENABLED:
+            words[0] = scd4x.settings[command == SCD4X_COMMAND_GET_TEMPERATURE_OFFSET ? SCD4X_OFFSET :
+                                      command == SCD4X_COMMAND_GET_SENSOR_ALTITUDE ? SCD4X_ALTITUDE : SCD4X_ASC];
+            scd4x_respond(words, 1);
+            scd4x.busy_until = emulator_time + EMULATOR_COMMAND_US;
+            break;
+        case SCD4X_COMMAND_SET_TEMPERATURE_OFFSET:
+        case SCD4X_COMMAND_SET_SENSOR_ALTITUDE:
+        case SCD4X_COMMAND_SET_ASC_ENABLED:
+
+            if(size == 2) {
+                return scd4x_violation("Setting without a value", command);
+            }
+            scd4x.settings[command == SCD4X_COMMAND_SET_TEMPERATURE_OFFSET ? SCD4X_OFFSET :
+                           command == SCD4X_COMMAND_SET_SENSOR_ALTITUDE ? SCD4X_ALTITUDE : SCD4X_ASC] = argument;
+            scd4x.busy_until = emulator_time + EMULATOR_COMMAND_US;
+            break;
+        case SCD4X_COMMAND_PERSIST_SETTINGS:
+            memcpy(scd4x.eeprom, scd4x.settings, sizeof(scd4x.eeprom));
+            scd4x.persists++;
+            scd4x.busy_until = emulator_time + ACQUISITION_PERSIST_MS * 1000LL;
+            break;
+        case SCD4X_COMMAND_FORCED_RECALIBRATION:
+
+            // Only meaningful right after 3 minutes of measurements in the reference air
+            if(size == 2 || scd4x.stopped_at - scd4x.measuring_since < ACQUISITION_RECALIBRATION_WARMUP_MS * 1000LL ||
+               emulator_time - scd4x.stopped_at < ACQUISITION_STOP_MS * 1000LL) {
+                return scd4x_violation("Forced recalibration without a warm up", command);
+            }
+            // The emulated room is not the reference air, the correction is only reported
+            scd4x.correction = argument - scd4x.co2;
+            words[0] = ACQUISITION_RECALIBRATION_ZERO + scd4x.correction;
+            scd4x_respond(words, 1);
+            scd4x.busy_until = emulator_time + ACQUISITION_RECALIBRATION_MS * 1000LL;
+            break;
+        case SCD4X_COMMAND_PERFORM_SELF_TEST:
+            words[0] = 0x0000;
+            scd4x_respond(words, 1);
+            scd4x.busy_until = emulator_time + ACQUISITION_SELF_TEST_MS * 1000LL;
+            break;
+        default:
+            return scd4x_violation("Unknown command", command);
+    }
+    return ESP_OK;
+}
+
+esp_err_t i2c_master_read_from_device(i2c_port_t port, uint8_t address, uint8_t *data, size_t size,
+                                      TickType_t ticks) {
+    bus_transfer(size);
+
+    if(scd4x.response_size == 0 || emulator_time < scd4x.busy_until) {
+        return scd4x_violation("Read without a response ready", 0x0000);
+    }
+
+    if(size != scd4x.response_size) {
+        return scd4x_violation("Read of the wrong size", size);
+    }
+    memcpy(data, scd4x.response, size);
+    scd4x.response_size = 0;
+
+    // A glitch on the bus flips a bit the CRC has to catch
+    if(bus.corrupt_every > 0 && ++bus.reads % bus.corrupt_every == 0) {
+        data[0] ^= 0x01;
+    }
+    return ESP_OK;
+}
+
+static bool window_contains(const acquisition_sample_t *sample) {
+    const float margin = 0.01;
+
+    return sample->co2 >= floorf(window.co2_min) && sample->co2 <= ceilf(window.co2_max) &&
+           sample->temperature >= window.temperature_min - margin &&
+           sample->temperature <= window.temperature_max + margin &&
+           sample->humidity >= window.humidity_min - margin && sample->humidity <= window.humidity_max + margin;
+}
+
+static void reference_add(uint32_t time, const acquisition_sample_t *sample) {
+    const float scales[STATISTICS_QUANTITIES] = {STATISTICS_CO2_SCALE, STATISTICS_TEMPERATURE_SCALE,
+                                                 STATISTICS_HUMIDITY_SCALE};
+
+    if(reference.slot_readings > 0 && time - reference.slot_start >= STATISTICS_SLOT_S) {
+
+        if(reference.count == reference.capacity) {
+            reference.capacity = MAX(64, reference.capacity * 2);
+            reference.slots = realloc(reference.slots, reference.capacity * sizeof(statistics_sample_t));
+        }
+        statistics_sample_t *slot = &reference.slots[reference.count++];
+        slot->time = reference.slot_start;
+
+        slot->co2 = roundf((reference.slot_sum[STATISTICS_CO2] / reference.slot_readings) * scales[STATISTICS_CO2]);
+        slot->temperature = roundf((reference.slot_sum[STATISTICS_TEMPERATURE] / reference.slot_readings) *
+                                   scales[STATISTICS_TEMPERATURE]);
+        slot->humidity = roundf((reference.slot_sum[STATISTICS_HUMIDITY] / reference.slot_readings) *
+                                scales[STATISTICS_HUMIDITY]);
+        reference.slot_readings = 0;
+    }
+
+    if(reference.slot_readings == 0) {
+        reference.slot_start = time;
+        memset(reference.slot_sum, 0x00, sizeof(reference.slot_sum));
+    }
+    reference.slot_sum[STATISTICS_CO2] += sample->co2;
+    reference.slot_sum[STATISTICS_TEMPERATURE] += sample->temperature;
+    reference.slot_sum[STATISTICS_HUMIDITY] += sample->humidity;
+    reference.slot_readings++;
+}
+
+static bool reference_visit(const statistics_sample_t *sample, void *arg) {
+    uint32_t *index = arg;
+
+    while(*index < reference.count && reference.slots[*index].time < sample->time) {
+        (*index)++;
+    }
+    if(*index >= reference.count || reference.slots[*index].time != sample->time) {
+        return false;
+    }
+    const statistics_sample_t *slot = &reference.slots[(*index)++];
+    return slot->co2 == sample->co2 && slot->temperature == sample->temperature && slot->humidity == sample->humidity;
+}
+
+// Compares every window against a full scan of the reference and the history against its last slots
+static uint32_t reference_check(uint32_t now) {
+    const uint32_t windows[STATISTICS_WINDOWS] = {3600, 8 * 3600, 24 * 3600};
+    uint32_t mismatches = 0;
+
+    for(uint8_t window = 0; window < STATISTICS_WINDOWS; window++) {
+
+        for(uint8_t quantity = 0; quantity < STATISTICS_QUANTITIES; quantity++) {
+            statistics_summary_t summary = statistics_get(quantity, window);
+            float open = reference.slot_sum[quantity] / reference.slot_readings;
+            float min = open, max = open, sum = open;
+            uint32_t count = 1;
+
+            for(uint32_t i = 0; i < reference.count; i++) {
+
+                if((int64_t) reference.slots[i].time > (int64_t) now - windows[window]) {
+                    float value = statistics_value(&reference.slots[i], quantity);
+                    min = MIN(min, value);
+                    max = MAX(max, value);
+                    sum += value;
+                    count++;
+                }
+            }
+
+            if(summary.count != count || summary.min != min || summary.max != max ||
+               fabsf(summary.mean - sum / count) > 0.01) {
+                ESP_LOG_LEVEL(ESP_LOG_NONE, EMULATOR_TAG, "%.3fs: window %d quantity %d is %.2f/%.2f/%.2f over %u "
+                              "instead of %.2f/%.2f/%.2f over %u", emulator_time / 1000000.0, window, quantity,
+                              summary.min, summary.max, summary.mean, summary.count, min, max, sum / count, count);
+                mismatches++;
+            }
+        }
+    }
+
+    uint32_t index = 0;
+    uint32_t expected = MIN(reference.count, STATISTICS_HISTORY_SIZE);
+
+    if(statistics_visit(0, reference_visit, &index) != expected || index != reference.count) {
+        ESP_LOG_LEVEL(ESP_LOG_NONE, EMULATOR_TAG, "%.3fs: history differs from the last %u slots",
+                      emulator_time / 1000000.0, expected);
+        mismatches++;
+    }
+    return mismatches;
+}
+
+// Whether the last request ended the way it should, a corrupted bus can fail any of them
+static uint32_t request_check(const acquisition_t *acquisition, const request_t *request, bool corrupted) {
+    acquisition_status_t expected = acquisition->mode == ACQUISITION_SINGLE_SHOT && request->single_shot_fails ?
+                                    ACQUISITION_STATUS_FAILED : ACQUISITION_STATUS_DONE;
+
+    if(acquisition->calibration.step != request->step || acquisition->calibration.status != expected) {
+
+        if(!corrupted) {
+            ESP_LOG_LEVEL(ESP_LOG_NONE, EMULATOR_TAG, "%.3fs: calibration step %d ended with status %d instead of %d",
+                          emulator_time / 1000000.0, acquisition->calibration.step,
+                          acquisition->calibration.status, expected);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Runs sensors_task's acquisition loop on the emulated clock, returns the number of failures
+static uint32_t emulator_run(acquisition_mode_t mode, const char *name, int64_t duration, uint32_t corrupt_every) {
+    // Requests as the API would send them, then a reboot that must not write the EEPROM again
+    const request_t requests[] = {
+        {duration / 5, ACQUISITION_STEP_SELF_TEST, 0, false},
+        {duration * 3 / 10, ACQUISITION_STEP_RECALIBRATION, EMULATOR_REFERENCE_PPM, true},
+        {duration * 2 / 5, ACQUISITION_STEP_ASC, 0, false},
+        {duration / 2, ACQUISITION_STEP_ASC, 0, false}
+    };
+    const uint32_t request_count = sizeof(requests) / sizeof(requests[0]);
+    const int64_t reboot = duration * 3 / 5;
+    acquisition_t acquisition;
+    uint32_t readings = 0, errors = 0, outside = 0, mismatches = 0, calibration_mismatches = 0, request = 0;
+    int64_t first_reading = -1, last_reading = 0, calibrated = -1, requested = -1, request_wait = 0;
+    bool rebooted = false;
+
+    emulator_time = 0;
+    memset(&scd4x, 0x00, sizeof(scd4x));
+    scd4x.settings[SCD4X_OFFSET] = EMULATOR_STALE_OFFSET;
+    scd4x.settings[SCD4X_ALTITUDE] = EMULATOR_STALE_ALTITUDE;
+    scd4x.settings[SCD4X_ASC] = 1;
+    memcpy(scd4x.eeprom, scd4x.settings, sizeof(scd4x.eeprom));
+    memset(&bus, 0x00, sizeof(bus));
+    bus.corrupt_every = corrupt_every;
+    window_reset();
+    free(reference.slots);
+    memset(&reference, 0x00, sizeof(reference));
+    statistics_init();
+
+    acquisition_init(&acquisition, I2C_NUM_0, mode);
+
+    while(emulator_time < duration) {
+        acquisition_sample_t sample;
+        int64_t delay = acquisition.next_time - esp_timer_get_time();
+
+        // sensors_task wakes up on a request as well as on the sensor
+        if(request < request_count && requests[request].time - emulator_time < delay) {
+            delay = requests[request].time - emulator_time;
+        }
+
+        if(delay > 0) {
+            vTaskDelay((delay + EMULATOR_TICK_US - 1) / EMULATOR_TICK_US);
+        }
+
+        if(request < request_count && emulator_time >= requests[request].time) {
+
+            if(request > 0) {
+                calibration_mismatches += request_check(&acquisition, &requests[request - 1], corrupt_every > 0);
+            }
+
+            if(!acquisition_request(&acquisition, requests[request].step, requests[request].argument, emulator_time)) {
+                ESP_LOG_LEVEL(ESP_LOG_NONE, EMULATOR_TAG, "%.3fs: calibration step %d refused",
+                              emulator_time / 1000000.0, requests[request].step);
+                calibration_mismatches++;
+            } else {
+                requested = emulator_time;
+            }
+            request++;
+            continue;
+        }
+
+        // Only the ESP32 restarts, the sensor keeps measuring with what it has in RAM
+        if(!rebooted && emulator_time >= reboot) {
+            calibration_mismatches += request_check(&acquisition, &requests[request_count - 1], corrupt_every > 0);
+            acquisition_init(&acquisition, I2C_NUM_0, mode);
+            window_reset();
+            rebooted = true;
+        }
+        acquisition_result_t result = acquisition_run(&acquisition, esp_timer_get_time(), &sample);
+
+        // The samples read so far survive a single failed exchange
+        if(result == ACQUISITION_ERROR) {
+            errors++;
+
+            if(acquisition.samples == 0) {
+                window_reset();
+            }
+        }
+
+        // Time from a request to the sensor starting on it
+        if(requested >= 0 && acquisition.calibration.status != ACQUISITION_STATUS_PENDING) {
+            request_wait = MAX(request_wait, emulator_time - requested);
+            requested = -1;
+        }
+
+        if(calibrated < 0 && acquisition.calibration.checked) {
+            calibrated = acquisition.calibration.step_time;
+        }
+
+        if(result != ACQUISITION_READING) {
+            continue;
+        }
+
+        if(!window_contains(&sample)) {
+            ESP_LOG_LEVEL(ESP_LOG_NONE, EMULATOR_TAG, "%.3fs: reading CO₂ %d ppm - %.2f °C - %.2f%% outside "
+                          "of the samples read", emulator_time / 1000000.0, sample.co2, sample.temperature,
+                          sample.humidity);
+            outside++;
+        }
+        ESP_LOGI(EMULATOR_TAG, "%8.3fs: CO₂ %4d ppm - Temperature %2.2f °C - Humidity %2.2f%%",
+                 emulator_time / 1000000.0, sample.co2, sample.temperature, sample.humidity);
+
+        uint32_t now = emulator_time / 1000000;
+        statistics_sample_t closed;
+        statistics_add(now, sample.co2, sample.temperature, sample.humidity, &closed);
+        reference_add(now, &sample);
+        mismatches += reference_check(now);
+
+        first_reading = first_reading < 0 ? emulator_time : first_reading;
+        last_reading = emulator_time;
+        readings++;
+        window_reset();
+    }
+
+    // The stale settings once at boot and the ASC change, nothing after the reboot
+    uint16_t offset = lroundf(SENSORS_TEMPERATURE_OFFSET * ACQUISITION_OFFSET_SCALE);
+
+    if(corrupt_every == 0 && (scd4x.persists != 2 || abs(scd4x.eeprom[SCD4X_OFFSET] - offset) > 1 ||
+                              scd4x.eeprom[SCD4X_ALTITUDE] != SENSORS_SENSOR_ALTITUDE || scd4x.eeprom[SCD4X_ASC] != 0 ||
+                              !acquisition.calibration.checked || acquisition.calibration.persists != 0)) {
+        ESP_LOG_LEVEL(ESP_LOG_NONE, EMULATOR_TAG, "%.3fs: %u EEPROM writes, offset 0x%04x altitude %u ASC %u",
+                      emulator_time / 1000000.0, scd4x.persists, scd4x.eeprom[SCD4X_OFFSET],
+                      scd4x.eeprom[SCD4X_ALTITUDE], scd4x.eeprom[SCD4X_ASC]);
+        calibration_mismatches++;
+    }
+
+    ESP_LOG_LEVEL(ESP_LOG_NONE, EMULATOR_TAG, "%-11s calibrated after %5.3fs, requests started within %5.3fs, "
+                  "first reading after %5.1fs, "
+                  "%4u readings every %6.1fs, %5u transfers, bus busy %6.3fs (%.4f%%) longest %uus, %u errors, "
+                  "%u violations, %u outside, %u statistics mismatches, %u EEPROM writes, %u calibration mismatches",
+                  name, calibrated / 1000000.0, request_wait / 1000000.0, first_reading / 1000000.0, readings,
+                  readings > 1 ? (last_reading - first_reading) / 1000000.0 / (readings - 1) : 0.0,
+                  bus.transactions, bus.busy_time / 1000000.0, (bus.busy_time * 100.0) / duration,
+                  (uint32_t) bus.longest, errors, bus.violations, outside, mismatches, scd4x.persists,
+                  calibration_mismatches);
+
+    return bus.violations + outside + mismatches + calibration_mismatches + (readings == 0);
+}
+
+void usage(const char *name) {
+    printf("Usage: %s [-m periodic|low_power|single_shot] [-d hours] [-f corrupt_every_nth_read] [-v]\n", name);
+}
+
+int main(int argc, char **argv) {
+    const char *names[] = {"periodic", "low_power", "single_shot"};
+    int mode = -1;
+    int64_t duration = EMULATOR_DEFAULT_HOURS * 3600 * 1000000LL;
+    uint32_t corrupt_every = 0;
+    uint32_t failures = 0;
+    int option;
+
+    while((option = getopt(argc, argv, "m:d:f:vh")) != -1) {
+        switch(option) {
+            case 'm':
+                for(mode = ACQUISITION_SINGLE_SHOT; mode >= 0 && strcmp(optarg, names[mode]) != 0; mode--);
+
+                if(mode < 0) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'd':
+                duration = atof(optarg) * 3600 * 1000000LL;
+                break;
+            case 'f':
+                corrupt_every = atoi(optarg);
+                break;
+            case 'v':
+                simulator_log_level = ESP_LOG_INFO;
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    for(int i = ACQUISITION_PERIODIC; i <= ACQUISITION_SINGLE_SHOT; i++) {
+
+        if(mode < 0 || mode == i) {
+            failures += emulator_run(i, names[i], duration, corrupt_every);
+        }
+    }
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
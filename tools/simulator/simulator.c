@@ -0,0 +1,1203 @@
+/* MIT License
+*
+* Copyright (c) 2022 ma-lwa-re
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include "dreamdesk.h"
+#include "motion.h"
+#include "events.h"
+#include "api.h"
+
+#define SIMULATOR_TICK_US           (portTICK_PERIOD_MS * 1000)
+#define SIMULATOR_STEP_US           (1000)
+#define SIMULATOR_SLOT_US           (10000)
+#define SIMULATOR_SPEED             (38000)
+#define SIMULATOR_ACCELERATION      (150000)
+#define SIMULATOR_STATUS_DELAY_US   (150000)
+#define SIMULATOR_HISTORY_SIZE      (SIMULATOR_STATUS_DELAY_US / SIMULATOR_STEP_US)
+#define SIMULATOR_MOTOR_TIMEOUT_US  (200000)
+#define SIMULATOR_WAKE_UP_US        (100000)
+#define SIMULATOR_COMMAND_US        (2500)
+#define SIMULATOR_SWITCH_US         (50)
+#define SIMULATOR_SETTLE_US         (500000)
+#define SIMULATOR_TIMEOUT_US        (60 * 1000000)
+#define SIMULATOR_TX_BUFFER_SIZE    (64)
+#define SIMULATOR_NVS_SIZE          (16)
+#define SIMULATOR_NVS_KEY_SIZE      (16)
+#define SIMULATOR_TIMERS            (4)
+#define SIMULATOR_SEMAPHORES        (4)
+#define SIMULATOR_QUEUE_SIZE        (16)
+#define SIMULATOR_QUEUE_ITEM_SIZE   (32)
+#define SIMULATOR_CAPTURE_SIZE      (2048)
+#define SIMULATOR_CAPTURE_FRAMES    (SIMULATOR_CAPTURE_SIZE / LIN_HEADER_SIZE)
+#define SIMULATOR_UNANSWERED        (7)
+#define SIMULATOR_STRESS_WRITES     (2000000)
+#define SIMULATOR_STRESS_READERS    (16)
+#define SIMULATOR_PAYLOADS          (100000)
+#define SIMULATOR_BENCHMARK_CALLS   (20000000)
+#define SIMULATOR_BIT(value, bit)   (((value) >> (bit)) & 0x01)
+
+// A notified move_task runs within the step it was notified in, the IKEA schedule runs a
+// whole cycle at once so what it notifies waits for the end of the cycle. Polling on the
+// DESK_MOVE_TIMEOUT instead of waking on the notifications goes well past either bound.
+#if defined(LIN_MASTER)
+#define SIMULATOR_LATENCY_US        (DESK_MOVE_PERIOD_MS * 1000 + SIMULATOR_SWITCH_US)
+#else
+#define SIMULATOR_LATENCY_US        (SIMULATOR_STEP_US + SIMULATOR_SWITCH_US)
+#endif
+
+static const char *SIMULATOR_TAG = "simulator";
+
+#if defined(LOGICDATA)
+static const uint8_t master_schedule[] = {LIN_PROTECTED_ID_SYNC, LIN_PROTECTED_ID_MOVE, LIN_PROTECTED_ID_STATUS};
+#endif
+
+typedef struct motor {
+    int64_t time;
+    int64_t position;
+    int32_t velocity;
+    int8_t direction;
+    int64_t last_command;
+    int64_t last_moved;
+    int32_t history[SIMULATOR_HISTORY_SIZE];
+    uint32_t history_index;
+} motor_t;
+
+typedef struct bus {
+    lin_parser_t parser;
+    bool in_header;
+    uint8_t tx_buffer[SIMULATOR_TX_BUFFER_SIZE];
+    uint8_t tx_size;
+    uint8_t slot;
+    int64_t next_slot;
+    uint32_t frames;
+    int64_t break_start;
+    int64_t last_header;
+    int64_t next_cycle;
+} bus_t;
+
+// Slot timing of the headers sent by the firmware when it is the bus master
+typedef struct schedule {
+    uint32_t headers;
+    uint32_t violations;
+    int64_t break_min;
+    int64_t break_max;
+    int64_t space_min;
+} schedule_t;
+
+struct esp_timer {
+    esp_timer_cb_t callback;
+    void *arg;
+    int64_t due;
+    bool created;
+    bool armed;
+};
+
+struct semaphore {
+    bool created;
+    bool given;
+};
+
+// The UART queue is left NULL by the stubbed driver, only the command queue is real
+typedef struct queue {
+    uint8_t items[SIMULATOR_QUEUE_SIZE][SIMULATOR_QUEUE_ITEM_SIZE];
+    UBaseType_t length;
+    UBaseType_t item_size;
+    UBaseType_t head;
+    UBaseType_t count;
+} queue_t;
+
+// The bytes of the bus with the time each one ended, replayed into a bare parser
+typedef struct capture {
+    bool enabled;
+    bool closed;
+    uint8_t bytes[SIMULATOR_CAPTURE_SIZE];
+    int64_t times[SIMULATOR_CAPTURE_SIZE];
+    uint16_t size;
+    uint16_t offsets[SIMULATOR_CAPTURE_FRAMES];
+    uint8_t sizes[SIMULATOR_CAPTURE_FRAMES];
+    uint16_t headers;
+    uint16_t unanswered;
+} capture_t;
+
+typedef struct nvs_entry {
+    char key[SIMULATOR_NVS_KEY_SIZE];
+    uint16_t value;
+} nvs_entry_t;
+
+typedef struct scenario {
+    int32_t start;
+    int32_t target;
+    int32_t extreme;
+    int32_t overshoot;
+    int32_t error;
+    int64_t start_time;
+    int64_t settle_time;
+    int64_t end_time;
+    uint32_t state_changes;
+    uint32_t events;
+    uint32_t early_events;
+    bool stale_events;
+    bool running;
+    bool commanded;
+    bool reached;
+} scenario_t;
+
+esp_log_level_t simulator_log_level = ESP_LOG_NONE;
+int64_t simulator_time = 0;
+
+extern response_frame_t response_frame;
+
+static motor_t motor;
+static bus_t bus;
+static scenario_t scenario;
+static jmp_buf scenario_exit;
+static nvs_entry_t nvs[SIMULATOR_NVS_SIZE];
+static uint32_t nvs_writes = 0;
+static uint32_t notifications = 0;
+static int64_t notify_time = 0;
+static esp_timer_handle_t command_timer;
+static schedule_t schedule = {.break_min = INT64_MAX, .space_min = INT64_MAX};
+static capture_t capture;
+static atomic_bool stress_running;
+static atomic_ullong stress_reads;
+static atomic_ullong stress_torn;
+static struct esp_timer timers[SIMULATOR_TIMERS];
+static struct semaphore semaphores[SIMULATOR_SEMAPHORES];
+static queue_t command_queue;
+static events_t events;
+static esp_timer_handle_t events_timer;
+static int64_t events_last = INT64_MIN;
+static bool serving = false;
+static int64_t serve_origin = 0;
+
+void simulator_advance(int64_t duration);
+
+int64_t esp_timer_get_time() {
+    return simulator_time;
+}
+
+TickType_t xTaskGetTickCount() {
+    return simulator_time / SIMULATOR_TICK_US;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+
+    if(command_queue.length != 0 || length > SIMULATOR_QUEUE_SIZE || item_size > SIMULATOR_QUEUE_ITEM_SIZE) {
+        return NULL;
+    }
+    command_queue = (queue_t) {.length = length, .item_size = item_size};
+    return &command_queue;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks) {
+    queue_t *q = queue;
+
+    if(q == NULL || q->count == 0) {
+        return pdFALSE;
+    }
+    memcpy(item, q->items[q->head], q->item_size);
+    q->head = (q->head + 1) % q->length;
+    q->count--;
+    return pdTRUE;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks) {
+    queue_t *q = queue;
+
+    if(q == NULL) {
+        return pdTRUE;
+    }
+
+    if(q->count == q->length) {
+        return pdFALSE;
+    }
+    memcpy(q->items[(q->head + q->count) % q->length], item, q->item_size);
+    q->count++;
+    return pdTRUE;
+}
+
+BaseType_t xQueueReset(QueueHandle_t queue) {
+    queue_t *q = queue;
+
+    if(q != NULL) {
+        q->head = q->count = 0;
+    }
+    return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+    return queue != NULL ? ((queue_t*) queue)->count : 0;
+}
+
+int uart_read_bytes(uart_port_t port, void *data, uint32_t size, TickType_t ticks) {
+    return 0;
+}
+
+int uart_flush_input(uart_port_t port) {
+    return 0;
+}
+
+// The break is the TX line held low, its length is the time the line stays inverted
+int uart_set_line_inverse(uart_port_t port, uint32_t inverse_mask) {
+
+    if(inverse_mask == UART_SIGNAL_TXD_INV) {
+        bus.break_start = simulator_time;
+        return 0;
+    }
+
+    int64_t break_length = simulator_time - bus.break_start;
+    schedule.break_min = MIN(schedule.break_min, break_length);
+    schedule.break_max = MAX(schedule.break_max, break_length);
+
+    if(break_length < LIN_HEADER_BREAK_DURATION) {
+        schedule.violations++;
+    }
+
+    if(bus.last_header > 0) {
+        int64_t space = bus.break_start - bus.last_header;
+        schedule.space_min = MIN(schedule.space_min, space);
+
+        if(space < LIN_FRAME_SPACE_US) {
+            schedule.violations++;
+        }
+    }
+    return 0;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *create_args, esp_timer_handle_t *handle) {
+    for(uint8_t i = 0; i < SIMULATOR_TIMERS; i++) {
+
+        if(!timers[i].created) {
+            timers[i] = (struct esp_timer) {.callback = create_args->callback, .arg = create_args->arg,
+                                            .created = true};
+            *handle = &timers[i];
+            return ESP_OK;
+        }
+    }
+    return ESP_FAIL;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us) {
+    timer->due = simulator_time + timeout_us;
+    timer->armed = true;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+    timer->armed = false;
+    return ESP_OK;
+}
+
+struct esp_timer *timer_next(int64_t until) {
+    struct esp_timer *next = NULL;
+
+    for(uint8_t i = 0; i < SIMULATOR_TIMERS; i++) {
+
+        if(timers[i].armed && timers[i].due <= until && (next == NULL || timers[i].due < next->due)) {
+            next = &timers[i];
+        }
+    }
+    return next;
+}
+
+SemaphoreHandle_t semaphore_create(bool given) {
+    for(uint8_t i = 0; i < SIMULATOR_SEMAPHORES; i++) {
+
+        if(!semaphores[i].created) {
+            semaphores[i] = (struct semaphore) {.created = true, .given = given};
+            return &semaphores[i];
+        }
+    }
+    return NULL;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary() {
+    return semaphore_create(false);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex() {
+    return semaphore_create(true);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks) {
+    // Only the timers can give a semaphore while the single firmware task is blocked
+    while(!semaphore->given && timer_next(INT64_MAX) != NULL) {
+        simulator_advance(timer_next(INT64_MAX)->due - simulator_time);
+    }
+
+    if(!semaphore->given) {
+        return pdFALSE;
+    }
+    semaphore->given = false;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+    semaphore->given = true;
+    return pdTRUE;
+}
+
+nvs_entry_t *nvs_find(const char *key, bool create) {
+    for(uint8_t i = 0; i < SIMULATOR_NVS_SIZE; i++) {
+
+        if(strncmp(nvs[i].key, key, SIMULATOR_NVS_KEY_SIZE) == 0) {
+            return &nvs[i];
+        }
+
+        if(create && nvs[i].key[0] == '\0') {
+            strncpy(nvs[i].key, key, SIMULATOR_NVS_KEY_SIZE - 1);
+            return &nvs[i];
+        }
+    }
+    return NULL;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *handle) {
+    *handle = 0;
+    return (open_mode == NVS_READONLY && nvs[0].key[0] == '\0') ? ESP_ERR_NVS_NOT_FOUND : ESP_OK;
+}
+
+esp_err_t nvs_get_u16(nvs_handle_t handle, const char *key, uint16_t *value) {
+    nvs_entry_t *entry = nvs_find(key, false);
+
+    if(entry == NULL) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    *value = entry->value;
+    return ESP_OK;
+}
+
+esp_err_t nvs_set_u16(nvs_handle_t handle, const char *key, uint16_t value) {
+    nvs_entry_t *entry = nvs_find(key, true);
+
+    if(entry == NULL) {
+        return ESP_FAIL;
+    }
+    entry->value = value;
+    return ESP_OK;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle) {
+    nvs_writes++;
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle) {
+}
+
+int32_t motor_height() {
+    return motor.position / 1000;
+}
+
+// The controller reports the position it measured a while ago
+int32_t motor_reported_height() {
+    return motor.history[motor.history_index];
+}
+
+void motor_update(int64_t until) {
+    // The motor moves in fixed steps while the bus and the timers run on the exact time
+    for(; motor.time + SIMULATOR_STEP_US <= until; motor.time += SIMULATOR_STEP_US) {
+        int32_t speed = 0;
+
+        if(motor.direction != 0 && motor.time - motor.last_command < SIMULATOR_MOTOR_TIMEOUT_US) {
+            speed = motor.direction * SIMULATOR_SPEED;
+        }
+
+        int32_t step = SIMULATOR_ACCELERATION / (1000000 / SIMULATOR_STEP_US);
+
+        if(motor.velocity < speed) {
+            motor.velocity = (motor.velocity + step > speed) ? speed : motor.velocity + step;
+        } else if(motor.velocity > speed) {
+            motor.velocity = (motor.velocity - step < speed) ? speed : motor.velocity - step;
+        }
+        motor.position += (int64_t) motor.velocity * SIMULATOR_STEP_US / 1000000;
+
+        if(motor.velocity != 0) {
+            motor.last_moved = motor.time;
+        }
+
+        int32_t height = motor_height();
+        motor.history[motor.history_index] = height;
+        motor.history_index = (motor.history_index + 1) % SIMULATOR_HISTORY_SIZE;
+
+        if(scenario.running && ((scenario.target > scenario.start && height > scenario.extreme) ||
+                                (scenario.target < scenario.start && height < scenario.extreme))) {
+            scenario.extreme = height;
+        }
+    }
+    simulator_time = MAX(simulator_time, until);
+}
+
+void motor_command(uint8_t protected_id, uint8_t *data) {
+    #if defined(LOGICDATA)
+    response_frame_t *response = (response_frame_t*) data;
+
+    if(protected_id == LIN_PROTECTED_ID_MOVE) {
+        motor.direction = (response->action != DESK_MOVE) ? 0 : (response->direction == DESK_UP) ? 1 : -1;
+        motor.last_command = simulator_time;
+    }
+    #elif defined(IKEA)
+    response_frame_t *response = (response_frame_t*) data;
+
+    if(protected_id == LIN_PROTECTED_ID_MOVE) {
+        motor.direction = (response->action == DESK_UP) ? 1 : (response->action == DESK_DOWN) ? -1 : 0;
+        motor.last_command = simulator_time;
+    }
+    #endif
+}
+
+uint8_t motor_status(uint8_t protected_id, uint8_t *frame) {
+    uint8_t *data = frame;
+    int32_t height = motor_reported_height();
+
+    #if defined(LOGICDATA)
+    if(protected_id != LIN_PROTECTED_ID_STATUS) {
+        return 0;
+    }
+    memset(data, 0x00, LIN_DATA_SIZE);
+    data[2] = DESK_READY;
+    data[3] = height >> 8;
+    data[4] = height & 0xFF;
+    data[5] = ((height - DESK_MIN_HEIGHT) * 255) / (DESK_MAX_HEIGHT - DESK_MIN_HEIGHT);
+    #elif defined(IKEA)
+    if(protected_id != LIN_PROTECTED_ID_STATUS_RIGHT && protected_id != LIN_PROTECTED_ID_STATUS_LEFT) {
+        return 0;
+    }
+    uint16_t raw_height = (height * 1005) / 100 - 6370;
+    data[0] = raw_height & 0xFF;
+    data[1] = raw_height >> 8;
+    data[2] = motor.velocity != 0 ? DESK_STATUS_MOVING : DESK_STATUS_READY;
+    #endif
+
+    data[LIN_DATA_SIZE] = checksum(data, protected_id | parity(protected_id));
+    return LIN_DATA_SIZE + LIN_CHECKSUM_SIZE;
+}
+
+// Every few headers the response is left out, like a slave missing its slot
+void capture_frame(uint8_t *header, uint8_t *response, uint8_t response_size) {
+
+    if(capture.headers % SIMULATOR_UNANSWERED == SIMULATOR_UNANSWERED - 1) {
+        response_size = 0;
+    }
+
+    if(!capture.enabled || capture.closed || capture.size + LIN_HEADER_SIZE + response_size > SIMULATOR_CAPTURE_SIZE) {
+        return;
+    }
+    capture.offsets[capture.headers] = capture.size + LIN_HEADER_SIZE - 1;
+    capture.sizes[capture.headers] = response_size;
+    capture.unanswered += response_size == 0;
+    capture.headers++;
+
+    for(uint8_t i = 0; i < LIN_HEADER_SIZE; i++, capture.size++) {
+        capture.bytes[capture.size] = header[i];
+        capture.times[capture.size] = simulator_time - (LIN_HEADER_SIZE - 1 - i) * LIN_BYTE_US;
+    }
+
+    for(uint8_t i = 0; i < response_size; i++, capture.size++) {
+        capture.bytes[capture.size] = response[i];
+        capture.times[capture.size] = simulator_time + (i + 1) * LIN_BYTE_US;
+    }
+}
+
+void bus_header(uint8_t protected_id) {
+    uint8_t header[LIN_HEADER_SIZE] = {LIN_HEADER_BREAK, LIN_HEADER_SYNC, protected_id | parity(protected_id)};
+    uint8_t response[LIN_FRAME_MAX_SIZE];
+    uint8_t response_size = 0;
+
+    // Every header starts with a break, exactly like the UART_BREAK event in rx_task,
+    // and its bytes are stamped from the end of the event the same way
+    lin_parser_reset(&bus.parser);
+    bus.parser.timestamp = simulator_time - sizeof(header) * LIN_BYTE_US;
+    bus.in_header = true;
+    bus.tx_size = 0;
+    desk_handle_lin_bytes(&bus.parser, header, sizeof(header));
+
+    if(bus.tx_size > 0) {
+        response_size = MIN(bus.tx_size, sizeof(response));
+        memcpy(response, bus.tx_buffer, response_size);
+        motor_command(protected_id, response);
+    } else {
+        response_size = motor_status(protected_id, response);
+    }
+
+    // The bus is a single wire, the response is read back by the receiver as well
+    capture_frame(header, response, response_size);
+    bus.tx_size = 0;
+    desk_handle_lin_bytes(&bus.parser, response, response_size);
+    bus.in_header = false;
+    bus.frames++;
+}
+
+void simulator_advance(int64_t duration) {
+    int64_t until = simulator_time + duration;
+
+    for(;;) {
+        struct esp_timer *timer = timer_next(until);
+
+        #if defined(LOGICDATA)
+        if(bus.next_slot <= until && (timer == NULL || bus.next_slot < timer->due)) {
+            motor_update(bus.next_slot);
+            bus_header(master_schedule[bus.slot]);
+            bus.slot = (bus.slot + 1) % sizeof(master_schedule);
+            bus.next_slot += SIMULATOR_SLOT_US;
+            continue;
+        }
+        #elif defined(LIN_MASTER)
+        // Stands in for lin_schedule_task, the cycle itself advances the time until its last header
+        if(bus.next_cycle <= until && (timer == NULL || bus.next_cycle < timer->due)) {
+            int64_t cycle_start = bus.next_cycle;
+            motor_update(cycle_start);
+            bus.next_cycle = INT64_MAX;
+            bus.next_cycle = MAX(cycle_start + (int64_t) lin_schedule_cycle() * SIMULATOR_TICK_US, simulator_time);
+            continue;
+        }
+        #endif
+
+        if(timer == NULL) {
+            break;
+        }
+        motor_update(timer->due);
+        timer->armed = false;
+        timer->callback(timer->arg);
+    }
+    motor_update(until);
+}
+
+int uart_write_bytes(uart_port_t port, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+
+    if(bus.in_header) {
+        size = MIN(size, sizeof(bus.tx_buffer) - bus.tx_size);
+        memcpy(&bus.tx_buffer[bus.tx_size], bytes, size);
+        bus.tx_size += size;
+        return size;
+    }
+
+    // The IKEA firmware is the bus master, headers come from its schedule table
+    if(size == LIN_HEADER_SIZE - 1 && bytes[0] == LIN_HEADER_SYNC) {
+        schedule.headers++;
+        bus_header(bytes[1] & 0x3F);
+        bus.last_header = simulator_time;
+    }
+    return size;
+}
+
+int64_t wall_time() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Keeps the simulated desk in step with the wall clock, the API is served while it waits
+void simulator_serve_poll() {
+    int64_t ahead = simulator_time - (wall_time() - serve_origin);
+    api_poll(MAX(ahead, 0) / 1000);
+}
+
+void simulator_check() {
+
+    if(serving) {
+        simulator_serve_poll();
+        return;
+    }
+
+    if(!scenario.running) {
+        return;
+    }
+
+    // Give the firmware time to see the desk at rest before ending the move, a queued
+    // command has not reached move_task yet
+    if(scenario.commanded && command_queue.count == 0 && !desk_get_state().control && motor.velocity == 0 && simulator_time - motor.last_moved >= SIMULATOR_SETTLE_US) {
+        scenario.reached = true;
+        longjmp(scenario_exit, 1);
+    }
+
+    if(simulator_time - scenario.start_time > SIMULATOR_TIMEOUT_US) {
+        longjmp(scenario_exit, 1);
+    }
+}
+
+void vTaskDelay(TickType_t ticks) {
+    simulator_advance((int64_t) ticks * SIMULATOR_TICK_US);
+    simulator_check();
+}
+
+void vTaskDelete(TaskHandle_t task) {
+}
+
+void vTaskSuspend(TaskHandle_t task) {
+}
+
+void vTaskDelayUntil(TickType_t *previous_wake_time, TickType_t ticks) {
+    *previous_wake_time += ticks;
+    simulator_advance(MAX((int64_t) *previous_wake_time * SIMULATOR_TICK_US - simulator_time, 0));
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle() {
+    return &notifications;
+}
+
+// The firmware runs as a single host thread, there is no task stack to watch
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task) {
+    return 0;
+}
+
+char *pcTaskGetName(TaskHandle_t task) {
+    return "simulator";
+}
+
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value, eNotifyAction action) {
+
+    if(notifications == 0) {
+        notify_time = simulator_time;
+    }
+    notifications |= value;
+    return pdPASS;
+}
+
+// move_task is the only task waiting, the bus keeps running until it is notified
+BaseType_t xTaskNotifyWait(uint32_t clear_on_entry, uint32_t clear_on_exit, uint32_t *value, TickType_t ticks) {
+    int64_t until = simulator_time + (int64_t) ticks * SIMULATOR_TICK_US;
+    notifications &= ~clear_on_entry;
+
+    while(notifications == 0 && simulator_time < until) {
+        simulator_advance(SIMULATOR_STEP_US);
+        simulator_check();
+    }
+
+    // The notified task only runs once the scheduler switched over to it. It preempts the
+    // schedule task of the IKEA master, so a cycle due meanwhile only starts after it
+    if(notifications != 0) {
+        int64_t next_cycle = bus.next_cycle;
+        bus.next_cycle = INT64_MAX;
+        simulator_advance(MAX(notify_time + SIMULATOR_SWITCH_US - simulator_time, 0));
+        bus.next_cycle = next_cycle;
+    }
+    simulator_check();
+
+    if(value != NULL) {
+        *value = notifications;
+    }
+    bool notified = notifications != 0;
+    notifications &= ~clear_on_exit;
+    return notified ? pdTRUE : pdFALSE;
+}
+
+// Stands in for NotifyDeskState, the events come from the same events_notify and the
+// HomeKit timer that ends the interval is an esp_timer on the simulated clock
+void simulator_notify() {
+    desk_state_t state = desk_get_state();
+    uint8_t raised = events_notify(&events, &state);
+
+    if(raised != 0x00) {
+
+        if(scenario.running) {
+            scenario.events += __builtin_popcount(raised);
+            scenario.early_events += simulator_time - events_last < EVENTS_INTERVAL_MS * 1000;
+        }
+        events_last = simulator_time;
+    }
+
+    if(events.held) {
+        esp_timer_start_once(events_timer, EVENTS_INTERVAL_MS * 1000);
+    }
+}
+
+void simulator_events_timer(void *arg) {
+    events_release(&events);
+    simulator_notify();
+}
+
+// Stands in for HandleDeskStateChange, the run loop callback is taken to run right away
+void simulator_listener(const desk_state_t *state) {
+
+    if(scenario.running) {
+        scenario.state_changes++;
+    }
+
+    if(events_changed(&events)) {
+        simulator_notify();
+    }
+}
+
+// Feeds the capture to a bare parser, without the resets rx_task does on breaks and silent
+// gaps, in the events the UART would post plus one more boundary at the split offset.
+// Returns the number of headers and frames that did not come out exactly as sent.
+uint32_t replay_split(uint16_t split) {
+    lin_parser_t parser;
+    uint16_t header = 0, frames = 0, expected_frames = 0;
+    uint32_t lost = 0;
+
+    lin_parser_reset(&parser);
+
+    for(uint16_t start = 0, end; start < capture.size; start = end) {
+        // An event ends where the line stays idle for a byte time
+        for(end = start + 1; end < capture.size && end != split &&
+            capture.times[end] - capture.times[end - 1] <= LIN_BYTE_US; end++);
+
+        parser.timestamp = capture.times[end - 1] + LIN_BYTE_US - (end - start) * LIN_BYTE_US;
+
+        for(uint16_t i = start; i < end; i++) {
+            uint8_t *frame = &parser.buffer[LIN_HEADER_SIZE - 1];
+
+            switch(lin_parser_feed(&parser, capture.bytes[i])) {
+                case LIN_EVENT_NONE:
+                    break;
+                case LIN_EVENT_HEADER:
+                    if(header < capture.headers && *frame == capture.bytes[capture.offsets[header]]) {
+                        header++;
+                    } else {
+                        lost++;
+                    }
+                    break;
+                case LIN_EVENT_FRAME:
+                    if(header > 0 && capture.sizes[header - 1] > 0 &&
+                       memcmp(frame, &capture.bytes[capture.offsets[header - 1]], parser.size - LIN_HEADER_SIZE + 1) == 0) {
+                        frames++;
+                    } else {
+                        lost++;
+                    }
+                    break;
+                default:
+                    lost++;
+                    break;
+            }
+        }
+    }
+
+    for(uint16_t i = 0; i < capture.headers; i++) {
+        expected_frames += capture.sizes[i] > 0;
+    }
+    return lost + (capture.headers - header) + (expected_frames - frames);
+}
+
+// Replays the capture split at every byte offset, a frame crossing two events must still come out whole
+uint32_t replay() {
+    uint32_t lost = 0;
+
+    for(uint16_t split = 1; split < capture.size; split++) {
+        lost += replay_split(split);
+    }
+
+    ESP_LOG_LEVEL(ESP_LOG_NONE, SIMULATOR_TAG, "Replayed %u bytes with %u headers, %u unanswered, split at "
+                  "every offset: %u frames lost", capture.size, capture.headers, capture.unanswered, lost);
+    return lost;
+}
+
+void simulator_reset(int32_t start) {
+    desk_state_init();
+    response_frame.action = DESK_IDLE;
+
+    memset(&motor, 0x00, sizeof(motor));
+    motor.time = simulator_time;
+    motor.position = (int64_t) start * 1000;
+
+    for(uint32_t i = 0; i < SIMULATOR_HISTORY_SIZE; i++) {
+        motor.history[i] = start;
+    }
+
+    memset(&bus, 0x00, sizeof(bus));
+    lin_parser_reset(&bus.parser);
+    bus.next_slot = simulator_time;
+    bus.next_cycle = simulator_time;
+
+    #if defined(LIN_MASTER)
+    lin_schedule_set(LIN_MASTER_SCHEDULE);
+    #endif
+
+    memset(&scenario, 0x00, sizeof(scenario));
+    notifications = 0;
+    esp_timer_stop(command_timer);
+
+    memset(&events, 0x00, sizeof(events));
+    esp_timer_stop(events_timer);
+    events_last = INT64_MIN;
+
+    // Learned motion parameters survive between moves through the emulated NVS
+    motion_init();
+}
+
+// The command arrives while move_task waits, as it would from HomeKit or the API
+void simulator_command(void *arg) {
+    scenario.start_time = simulator_time;
+    scenario.commanded = true;
+    desk_send_command(DESK_COMMAND_HEIGHT, scenario.target);
+}
+
+scenario_t simulator_run(int32_t start, int32_t target) {
+    simulator_reset(start);
+
+    // Let the controller report its height before asking for a move
+    simulator_advance(SIMULATOR_WAKE_UP_US);
+
+    scenario.start = start;
+    scenario.target = target;
+    scenario.extreme = start;
+    scenario.start_time = simulator_time;
+    esp_timer_start_once(command_timer, SIMULATOR_COMMAND_US);
+
+    if(setjmp(scenario_exit) == 0) {
+        scenario.running = true;
+        move_task(NULL);
+    }
+
+    // The bus restarts with every scenario, the capture keeps to the first one
+    scenario.end_time = simulator_time;
+
+    // The events held back at the end of the move still go out once the interval is over
+    while(events_timer->armed) {
+        simulator_advance(events_timer->due - simulator_time);
+    }
+
+    desk_state_t state = desk_get_state();
+    events_t published = events;
+    scenario.stale_events = events_notify(&published, &state) != 0x00;
+
+    scenario.running = false;
+    capture.closed = true;
+    scenario.settle_time = motor.last_moved - scenario.start_time;
+    scenario.error = motor_height() - target;
+    scenario.overshoot = (target > start) ? scenario.extreme - target : target - scenario.extreme;
+    scenario.overshoot = MAX(scenario.overshoot, 0);
+    return scenario;
+}
+
+// Runs the desk in real time with the local API on the given port until interrupted
+int simulator_serve(uint16_t port, int32_t start) {
+    simulator_reset(start);
+    simulator_advance(SIMULATOR_WAKE_UP_US);
+
+    if(!api_init(port)) {
+        return EXIT_FAILURE;
+    }
+    ESP_LOG_LEVEL(ESP_LOG_NONE, SIMULATOR_TAG, "Desk at %dcm, serving the API on port %d", start / 10, port);
+
+    serve_origin = wall_time() - simulator_time;
+    serving = true;
+    move_task(NULL);
+    return EXIT_SUCCESS;
+}
+
+uint16_t stress_height(int64_t time) {
+    return DESK_MIN_HEIGHT + (time * 2) % (DESK_MAX_HEIGHT - DESK_MIN_HEIGHT);
+}
+
+// A snapshot is torn when it mixes two writes, the percentage and the timestamp always go
+// with the height and only the targets of stress_mover are odd, so control goes with an odd target
+void *stress_reader(void *arg) {
+    uint64_t reads = 0, torn = 0;
+
+    while(atomic_load(&stress_running)) {
+        desk_state_t state = desk_get_state();
+        torn += state.percentage != desk_height_percentage(state.current_height) ||
+                state.current_height != stress_height(state.height_timestamp) ||
+                state.control != (state.target_height & 0x01);
+        reads++;
+    }
+    atomic_fetch_add(&stress_reads, reads);
+    atomic_fetch_add(&stress_torn, torn);
+    return NULL;
+}
+
+// Stands in for rx_task, the clock only moves here and every tick brings another height
+void *stress_receiver(void *arg) {
+    for(uint32_t i = 0; i < SIMULATOR_STRESS_WRITES; i++) {
+        simulator_time = i;
+        desk_update_height(stress_height(i));
+    }
+    return NULL;
+}
+
+// Stands in for move_task, odd targets taken and released again
+void *stress_mover(void *arg) {
+    for(uint32_t i = 0; i < SIMULATOR_STRESS_WRITES; i++) {
+        uint16_t target = DESK_MIN_HEIGHT + 1 + (i * 14) % (DESK_MAX_HEIGHT - DESK_MIN_HEIGHT - 2);
+        desk_set_target_height(target);
+        desk_finish_move(target);
+    }
+    return NULL;
+}
+
+// Hammers the desk state from two writer threads and the given number of reader threads,
+// the critical sections of the stubs are real spinlocks so the writers stay serialized.
+// The even heights and odd targets stay apart, the writers never undo each other.
+int simulator_stress(uint32_t readers) {
+    pthread_t reader_threads[SIMULATOR_STRESS_READERS], receiver, mover;
+    readers = MIN(MAX(readers, 1), SIMULATOR_STRESS_READERS);
+
+    simulator_time = 0;
+    simulator_reset(DESK_MIN_HEIGHT);
+    desk_update_height(stress_height(0));
+    atomic_store(&stress_running, true);
+
+    for(uint32_t i = 0; i < readers; i++) {
+        pthread_create(&reader_threads[i], NULL, stress_reader, NULL);
+    }
+    pthread_create(&receiver, NULL, stress_receiver, NULL);
+    pthread_create(&mover, NULL, stress_mover, NULL);
+
+    pthread_join(receiver, NULL);
+    pthread_join(mover, NULL);
+    atomic_store(&stress_running, false);
+
+    for(uint32_t i = 0; i < readers; i++) {
+        pthread_join(reader_threads[i], NULL);
+    }
+
+    ESP_LOG_LEVEL(ESP_LOG_NONE, SIMULATOR_TAG, "%u readers took %llu snapshots during %u height and %u target "
+                  "writes, %llu torn", readers, atomic_load(&stress_reads), SIMULATOR_STRESS_WRITES,
+                  SIMULATOR_STRESS_WRITES, atomic_load(&stress_torn));
+    return atomic_load(&stress_torn) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// The parity and checksum the firmware used before the lookup table and the carry folding
+uint8_t reference_parity(uint8_t pid) {
+    uint8_t p0 = SIMULATOR_BIT(pid, 0) ^ SIMULATOR_BIT(pid, 1) ^ SIMULATOR_BIT(pid, 2) ^ SIMULATOR_BIT(pid, 4);
+    uint8_t p1 = ~(SIMULATOR_BIT(pid, 1) ^ SIMULATOR_BIT(pid, 3) ^ SIMULATOR_BIT(pid, 4) ^ SIMULATOR_BIT(pid, 5));
+    return ((p0 | (p1 << 1)) << 6) & 0xC0;
+}
+
+// The classic checksum of the LIN 1.x frames leaves the protected id out
+uint8_t reference_checksum(uint8_t *lin_data, uint8_t protected_id) {
+    bool classic = (LIN_CLASSIC_CHECKSUM_IDS >> (protected_id & 0x3F)) & 0x01;
+    uint16_t checksum = classic ? 0 : (protected_id & 0x3F) | reference_parity(protected_id);
+
+    for(uint8_t i = 0; i < LIN_DATA_SIZE; i++) {
+        checksum += lin_data[i];
+        if(checksum > 0xFF) {
+            checksum -= 0xFF;
+        }
+    }
+    return (~checksum & 0xFF);
+}
+
+// Returns the time per call in nanoseconds, the sum keeps the calls from being optimized out
+double benchmark(uint8_t (*checksum_function)(uint8_t*, uint8_t), uint8_t (*parity_function)(uint8_t),
+                 uint8_t *payloads, volatile uint32_t *sink) {
+    uint32_t sum = 0;
+    int64_t start = wall_time();
+
+    for(uint32_t i = 0; i < SIMULATOR_BENCHMARK_CALLS; i++) {
+        uint8_t pid = i & LIN_PROTECTED_ID_MAX;
+        sum += checksum_function(&payloads[(i % 256) * LIN_DATA_SIZE], pid | parity_function(pid));
+    }
+    *sink = sum;
+    return (wall_time() - start) * 1000.0 / SIMULATOR_BENCHMARK_CALLS;
+}
+
+// Compares parity() on every byte and checksum() on random payloads for every frame id with
+// the previous code, all zero and all 0xFF payloads included, then times both
+int simulator_checksums() {
+    static uint8_t payloads[256 * LIN_DATA_SIZE];
+    volatile uint32_t sink;
+    uint32_t mismatches = 0;
+    uint8_t data[LIN_DATA_SIZE];
+
+    for(uint16_t pid = 0; pid <= 0xFF; pid++) {
+        mismatches += parity(pid) != reference_parity(pid);
+    }
+
+    srand(1);
+    for(uint8_t id = 0; id <= LIN_PROTECTED_ID_MAX; id++) {
+        uint8_t protected_id = id | reference_parity(id);
+
+        for(uint32_t i = 0; i < SIMULATOR_PAYLOADS; i++) {
+            for(uint8_t j = 0; j < LIN_DATA_SIZE; j++) {
+                data[j] = (i == 0) ? 0x00 : (i == 1) ? 0xFF : rand();
+            }
+            mismatches += checksum(data, protected_id) != reference_checksum(data, protected_id);
+        }
+    }
+
+    for(uint32_t i = 0; i < sizeof(payloads); i++) {
+        payloads[i] = rand();
+    }
+    double reference_time = benchmark(reference_checksum, reference_parity, payloads, &sink);
+    double table_time = benchmark(checksum, parity, payloads, &sink);
+
+    ESP_LOG_LEVEL(ESP_LOG_NONE, SIMULATOR_TAG, "256 parities and %u payloads for each of the 64 ids with %d data "
+                  "bytes, %u mismatches", SIMULATOR_PAYLOADS, LIN_DATA_SIZE, mismatches);
+    ESP_LOG_LEVEL(ESP_LOG_NONE, SIMULATOR_TAG, "Checksum and parity %.2fns per frame, %.2fns before",
+                  table_time, reference_time);
+    return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void usage(const char *name) {
+    printf("Usage: %s [-s start_cm] [-t target_cm] [-m max_overshoot_mm] [-e max_events] [-a api_port] [-r] [-p readers] [-c] [-v]\n", name);
+}
+
+int main(int argc, char **argv) {
+    int32_t start_min = DESK_MIN_HEIGHT / 10, start_max = DESK_MAX_HEIGHT / 10;
+    int32_t target_min = DESK_MIN_HEIGHT / 10, target_max = DESK_MAX_HEIGHT / 10;
+    int32_t max_overshoot = -1;
+    int32_t max_events = -1;
+    int32_t api_port = 0;
+    int32_t stress_readers = 0;
+    int option;
+
+    while((option = getopt(argc, argv, "s:t:m:e:a:rp:cvh")) != -1) {
+        switch(option) {
+            case 's':
+                start_min = start_max = atoi(optarg);
+                break;
+            case 't':
+                target_min = target_max = atoi(optarg);
+                break;
+            case 'm':
+                max_overshoot = atoi(optarg);
+                break;
+            case 'e':
+                max_events = atoi(optarg);
+                break;
+            case 'a':
+                api_port = atoi(optarg);
+                break;
+            case 'c':
+                return simulator_checksums();
+            case 'p':
+                stress_readers = atoi(optarg);
+                break;
+            case 'r':
+                capture.enabled = true;
+                break;
+            case 'v':
+                simulator_log_level = ESP_LOG_INFO;
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    uint32_t count = 0, failures = 0;
+    int64_t total_overshoot = 0, total_settle_time = 0, total_error = 0, total_time = 0;
+    int64_t total_changes = 0, total_events = 0;
+    uint32_t worst_events = 0, early_events = 0, stale_events = 0;
+    int32_t worst_overshoot = 0;
+    clock_t wall_clock = clock();
+
+    #if defined(LIN_MASTER)
+    lin_master_init();
+    #endif
+    esp_timer_create(&(esp_timer_create_args_t){.callback = simulator_events_timer}, &events_timer);
+    esp_timer_create(&(esp_timer_create_args_t){.callback = simulator_command}, &command_timer);
+    desk_add_listener(simulator_listener);
+
+    if(api_port > 0) {
+        return simulator_serve(api_port, start_min * 10);
+    }
+
+    if(stress_readers > 0) {
+        return simulator_stress(stress_readers);
+    }
+
+    for(int32_t start = start_min; start <= start_max; start++) {
+        for(int32_t target = target_min; target <= target_max; target++) {
+
+            if(start == target) {
+                continue;
+            }
+
+            scenario_t result = simulator_run(start * 10, target * 10);
+            bool failed = !result.reached || (max_overshoot >= 0 && result.overshoot > max_overshoot) ||
+                          (max_events >= 0 && result.events > max_events) ||
+                          result.early_events > 0 || result.stale_events;
+
+            if(failed || start_min == start_max || simulator_log_level != ESP_LOG_NONE) {
+                ESP_LOG_LEVEL(ESP_LOG_NONE, SIMULATOR_TAG, "%3dcm -> %3dcm: overshoot %2dmm, error %3dmm, "
+                              "settled in %5lldms, %2u events%s%s", start, target, result.overshoot, result.error,
+                              (long long) result.settle_time / 1000, result.events,
+                              result.reached ? "" : " (timeout)", result.stale_events ? " (stale)" : "");
+            }
+
+            count++;
+            failures += failed;
+            total_overshoot += result.overshoot;
+            total_error += abs(result.error);
+            total_settle_time += result.settle_time;
+            total_time += result.end_time - result.start_time;
+            total_changes += result.state_changes;
+            total_events += result.events;
+            worst_events = MAX(worst_events, result.events);
+            early_events += result.early_events;
+            stale_events += result.stale_events;
+            worst_overshoot = MAX(worst_overshoot, result.overshoot);
+        }
+    }
+
+    double elapsed = (double) (clock() - wall_clock) / CLOCKS_PER_SEC;
+
+    if(count == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    ESP_LOG_LEVEL(ESP_LOG_NONE, SIMULATOR_TAG, "%u scenarios in %.2fs (%.0f/s), %u failed", count, elapsed,
+                  count / (elapsed > 0 ? elapsed : 1), failures);
+    ESP_LOG_LEVEL(ESP_LOG_NONE, SIMULATOR_TAG, "%u NVS commits", nvs_writes);
+    ESP_LOG_LEVEL(ESP_LOG_NONE, SIMULATOR_TAG, "Overshoot mean %.1fmm max %dmm - Error mean %.1fmm - "
+                  "Settle time mean %lldms", (double) total_overshoot / count, worst_overshoot,
+                  (double) total_error / count, (long long) total_settle_time / count / 1000);
+
+    ESP_LOG_LEVEL(ESP_LOG_NONE, SIMULATOR_TAG, "%.1f listener state changes and %.1f HomeKit events per move, "
+                  "at most %u, %u raised within %dms of the previous ones, %u moves left stale", (double) total_changes / count,
+                  (double) total_events / count, worst_events, early_events, EVENTS_INTERVAL_MS, stale_events);
+
+    desk_move_stats_t move_stats = desk_get_move_stats();
+    ESP_LOG_LEVEL(ESP_LOG_NONE, SIMULATOR_TAG, "move_task %.1f wakeups/s, %u decisions, median latency %uus "
+                  "- bound %uus", move_stats.wakeups * 1000000.0 / MAX(total_time, 1), move_stats.decisions,
+                  move_stats.latency_median_us, SIMULATOR_LATENCY_US);
+    failures += move_stats.latency_median_us > SIMULATOR_LATENCY_US;
+    ESP_LOG_LEVEL(ESP_LOG_NONE, SIMULATOR_TAG, "Response latency p50 %uus - p99 %uus - budget %uus",
+                  lin_response_latency(50), lin_response_latency(99), LIN_RESPONSE_BUDGET_US);
+
+    if(schedule.headers > 0) {
+        ESP_LOG_LEVEL(ESP_LOG_NONE, SIMULATOR_TAG, "%u headers, break %lld-%lldus, frame space >= %lldus, "
+                      "%u schedule violations", schedule.headers, (long long) schedule.break_min,
+                      (long long) schedule.break_max, (long long) schedule.space_min, schedule.violations);
+        failures += schedule.violations;
+    }
+    desk_command_stats_t command_stats = desk_get_command_stats();
+    ESP_LOG_LEVEL(ESP_LOG_NONE, SIMULATOR_TAG, "%u commands, queue depth <= %u, command to motion latency "
+                  "<= %uus - bound %uus", command_stats.commands, command_stats.queue_depth_max,
+                  command_stats.latency_max_us, SIMULATOR_LATENCY_US);
+    failures += command_stats.latency_max_us > SIMULATOR_LATENCY_US;
+
+    if(capture.enabled) {
+        failures += replay();
+    }
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
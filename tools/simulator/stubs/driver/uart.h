@@ -0,0 +1,89 @@
+/* MIT License
+*
+* Copyright (c) 2022 ma-lwa-re
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "driver/gpio.h"
+
+#define UART_NUM_0              (0)
+#define UART_NUM_2              (2)
+#define UART_FIFO_LEN           (128)
+#define UART_PIN_NO_CHANGE      (-1)
+#define UART_SIGNAL_INV_DISABLE (0x00)
+#define UART_SIGNAL_TXD_INV     (0x01)
+
+typedef int uart_port_t;
+
+typedef enum {UART_DATA, UART_BREAK, UART_BUFFER_FULL, UART_FIFO_OVF,
+              UART_FRAME_ERR, UART_PARITY_ERR} uart_event_type_t;
+
+typedef enum {UART_DATA_8_BITS} uart_word_length_t;
+typedef enum {UART_PARITY_DISABLE} uart_parity_t;
+typedef enum {UART_STOP_BITS_1} uart_stop_bits_t;
+typedef enum {UART_HW_FLOWCTRL_DISABLE} uart_hw_flowcontrol_t;
+typedef enum {UART_SCLK_APB} uart_sclk_t;
+
+typedef struct {
+    uart_event_type_t type;
+    size_t size;
+} uart_event_t;
+
+typedef struct {
+    int baud_rate;
+    uart_word_length_t data_bits;
+    uart_parity_t parity;
+    uart_stop_bits_t stop_bits;
+    uart_hw_flowcontrol_t flow_ctrl;
+    uart_sclk_t source_clk;
+} uart_config_t;
+
+int uart_write_bytes(uart_port_t port, const void *data, size_t size);
+
+int uart_read_bytes(uart_port_t port, void *data, uint32_t size, TickType_t ticks);
+
+int uart_flush_input(uart_port_t port);
+
+int uart_set_line_inverse(uart_port_t port, uint32_t inverse_mask);
+
+static inline int uart_set_pin(uart_port_t port, int tx, int rx, int rts, int cts) {
+    return 0;
+}
+
+static inline int uart_driver_install(uart_port_t port, int rx_size, int tx_size, int queue_size,
+                                      QueueHandle_t *queue, int flags) {
+    return 0;
+}
+
+static inline int uart_param_config(uart_port_t port, const uart_config_t *config) {
+    return 0;
+}
+
+static inline int uart_set_rx_timeout(uart_port_t port, uint8_t threshold) {
+    return 0;
+}
+
+static inline int uart_get_buffered_data_len(uart_port_t port, size_t *size) {
+    *size = 0;
+    return 0;
+}
@@ -0,0 +1,63 @@
+/* MIT License
+*
+* Copyright (c) 2022 ma-lwa-re
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+
+#define CONFIG_IDF_TARGET       "host"
+#define CHIP_FEATURE_EMB_FLASH  (1 << 0)
+#define CHIP_FEATURE_BT         (1 << 4)
+#define CHIP_FEATURE_BLE        (1 << 5)
+#define ESP_OK                  (0)
+#define ESP_FAIL                (-1)
+#define ESP_ERR_TIMEOUT         (0x107)
+#define ESP_ERR_INVALID_CRC     (0x109)
+#define ESP_ERR_NVS_NO_FREE_PAGES       (0x1100 + 0x0d)
+#define ESP_ERR_NVS_NEW_VERSION_FOUND   (0x1100 + 0x10)
+#define ESP_ERROR_CHECK(x)      ((void) (x))
+#define ESP_ERROR_CHECK_WITHOUT_ABORT(x) (x)
+
+typedef int esp_err_t;
+
+typedef struct {
+    int model;
+    uint32_t features;
+    uint8_t cores;
+    uint8_t revision;
+} esp_chip_info_t;
+
+static inline void esp_chip_info(esp_chip_info_t *chip_info) {
+    *chip_info = (esp_chip_info_t) {.cores = 1};
+}
+
+static inline uint32_t esp_get_free_heap_size() {
+    return 0;
+}
+
+static inline uint32_t esp_get_minimum_free_heap_size() {
+    return 0;
+}
+
+static inline void esp_restart() {
+    exit(0);
+}
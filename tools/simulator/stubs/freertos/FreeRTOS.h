@@ -0,0 +1,57 @@
+/* MIT License
+*
+* Copyright (c) 2022 ma-lwa-re
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#define configMAX_PRIORITIES    (25)
+#define portMAX_DELAY           (0xFFFFFFFF)
+#define portTICK_PERIOD_MS      (10)
+#define pdTRUE                  (1)
+#define pdFALSE                 (0)
+#define pdPASS                  (pdTRUE)
+#define pdMS_TO_TICKS(ms)       ((TickType_t) ((ms) / portTICK_PERIOD_MS))
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef void *QueueHandle_t;
+typedef void *TaskHandle_t;
+typedef int portMUX_TYPE;
+
+// Spinlocks like on the two cores, the stress test runs the firmware from several threads
+#define portMUX_INITIALIZER_UNLOCKED    (0)
+#define portENTER_CRITICAL(mux)         while(__atomic_exchange_n((mux), 1, __ATOMIC_ACQUIRE)) {}
+#define portEXIT_CRITICAL(mux)          __atomic_store_n((mux), 0, __ATOMIC_RELEASE)
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size);
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks);
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks);
+
+BaseType_t xQueueReset(QueueHandle_t queue);
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue);
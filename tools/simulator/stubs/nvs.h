@@ -0,0 +1,47 @@
+/* MIT License
+*
+* Copyright (c) 2022 ma-lwa-re
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+#pragma once
+#include <stdint.h>
+#include "esp_system.h"
+
+#define ESP_FAIL                (-1)
+#define ESP_ERR_NVS_NOT_FOUND   (0x1100 + 0x02)
+#define NVS_KEY_NAME_MAX_SIZE   (16)
+
+typedef uint32_t nvs_handle_t;
+
+typedef enum {NVS_READONLY, NVS_READWRITE} nvs_open_mode_t;
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *handle);
+
+esp_err_t nvs_get_u16(nvs_handle_t handle, const char *key, uint16_t *value);
+
+esp_err_t nvs_set_u16(nvs_handle_t handle, const char *key, uint16_t value);
+
+esp_err_t nvs_commit(nvs_handle_t handle);
+
+void nvs_close(nvs_handle_t handle);
+
+static inline const char *esp_err_to_name(esp_err_t err) {
+    return err == ESP_OK ? "ESP_OK" : "ESP_FAIL";
+}